@@ -0,0 +1,95 @@
+#!/bin/bash
+# Benchmarks every I/O strategy on a synthetic snapshot over a grid of fractions and thread counts.
+# Run with `make benchmark'. Every setting can be overridden from the environment, e.g.,
+#   BENCH_NFILES=64 BENCH_NPART=4000000 BENCH_THREADS="1 8 32" BENCH_DIR=/scratch/bench make benchmark
+#
+# Writes one tab-separated line per run to BENCH_RESULTS (and stdout):
+#   strategy fraction threads nfiles npart_per_file id_bytes input_GB output_GB wall_s output_GB_per_s syscalls syscalls_per_GB status
+# where syscalls is the number of read + write system calls made by the run (from /proc/self/io)
+# and syscalls_per_GB is per GB of output (reads and writes submitted through io_uring are not counted).
+
+set -u
+
+BENCH_DIR=${BENCH_DIR:-benchmark_data}
+BENCH_NFILES=${BENCH_NFILES:-8}
+BENCH_NPART=${BENCH_NPART:-1000000}
+BENCH_ID_BYTES=${BENCH_ID_BYTES:-8}
+BENCH_FRACTIONS=${BENCH_FRACTIONS:-"0.001 0.01 0.1 0.5"}
+BENCH_THREADS=${BENCH_THREADS:-"1 4"}
+BENCH_STRATEGIES=${BENCH_STRATEGIES:-"pread mmap writev sendfile gather fused io_uring odirect copy_range auto"}
+BENCH_REPEATS=${BENCH_REPEATS:-1}
+BENCH_DROP_CACHES=${BENCH_DROP_CACHES:-0}   # 1 -> drop the page cache before every run (requires root)
+BENCH_RESULTS=${BENCH_RESULTS:-$BENCH_DIR/results.tsv}
+MAKE=${MAKE:-make}
+
+EXECUTABLE=subsample_Gadget_mmap_writev
+GENERATOR=generate_snapshot
+
+now() {
+    date +%s.%N
+}
+
+drop_caches() {
+    if [ "$BENCH_DROP_CACHES" = "1" ]; then
+        sync
+        echo 3 > /proc/sys/vm/drop_caches 2>/dev/null || echo "Warning: could not drop the page cache (not root?)" >&2
+    fi
+}
+
+total_bytes() {
+    local sum=0
+    for f in "$@"; do
+        [ -f "$f" ] && sum=$((sum + $(stat -c %s "$f")))
+    done
+    echo $sum
+}
+
+mkdir -p "$BENCH_DIR/bin" || exit 1
+snapshot="$BENCH_DIR/snap_${BENCH_NFILES}x${BENCH_NPART}_id${BENCH_ID_BYTES}"
+
+# The snapshot is only generated once for every (nfiles, npart, id bytes)
+if [ ! -f "$snapshot.$((BENCH_NFILES - 1))" ]; then
+    $MAKE $GENERATOR >/dev/null || exit 1
+    ./$GENERATOR --id-bytes="$BENCH_ID_BYTES" "$snapshot" "$BENCH_NFILES" "$BENCH_NPART" || exit 1
+fi
+input_bytes=$(total_bytes "$snapshot".*)
+
+# One executable runs every strategy (--io-strategy). The io_uring strategy is only built if the
+# kernel headers support it
+executable="$BENCH_DIR/bin/$EXECUTABLE"
+if $MAKE clean >/dev/null && $MAKE OPT="-DUSE_IO_URING" >/dev/null 2>"$BENCH_DIR/build.log"; then
+    :
+elif $MAKE clean >/dev/null && $MAKE OPT="" >/dev/null 2>>"$BENCH_DIR/build.log"; then
+    echo "Warning: could not build the io_uring strategy (see $BENCH_DIR/build.log)" >&2
+else
+    echo "Error: could not build $EXECUTABLE (see $BENCH_DIR/build.log)" >&2
+    exit 1
+fi
+mv $EXECUTABLE "$executable"
+$MAKE clean >/dev/null
+
+printf "strategy\tfraction\tthreads\tnfiles\tnpart_per_file\tid_bytes\tinput_GB\toutput_GB\twall_s\toutput_GB_per_s\tsyscalls\tsyscalls_per_GB\tstatus\n" | tee "$BENCH_RESULTS"
+for strategy in $BENCH_STRATEGIES; do
+    for fraction in $BENCH_FRACTIONS; do
+        for threads in $BENCH_THREADS; do
+            for repeat in $(seq 1 "$BENCH_REPEATS"); do
+                output="$BENCH_DIR/out_$strategy"
+                rm -f "$output".*
+                drop_caches
+                t0=$(now)
+                OMP_NUM_THREADS=$threads "$executable" --io-strategy="$strategy" "$fraction" "$snapshot" "$output" 2>"$BENCH_DIR/run.log"
+                status=$?
+                t1=$(now)
+                output_bytes=$(total_bytes "$output".*)
+                syscalls=$(awk '/I\/O system calls/ {print $(NF-3) + $NF}' "$BENCH_DIR/run.log")
+                awk -v b="$strategy" -v f="$fraction" -v t="$threads" -v nf="$BENCH_NFILES" -v np="$BENCH_NPART" -v idb="$BENCH_ID_BYTES" \
+                    -v ib="$input_bytes" -v ob="$output_bytes" -v t0="$t0" -v t1="$t1" -v sc="${syscalls:-0}" -v st="$status" 'BEGIN {
+                        gb = 1024.0*1024.0*1024.0; wall = t1 - t0; ogb = ob/gb;
+                        rate = (wall > 0) ? ogb/wall:0; per_gb = (ogb > 0) ? sc/ogb:0; result = (st == 0) ? "ok":"failed";
+                        printf "%s\t%s\t%s\t%s\t%s\t%s\t%.4f\t%.4f\t%.4f\t%.4f\t%d\t%.1f\t%s\n", b, f, t, nf, np, idb, ib/gb, ogb, wall,
+                               rate, sc, per_gb, result }' | tee -a "$BENCH_RESULTS"
+                rm -f "$output".*
+            done
+        done
+    done
+done
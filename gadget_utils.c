@@ -1,110 +1,67 @@
 #include <assert.h>
+#include <string.h>
 #include "gadget_utils.h"
 #include "utils.h"
+#include "macros.h"
 
 FILE * position_file_pointer(const char *file, const int type, const enum iofields field)
 {
-  FILE *fp = my_fopen(file,"r");
-  long bytes = 0;
-  size_t id_bytes = get_gadget_id_bytes(file);
-  struct io_header header = get_gadget_header(file);
-  int64_t nwithmass[6] = {0};
-  int64_t totnwithmass = 0;
+  const char labels[][GADGET_LABEL_LEN+1] = {"POS ", "VEL ", "ID  ", "MASS"};
+  struct gadget_block_index index;
+  int64_t bytes_per_part[6] = {0};
+
+  if(field < IO_POS || field > IO_MASS) {
+	  fprintf(stderr,"ERROR:IO_FIELD = %d is not implemented\n",field);
+	  exit(EXIT_FAILURE);
+  }
+  if(build_gadget_block_index(file, &index) != EXIT_SUCCESS) {
+	exit(EXIT_FAILURE);
+  }
+  const struct io_header header = index.header;
 
+  /* The mass field may not exist -> return NULL */
+  const struct gadget_block *block = find_gadget_block(&index, labels[field]);
+  if(block == NULL) {
+	return NULL;
+  }
+  
   switch(field)
 	{
 	case IO_POS:
-	  bytes += 4 + sizeof(struct io_header) + 4;
-	  bytes += 4;
-	  for(int k=0;k<type;k++) {
-		bytes += sizeof(float)*header.npart[k]*3 ;
-	  }
-	  break;
-	  
 	case IO_VEL:
-	  bytes += 4 + sizeof(struct io_header) + 4;
-	  bytes += 4;
-	  for(int k=0;k<6;k++) {
-		bytes += sizeof(float)*header.npart[k]*3 ;
-	  }
-	  bytes += 4;
-	  //All of the positions are accounted for. 
-
-	  bytes += 4; //for the padding for velocity
-	  for(int k=0;k<type;k++) {
-		bytes += sizeof(float)*header.npart[k]*3;
-	  }
-	  break;
-	  
-	case IO_ID:
-	  bytes += 4 + sizeof(struct io_header) + 4;
-	  bytes += 4;
-	  for(int k=0;k<6;k++) {
-		bytes += sizeof(float)*header.npart[k]*3 ;
-	  }
-	  bytes += 4;
-	  //All of the positions are accounted for. 
-
-	  //Account for all of the velocities
-	  bytes += 4; 
 	  for(int k=0;k<6;k++) {
-		bytes += sizeof(float)*header.npart[k]*3;
-	  }
-	  bytes += 4;
-	  
-	  bytes += 4;
-	  for(int k=0;k<type;k++) {
-		bytes += id_bytes*header.npart[k];
+		bytes_per_part[k] = sizeof(float)*3;
 	  }
 	  break;
 
-	  /* The mass field may not exist -> return NULL */
-	case IO_MASS:
-	  for(int k=0;k<6;k++){
-		if(header.mass[k] == 0.0) {
-		  nwithmass[k] += header.npart[k];
-		  totnwithmass += header.npart[k];
-		}
-	  }
-	  if(totnwithmass == 0) {
-		fclose(fp);
-		return NULL;
-	  } else {
-		bytes += 4 + sizeof(struct io_header) + 4;
-		bytes += 4;
-		for(int k=0;k<6;k++) {
-		  bytes += sizeof(float)*header.npart[k]*3 ;
-		}
-		bytes += 4;
-		//All of the positions are accounted for. 
-		
-		//Account for all of the velocities
-		bytes += 4; 
+	case IO_ID:
+	  {
+		int64_t totnpart = 0;
 		for(int k=0;k<6;k++) {
-		  bytes += sizeof(float)*header.npart[k]*3;
+		  totnpart += header.npart[k];
 		}
-		bytes += 4;
-		
-		//Account for the ids
-		bytes += 4;
 		for(int k=0;k<6;k++) {
-		  bytes += id_bytes*header.npart[k];
+		  bytes_per_part[k] = totnpart > 0 ? block->nbytes/totnpart:0;
 		}
-		bytes += 4;
-
+	  }
+	  break;
 
-		//Now skip the particles with mass
-		bytes +=4;
-		for(int k=0;k<type;k++) {
-		  bytes += sizeof(float)*nwithmass[k];
-		}
+	  /* Only the particles without a mass in the header are stored in the mass block */
+	case IO_MASS:
+	  for(int k=0;k<6;k++){
+		bytes_per_part[k] = (header.mass[k] == 0.0) ? sizeof(float):0;
 	  }
 	  break;
 
 	default:
-	  fprintf(stderr,"ERROR:IO_FIELD = %d is not implemented\n",field);
-	  exit(EXIT_FAILURE);
+	  break;
 	}
+
+  off_t bytes = block->offset;
+  for(int k=0;k<type;k++) {
+	bytes += bytes_per_part[k]*header.npart[k];
+  }
+  FILE *fp = my_fopen(file,"r");
   my_fseek(fp, bytes, SEEK_CUR);
   return fp;
 }
@@ -112,30 +69,42 @@ FILE * position_file_pointer(const char *file, const int type, const enum iofiel
 
 size_t get_gadget_id_bytes(const char *file)
 {
-  struct io_header header = get_gadget_header(file);
-  long bytes;
-  int dummy;
-  int64_t totnpart=0;
-  size_t id_bytes=0;
-  FILE *fp = my_fopen(file,"r");
-  for(int k=0;k<6;k++) {
-	totnpart += header.npart[k];
+  struct gadget_block_index index;
+  if(build_gadget_block_index(file, &index) != EXIT_SUCCESS) {
+	exit(EXIT_FAILURE);
   }
-  assert(totnpart > 0 && "There exist particles in the snapshot file");
-  
-  bytes =  4 + sizeof(struct io_header)  + 4;
-  bytes += 4 + sizeof(float)*3*totnpart  + 4;
-  bytes += 4 + sizeof(float)*3*totnpart  + 4;
-  my_fseek(fp, bytes, SEEK_CUR);
-  my_fread(&dummy, sizeof(dummy), 1, fp);
-  fclose(fp);
-  id_bytes = dummy/totnpart;
+  const size_t id_bytes = get_gadget_id_bytes_from_index(&index);
   assert((id_bytes == 4 || id_bytes == 8 ) && "ID bytes are 4 or 8 bytes");
   return id_bytes;
 }
 
+/* Bytes per particle ID from the size of the ID block (0 if there are no particles or no IDs) */
+size_t get_gadget_id_bytes_from_index(const struct gadget_block_index *index)
+{
+  int64_t totnpart=0;
+  for(int k=0;k<6;k++) {
+	totnpart += index->header.npart[k];
+  }
+  const struct gadget_block *block = find_gadget_block(index, "ID");
+  if(totnpart == 0 || block == NULL) {
+	return 0;
+  }
+  return block->nbytes/totnpart;
+}
+
 
-//assumes Gadget snapshot format=1
+/* Format-2 files have a label record before the header. Called after reading the first
+   4 bytes into dummy -> skips the label record (if present) and reads the padding for the header */
+static void skip_gadget_label_record(FILE *fp, int *dummy)
+{
+  if(*dummy == GADGET_LABEL_LEN + 4) {
+	fseek(fp, GADGET_LABEL_RECORD_BYTES - sizeof(*dummy), SEEK_CUR);
+	fread(dummy, sizeof(*dummy), 1, fp);
+  }
+}
+
+
+//works for Gadget snapshot format=1 and format=2
 struct io_header get_gadget_header(const char *fname)
 {
   FILE *fp=NULL;
@@ -156,6 +125,7 @@ struct io_header get_gadget_header(const char *fname)
 
   //// Don't really care which file actually succeeded (as long as one, buf or buf1, is present)
   fread(&dummy, sizeof(dummy), 1, fp);
+  skip_gadget_label_record(fp, &dummy);
   fread(&header, sizeof(header), 1, fp);
   fread(&dummy, sizeof(dummy), 1, fp);
   fclose(fp);
@@ -183,6 +153,7 @@ int get_gadget_nfiles(const char *fname)
 
   //// Don't really care which file actually succeeded (as long as one, buf or buf1, is present)
   fread(&dummy, sizeof(dummy), 1, fp);
+  skip_gadget_label_record(fp, &dummy);
   fread(&header, sizeof(header), 1, fp);
   fread(&dummy, sizeof(dummy), 1, fp);
   fclose(fp);
@@ -204,3 +175,212 @@ int64_t get_Numpart(struct io_header *header)
 
   return N;
 }
+
+
+/* Overwrites the total number of particles (and the mass) of `type' in the header of an
+   existing snapshot file. Used when the number of particles is only known once all of
+   the files have been written */
+int update_gadget_header_npartTotal(const char *file, const int type, const int64_t nparttotal, const double mass)
+{
+  struct io_header header;
+  int dummy;
+  FILE *fp = my_fopen(file,"r+");
+  if(fp == NULL) {
+    return EXIT_FAILURE;
+  }
+  if(my_fread(&dummy, sizeof(dummy), 1, fp) != 1) {
+    fclose(fp);
+    return EXIT_FAILURE;
+  }
+  skip_gadget_label_record(fp, &dummy);
+  const long header_offset = ftell(fp);
+  if(my_fread(&header, sizeof(header), 1, fp) != 1) {
+    fclose(fp);
+    return EXIT_FAILURE;
+  }
+  assert(dummy == sizeof(header) && "Padding bytes for the header must be 256");
+  header.npartTotal[type] = (uint32_t) nparttotal;
+  header.npartTotalHighWord[type] = (uint32_t) (nparttotal >> 32);
+  header.mass[type] = mass;
+
+  int status = my_fseek(fp, header_offset, SEEK_SET);
+  if(status == 0 && my_fwrite(&header, sizeof(header), 1, fp) != 1) {
+    status = EXIT_FAILURE;
+  }
+  if(fclose(fp) != 0) {
+    perror(NULL);
+    status = EXIT_FAILURE;
+  }
+  return status == 0 ? EXIT_SUCCESS:EXIT_FAILURE;
+}
+
+
+/* Returns 2 for files with labelled blocks, 1 for plain fortran blocks (-1 on error) */
+int get_gadget_snapformat(const char *file)
+{
+  int dummy;
+  FILE *fp = my_fopen(file,"r");
+  if(fp == NULL) {
+    return -1;
+  }
+  const size_t nread = my_fread(&dummy, sizeof(dummy), 1, fp);
+  fclose(fp);
+  if(nread != 1) {
+    return -1;
+  }
+  return dummy == GADGET_LABEL_LEN + 4 ? 2:1;
+}
+
+/* Labels are stored as exactly 4 chars -> shorter labels are padded with spaces */
+static void normalize_gadget_label(const char *label, char *dest)
+{
+  int i;
+  for(i=0;i<GADGET_LABEL_LEN && label[i] != '\0';i++) {
+    dest[i] = label[i];
+  }
+  for(;i<GADGET_LABEL_LEN;i++) {
+    dest[i] = ' ';
+  }
+  dest[GADGET_LABEL_LEN] = '\0';
+}
+
+static int gadget_label_slot(const char *label)
+{
+  uint32_t key;
+  memcpy(&key, label, sizeof(key));
+  return (int) ((key * 2654435761u) >> (32 - GADGET_LOOKUP_BITS));
+}
+
+const struct gadget_block * find_gadget_block(const struct gadget_block_index *index, const char *label)
+{
+  char name[GADGET_LABEL_LEN+1];
+  normalize_gadget_label(label, name);
+  const int mask = (1 << GADGET_LOOKUP_BITS) - 1;
+  for(int slot=gadget_label_slot(name);index->lookup[slot] >= 0;slot=(slot+1) & mask) {
+    const struct gadget_block *block = &(index->blocks[(int) index->lookup[slot]]);
+    if(memcmp(block->label, name, GADGET_LABEL_LEN) == 0) {
+      return block;
+    }
+  }
+  return NULL;
+}
+
+static int add_gadget_block(struct gadget_block_index *index, const char *label, const off_t offset, const int64_t nbytes)
+{
+  XRETURN(index->nblocks < GADGET_MAXBLOCKS, EXIT_FAILURE, "Snapshot contains more than GADGET_MAXBLOCKS = %d blocks\n", GADGET_MAXBLOCKS);
+  struct gadget_block *block = &(index->blocks[index->nblocks]);
+  normalize_gadget_label(label, block->label);
+  block->offset = offset;
+  block->nbytes = nbytes;
+  if(find_gadget_block(index, block->label) != NULL) {
+    fprintf(stderr,"Warning: Block `%s' appears more than once. Only the first one can be looked up by name\n", block->label);
+  } else {
+    const int mask = (1 << GADGET_LOOKUP_BITS) - 1;
+    int slot = gadget_label_slot(block->label);
+    while(index->lookup[slot] >= 0) {
+      slot = (slot + 1) & mask;
+    }
+    index->lookup[slot] = (int8_t) index->nblocks;
+  }
+  index->nblocks++;
+  return EXIT_SUCCESS;
+}
+
+/* Scans the padding bytes (and the labels for format-2) of every block in the file */
+int build_gadget_block_index(const char *file, struct gadget_block_index *index)
+{
+  const char format1_labels[][GADGET_LABEL_LEN+1] = {"HEAD", "POS ", "VEL ", "ID  ", "MASS"};
+  index->nblocks = 0;
+  memset(index->lookup, -1, sizeof(index->lookup));
+  index->snapformat = get_gadget_snapformat(file);
+  if(index->snapformat < 0) {
+    return EXIT_FAILURE;
+  }
+
+  FILE *fp = my_fopen(file,"r");
+  if(fp == NULL) {
+    return EXIT_FAILURE;
+  }
+  int status = EXIT_SUCCESS;
+  int has_mass_block = 0;
+  off_t offset = 0;
+  while(status == EXIT_SUCCESS) {
+    char label[GADGET_LABEL_LEN+1] = {'\0'};
+    uint32_t dummy1, dummy2;
+    if(index->snapformat == 2) {
+      char record[GADGET_LABEL_RECORD_BYTES];
+      const size_t nread = fread(record, 1, sizeof(record), fp);
+      if(nread == 0 && feof(fp)) {
+        break;
+      }
+      int32_t pad1, pad2;
+      memcpy(&pad1, record, sizeof(pad1));
+      memcpy(&pad2, record + GADGET_LABEL_RECORD_BYTES - sizeof(pad2), sizeof(pad2));
+      if(nread != sizeof(record) || pad1 != GADGET_LABEL_LEN + 4 || pad2 != GADGET_LABEL_LEN + 4) {
+        fprintf(stderr,"Error: Invalid block label record at offset %zu in file `%s'\n", (size_t) offset, file);
+        status = EXIT_FAILURE;
+        break;
+      }
+      memcpy(label, record + sizeof(pad1), GADGET_LABEL_LEN);
+      offset += GADGET_LABEL_RECORD_BYTES;
+    }
+    if(fread(&dummy1, sizeof(dummy1), 1, fp) != 1) {
+      if(index->snapformat == 1 && feof(fp)) {
+        break;
+      }
+      fprintf(stderr,"Error: Could not read the padding bytes at offset %zu in file `%s'\n", (size_t) offset, file);
+      status = EXIT_FAILURE;
+      break;
+    }
+    if(fseeko(fp, dummy1, SEEK_CUR) != 0 || fread(&dummy2, sizeof(dummy2), 1, fp) != 1 || dummy1 != dummy2) {
+      fprintf(stderr,"Error: Block starting at offset %zu in file `%s' is truncated or the padding bytes do not match\n", (size_t) offset, file);
+      status = EXIT_FAILURE;
+      break;
+    }
+
+    if(index->snapformat == 1) {
+      const int nknown = has_mass_block ? 5:4;
+      if(index->nblocks < nknown) {
+        memcpy(label, format1_labels[index->nblocks], GADGET_LABEL_LEN);
+      } else {
+        my_snprintf(label, sizeof(label), "B%03d", index->nblocks);
+      }
+    }
+    if(index->nblocks == 0) {
+      //keep the header. The masses are only stored in the file if the header mass is 0 for some particle type present
+      struct io_header *header = &(index->header);
+      if(dummy1 != sizeof(*header)) {
+        fprintf(stderr,"Error: Padding bytes for the header = %u should be exactly 256 (file `%s')\n", dummy1, file);
+        status = EXIT_FAILURE;
+        break;
+      }
+      if(fseeko(fp, offset + sizeof(dummy1), SEEK_SET) != 0 || my_fread(header, sizeof(*header), 1, fp) != 1 ||
+         fseeko(fp, sizeof(dummy2), SEEK_CUR) != 0) {
+        status = EXIT_FAILURE;
+        break;
+      }
+      for(int k=0;k<6;k++) {
+        if(header->npart[k] > 0 && header->mass[k] == 0.0) {
+          has_mass_block = 1;
+        }
+      }
+    }
+    status = add_gadget_block(index, label, offset + sizeof(dummy1), dummy1);
+    offset += sizeof(dummy1) + (off_t) dummy1 + sizeof(dummy2);
+  }
+  fclose(fp);
+  return status;
+}
+
+/* Fills the 16 byte format-2 label record for a block containing nbytes (excluding the padding) */
+void fill_gadget_label_record(char *dest, const char *label, const int64_t nbytes)
+{
+  const int32_t pad = GADGET_LABEL_LEN + 4;
+  const int32_t nextblock = (int32_t) (nbytes + 8);
+  char name[GADGET_LABEL_LEN+1];
+  normalize_gadget_label(label, name);
+  memcpy(dest, &pad, sizeof(pad));
+  memcpy(dest + sizeof(pad), name, GADGET_LABEL_LEN);
+  memcpy(dest + sizeof(pad) + GADGET_LABEL_LEN, &nextblock, sizeof(nextblock));
+  memcpy(dest + sizeof(pad) + GADGET_LABEL_LEN + sizeof(nextblock), &pad, sizeof(pad));
+}
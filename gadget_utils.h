@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #include "gadget_headers.h"
 
@@ -28,9 +29,47 @@ enum iofields           /*!< this enumeration lists the defined output blocks in
 
 
 
+/* Format-2 (SnapFormat=2) files precede every block with a 16 byte label record:
+   [int 8] [char label[4]] [int block size + 8] [int 8] */
+#define GADGET_LABEL_LEN            4
+#define GADGET_LABEL_RECORD_BYTES   (4 + GADGET_LABEL_LEN + 4 + 4)
+
+#ifndef GADGET_MAXBLOCKS
+#define GADGET_MAXBLOCKS            32
+#endif
+
+/* Size (as a power of 2) of the open-addressing table that maps a label to a block */
+#define GADGET_LOOKUP_BITS          6
+
+struct gadget_block
+{
+  char label[GADGET_LABEL_LEN+1];//4 chars, padded with spaces (e.g., "ID  ")
+  off_t offset;//offset of the first data byte (i.e., after the leading fortran padding)
+  int64_t nbytes;//number of data bytes (excluding the fortran padding)
+};
+
+/* Location of every block in one snapshot file. Built with a single scan over the
+   padding bytes (and labels); the data are never read. Format-1 files do not contain
+   labels -> the blocks are named HEAD, POS, VEL, ID, MASS (if the masses are stored
+   in the file) in the order they appear and the remaining ones are named Bnnn. The
+   header is read during the scan and kept with the index */
+struct gadget_block_index
+{
+  struct io_header header;
+  int snapformat;
+  int nblocks;
+  struct gadget_block blocks[GADGET_MAXBLOCKS];
+  int8_t lookup[1 << GADGET_LOOKUP_BITS];//index into blocks (-1 for empty slots)
+};
+
 struct io_header get_gadget_header(const char *fname);
 int get_gadget_nfiles(const char *fname);
 int64_t get_Numpart(struct io_header *header);
 FILE * position_file_pointer(const char *file, const int type, const enum iofields field);
 size_t get_gadget_id_bytes(const char *file);
-
+size_t get_gadget_id_bytes_from_index(const struct gadget_block_index *index);
+int update_gadget_header_npartTotal(const char *file, const int type, const int64_t nparttotal, const double mass);
+int get_gadget_snapformat(const char *file);
+int build_gadget_block_index(const char *file, struct gadget_block_index *index);
+const struct gadget_block * find_gadget_block(const struct gadget_block_index *index, const char *label);
+void fill_gadget_label_record(char *dest, const char *label, const int64_t nbytes);
@@ -0,0 +1,187 @@
+/* File: generate_snapshot.c */
+
+/* Writes a synthetic dark-matter only (format-1) Gadget snapshot <basename>.<i> with uniform
+   random positions and velocities and consecutive IDs -> input for the I/O benchmarks */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <inttypes.h>
+
+#include <gsl/gsl_rng.h>
+
+#include "gadget_headers.h"
+#include "gadget_utils.h"
+#include "utils.h"
+#include "macros.h"
+
+/* Number of particles generated (and written) per block */
+#ifndef GENERATE_CHUNKSIZE
+#define GENERATE_CHUNKSIZE  (1 << 16)
+#endif
+
+static int write_fortran_block_marker(FILE *fp, const size_t nbytes)
+{
+  const int32_t dummy = (int32_t) nbytes;
+  return my_fwrite((void *) &dummy, sizeof(dummy), 1, fp) == 1 ? EXIT_SUCCESS:EXIT_FAILURE;
+}
+
+/* The particles in file ifile get the IDs [id_offset + 1, id_offset + npart] */
+static int generate_gadget_file(const char *fname, const struct io_header *header, const size_t id_bytes, const int64_t id_offset,
+                                const gsl_rng *rng, float *fbuf, char *idbuf)
+{
+  const int64_t npart = header->npart[1];
+  const size_t field_bytes = (size_t) npart * 3 * sizeof(float);
+  XRETURN(npart * id_bytes < INT32_MAX && field_bytes < INT32_MAX, EXIT_FAILURE,
+          "Block sizes for %"PRId64" particles overflow the 4-byte fortran markers\n", npart);
+
+  FILE *fp = my_fopen(fname, "w");
+  if(fp == NULL) {
+    return EXIT_FAILURE;
+  }
+  int status = write_fortran_block_marker(fp, sizeof(*header));
+  status |= my_fwrite((void *) header, sizeof(*header), 1, fp) == 1 ? EXIT_SUCCESS:EXIT_FAILURE;
+  status |= write_fortran_block_marker(fp, sizeof(*header));
+
+  //POS then VEL
+  for(int field=0;field<2 && status == EXIT_SUCCESS;field++) {
+    const double scale = field == 0 ? header->BoxSize:1000.0;
+    const double shift = field == 0 ? 0.0:-500.0;
+    status |= write_fortran_block_marker(fp, field_bytes);
+    for(int64_t i=0;i<npart && status == EXIT_SUCCESS;i+=GENERATE_CHUNKSIZE) {
+      const int64_t n = (npart - i) < GENERATE_CHUNKSIZE ? (npart - i):GENERATE_CHUNKSIZE;
+      for(int64_t j=0;j<3*n;j++) {
+        fbuf[j] = (float) (shift + scale * gsl_rng_uniform(rng));
+      }
+      status |= my_fwrite(fbuf, sizeof(float), 3*n, fp) == (size_t) (3*n) ? EXIT_SUCCESS:EXIT_FAILURE;
+    }
+    status |= write_fortran_block_marker(fp, field_bytes);
+  }
+
+  //ID
+  status |= write_fortran_block_marker(fp, npart * id_bytes);
+  for(int64_t i=0;i<npart && status == EXIT_SUCCESS;i+=GENERATE_CHUNKSIZE) {
+    const int64_t n = (npart - i) < GENERATE_CHUNKSIZE ? (npart - i):GENERATE_CHUNKSIZE;
+    for(int64_t j=0;j<n;j++) {
+      const uint64_t id = id_offset + i + j + 1;
+      if(id_bytes == 4) {
+        ((uint32_t *) idbuf)[j] = (uint32_t) id;
+      } else {
+        ((uint64_t *) idbuf)[j] = id;
+      }
+    }
+    status |= my_fwrite(idbuf, id_bytes, n, fp) == (size_t) n ? EXIT_SUCCESS:EXIT_FAILURE;
+  }
+  status |= write_fortran_block_marker(fp, npart * id_bytes);
+
+  if(fclose(fp) != 0) {
+    status = EXIT_FAILURE;
+  }
+  if(status != EXIT_SUCCESS) {
+    fprintf(stderr,"Error: Could not write the synthetic snapshot file `%s'\n", fname);
+  }
+  return status;
+}
+
+int main(int argc, char **argv)
+{
+  size_t id_bytes = 8;
+  double boxsize = 100.0;
+  unsigned long seed = 42;
+
+  const struct option long_options[] = {
+    {"id-bytes", required_argument, NULL, 'i'},
+    {"boxsize", required_argument, NULL, 'b'},
+    {"seed", required_argument, NULL, 'r'},
+    {NULL, 0, NULL, 0}
+  };
+  int opt, bad_option=0;
+  while((opt = getopt_long(argc, argv, "i:b:r:", long_options, NULL)) != -1) {
+    switch(opt) {
+    case 'i':
+      id_bytes = (size_t) atoi(optarg);
+      if(id_bytes != 4 && id_bytes != 8) {
+        fprintf(stderr,"Error: ID bytes = `%s' must be 4 or 8\n", optarg);
+        bad_option = 1;
+      }
+      break;
+    case 'b':
+      boxsize = atof(optarg);
+      if(boxsize <= 0.0) {
+        fprintf(stderr,"Error: boxsize = `%s' must be positive\n", optarg);
+        bad_option = 1;
+      }
+      break;
+    case 'r':
+      seed = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      bad_option = 1;
+      break;
+    }
+  }
+  if(argc - optind != 3 || bad_option) {
+    fprintf(stderr,"ERROR: %s usage - [options] <output basename> <number of files> <number of particles per file>\n", argv[0]);
+    fprintf(stderr,"Writes a synthetic format-1 Gadget snapshot (dark matter only) to <output basename>.<i>\n");
+    fprintf(stderr,"Options:\n");
+    fprintf(stderr,"\t -i, --id-bytes=<4|8>        width of the particle IDs (default %zu)\n", id_bytes);
+    fprintf(stderr,"\t -b, --boxsize=<double>      size of the periodic box (default %g)\n", boxsize);
+    fprintf(stderr,"\t -r, --seed=<unsigned long>  seed for the positions and velocities (default %lu)\n", seed);
+    return EXIT_FAILURE;
+  }
+  const char *basename = argv[optind];
+  const int nfiles = atoi(argv[optind+1]);
+  const int64_t npart_per_file = atoll(argv[optind+2]);
+  XRETURN(nfiles > 0 && npart_per_file > 0 && npart_per_file < INT32_MAX, EXIT_FAILURE,
+          "Number of files = %d and particles per file = %"PRId64" must be positive\n", nfiles, npart_per_file);
+
+  const uint64_t nparttotal = (uint64_t) nfiles * npart_per_file;
+  struct io_header header;
+  memset(&header, 0, sizeof(header));
+  header.npart[1] = (int32_t) npart_per_file;
+  header.npartTotal[1] = (uint32_t) nparttotal;
+  header.npartTotalHighWord[1] = (uint32_t) (nparttotal >> 32);
+  header.num_files = nfiles;
+  header.BoxSize = boxsize;
+  header.Omega0 = 0.3;
+  header.OmegaLambda = 0.7;
+  header.HubbleParam = 0.7;
+  header.time = 1.0;
+  header.redshift = 0.0;
+  //the critical density (in 1e10 Msun/h / (Mpc/h)^3) -> the mass of every particle for the given box
+  header.mass[1] = 27.7536627 * header.Omega0 * boxsize * boxsize * boxsize / (double) nparttotal;
+
+  int errorflag = 0;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for(int ifile=0;ifile<nfiles;ifile++) {
+    float *fbuf = malloc(3 * GENERATE_CHUNKSIZE * sizeof(*fbuf));
+    char *idbuf = malloc(GENERATE_CHUNKSIZE * id_bytes);
+    gsl_rng *rng = gsl_rng_alloc(gsl_rng_mt19937);
+    char fname[MAXLEN];
+    if(fbuf == NULL || idbuf == NULL || rng == NULL) {
+      fprintf(stderr,"Error: Could not allocate memory to generate file %d\n", ifile);
+      errorflag = 1;
+    } else {
+      //every file has its own stream -> the snapshot does not depend on the number of threads
+      gsl_rng_set(rng, seed + ifile);
+      my_snprintf(fname, MAXLEN, "%s.%d", basename, ifile);
+      if(generate_gadget_file(fname, &header, id_bytes, ifile * npart_per_file, rng, fbuf, idbuf) != EXIT_SUCCESS) {
+        errorflag = 1;
+      }
+    }
+    free(fbuf);
+    free(idbuf);
+    if(rng != NULL) {
+      gsl_rng_free(rng);
+    }
+  }
+  if(errorflag != 0) {
+    return EXIT_FAILURE;
+  }
+  fprintf(stderr,"Wrote %"PRIu64" particles (%zu byte IDs) to %d files `%s.<i>'\n", nparttotal, id_bytes, nfiles, basename);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,378 @@
+/* File: id_index.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "id_index.h"
+#include "snapshot_layout.h"
+#include "utils.h"
+#include "macros.h"
+
+/* LSD radix sort on 8-bit digits. The histograms of all the digits are counted in one pass and
+   the digits that are the same for every ID are skipped */
+static int radix_sort_ids(uint64_t *ids, const int64_t nids)
+{
+  int64_t counts[8][256] = {{0}};
+  for(int64_t i=0;i<nids;i++) {
+    for(int d=0;d<8;d++) {
+      counts[d][(ids[i] >> (8*d)) & 0xFF]++;
+    }
+  }
+  uint64_t *tmp = NULL;
+  uint64_t *src = ids, *dst = NULL;
+  for(int d=0;d<8;d++) {
+    if(nids == 0 || counts[d][(ids[0] >> (8*d)) & 0xFF] == nids) {
+      continue;
+    }
+    if(tmp == NULL) {
+      tmp = malloc(nids * sizeof(*tmp));
+      XRETURN(tmp != NULL, EXIT_FAILURE, "Could not allocate memory to sort %"PRId64" IDs\n", nids);
+      dst = tmp;
+    }
+    int64_t offset = 0;
+    for(int b=0;b<256;b++) {
+      const int64_t n = counts[d][b];
+      counts[d][b] = offset;
+      offset += n;
+    }
+    for(int64_t i=0;i<nids;i++) {
+      dst[counts[d][(src[i] >> (8*d)) & 0xFF]++] = src[i];
+    }
+    uint64_t *swap = src;
+    src = dst;
+    dst = swap;
+  }
+  if(src != ids) {
+    memcpy(ids, src, nids * sizeof(*ids));
+  }
+  free(tmp);
+  return EXIT_SUCCESS;
+}
+
+/* Bit of the filter that covers id (the caller checks that id is inside [min_id, max_id]) */
+static inline uint64_t id_filter_bit(const struct id_index *idx, const uint64_t id)
+{
+  return (id - idx->min_id) >> idx->filter_shift;
+}
+
+/* Fills the subtree rooted at keys[k] with the sorted IDs starting at sorted[i] (in-order traversal).
+   Returns the index of the first ID that was not used */
+static int64_t fill_eytzinger(const uint64_t *sorted, uint64_t *keys, int64_t i, const int64_t k, const int64_t n)
+{
+  if(k <= n) {
+    i = fill_eytzinger(sorted, keys, i, 2*k, n);
+    keys[k] = sorted[i++];
+    i = fill_eytzinger(sorted, keys, i, 2*k + 1, n);
+  }
+  return i;
+}
+
+int build_id_index(struct id_index *idx, uint64_t *ids, const int64_t nids)
+{
+  memset(idx, 0, sizeof(*idx));
+  idx->nlevels = 1;
+  if(radix_sort_ids(ids, nids) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  int64_t nunique = 0;
+  for(int64_t i=0;i<nids;i++) {
+    if(nunique == 0 || ids[i] != ids[nunique-1]) {
+      ids[nunique++] = ids[i];
+    }
+  }
+  idx->nids = nunique;
+  idx->nlevel_ids[0] = nunique;
+  idx->min_id = nunique > 0 ? ids[0]:1;
+  idx->max_id = nunique > 0 ? ids[nunique-1]:0;
+  while(idx->height < 63 && (INT64_C(1) << idx->height) <= nunique) {
+    idx->height++;
+  }
+
+  //the keys are aligned to a cache line -> keys[8k..8k+7] (the descendants of keys[k] three levels down) share one line
+  void *keys = NULL;
+  XRETURN(posix_memalign(&keys, 64, (nunique + 1) * sizeof(*ids)) == 0, EXIT_FAILURE,
+          "Could not allocate memory for the %"PRId64" IDs of the index\n", nunique);
+  idx->keys = (uint64_t *) keys;
+  idx->keys[0] = 0;
+  fill_eytzinger(ids, idx->keys, 0, 1, nunique);
+  free(ids);
+
+  //the smallest shift that covers the range of IDs with (at most) ID_INDEX_FILTER_BITS_PER_ID bits per ID
+  const uint64_t span = nunique > 0 ? idx->max_id - idx->min_id:0;
+  const uint64_t max_bits = (uint64_t) (nunique > 0 ? nunique:1) * ID_INDEX_FILTER_BITS_PER_ID;
+  while(idx->filter_shift < 63 && (span >> idx->filter_shift) >= max_bits) {
+    idx->filter_shift++;
+  }
+  const uint64_t nwords = (span >> idx->filter_shift)/64 + 1;
+  idx->filter = calloc(nwords, sizeof(*(idx->filter)));
+  XRETURN(idx->filter != NULL, EXIT_FAILURE, "Could not allocate memory for the filter of the ID index (%"PRIu64" words)\n", nwords);
+  for(int64_t k=1;k<=nunique;k++) {
+    const uint64_t bit = id_filter_bit(idx, idx->keys[k]);
+    idx->filter[bit >> 6] |= UINT64_C(1) << (bit & 63);
+  }
+  return EXIT_SUCCESS;
+}
+
+int64_t id_index_find(const struct id_index *idx, const uint64_t id)
+{
+  if(id < idx->min_id || id > idx->max_id) {
+    return -1;
+  }
+  const uint64_t bit = id_filter_bit(idx, id);
+  if(((idx->filter[bit >> 6] >> (bit & 63)) & 1) == 0) {
+    return -1;
+  }
+  const int64_t n = idx->nids;
+  int64_t k = 1;
+  while(k <= n) {
+    k = 2*k + (idx->keys[k] < id);
+  }
+  //the trailing 1-bits are the steps to the right after the last step to the left -> k is the first key >= id
+  k >>= __builtin_ffsll(~k);
+  return (k > 0 && idx->keys[k] == id) ? k:-1;
+}
+
+/* Reads the IDs of every file <basename>.<ifile> (in parallel) into one array */
+static int read_snapshot_ids(const char *basename, uint64_t **ids, int64_t *nids, double *mass)
+{
+  struct snapshot_layout layout;
+  if(build_snapshot_layout(basename, NULL, &layout) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  int64_t *offsets = malloc((layout.nfiles + 1) * sizeof(*offsets));
+  XRETURN(offsets != NULL, EXIT_FAILURE, "Could not allocate memory for the offsets of %d files\n", layout.nfiles);
+  offsets[0] = 0;
+  for(int ifile=0;ifile<layout.nfiles;ifile++) {
+    offsets[ifile+1] = offsets[ifile] + layout.files[ifile].index.header.npart[1];
+  }
+  *nids = offsets[layout.nfiles];
+  *mass = layout.files[0].index.header.mass[1];
+  *ids = malloc((*nids > 0 ? *nids:1) * sizeof(**ids));
+  XRETURN(*ids != NULL, EXIT_FAILURE, "Could not allocate memory for the %"PRId64" IDs of `%s'\n", *nids, basename);
+
+  int errorflag = 0;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for(int ifile=0;ifile<layout.nfiles;ifile++) {
+    const int64_t npart = offsets[ifile+1] - offsets[ifile];
+    if(npart == 0 || errorflag) {
+      continue;
+    }
+    char fname[MAXLEN];
+    my_snprintf(fname, MAXLEN, "%s.%d", basename, ifile);
+    const size_t id_bytes = layout.files[ifile].id_bytes;
+    const struct gadget_block *block = find_gadget_block(&(layout.files[ifile].index), "ID");
+    const int fd = open(fname, O_RDONLY);
+    if(block == NULL || (id_bytes != 4 && id_bytes != 8) || fd < 0) {
+      fprintf(stderr,"Error: Could not read the IDs of the file `%s'\n", fname);
+      errorflag = 1;
+      if(fd >= 0) {
+        close(fd);
+      }
+      continue;
+    }
+    //4-byte IDs are read into the upper half of the range and widened from the front
+    uint64_t *dest = *ids + offsets[ifile];
+    char *buf = (char *) dest + (8 - id_bytes)*npart;
+    const size_t nbytes = id_bytes*npart;
+    size_t bytes_read = 0;
+    while(bytes_read < nbytes) {
+      const ssize_t n = pread(fd, buf + bytes_read, nbytes - bytes_read, block->offset + bytes_read);
+      if(n <= 0) {
+        break;
+      }
+      bytes_read += n;
+    }
+    close(fd);
+    if(bytes_read != nbytes) {
+      fprintf(stderr,"Error: Expected to read %zu bytes of IDs from `%s' but read %zu bytes instead\n", nbytes, fname, bytes_read);
+      errorflag = 1;
+      continue;
+    }
+    if(id_bytes == 4) {
+      for(int64_t i=0;i<npart;i++) {
+        uint32_t id;
+        memcpy(&id, buf + i*sizeof(id), sizeof(id));
+        dest[i] = id;
+      }
+    }
+  }
+  free(offsets);
+  free_snapshot_layout(&layout);
+  if(errorflag) {
+    free(*ids);
+    *ids = NULL;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+int build_id_index_from_snapshots(struct id_index *idx, const int nlevels, char (*basenames)[MAXLEN])
+{
+  XRETURN(nlevels > 0 && nlevels <= MAX_SUBSAMPLE_LEVELS, EXIT_FAILURE, "Number of levels = %d must be in [1, %d]\n",
+          nlevels, MAX_SUBSAMPLE_LEVELS);
+  uint64_t *ids = NULL;
+  int64_t nids = 0;
+  double mass = 0.0;
+  if(read_snapshot_ids(basenames[0], &ids, &nids, &mass) != EXIT_SUCCESS ||
+     build_id_index(idx, ids, nids) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  XRETURN(idx->nids == nids, EXIT_FAILURE, "Found %"PRId64" duplicate IDs in `%s'\n", nids - idx->nids, basenames[0]);
+  idx->nlevels = nlevels;
+  idx->mass[0] = mass;
+  my_snprintf(idx->source, MAXLEN, "%s", basenames[0]);
+  if(nlevels == 1) {
+    return EXIT_SUCCESS;
+  }
+
+  //the deeper levels are nested -> each ID is looked up in the first level and its depth bumped
+  idx->depth = calloc(idx->nids + 1, sizeof(*(idx->depth)));
+  XRETURN(idx->depth != NULL, EXIT_FAILURE, "Could not allocate memory for the depth of %"PRId64" IDs\n", idx->nids);
+  for(int level=1;level<nlevels;level++) {
+    if(read_snapshot_ids(basenames[level], &ids, &nids, &(idx->mass[level])) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+    }
+    int64_t nmissing = 0;
+#ifdef _OPENMP
+#pragma omp parallel for reduction(+:nmissing)
+#endif
+    for(int64_t i=0;i<nids;i++) {
+      const int64_t pos = id_index_find(idx, ids[i]);
+      if(pos < 0 || idx->depth[pos] != level - 1) {
+        nmissing++;
+        continue;
+      }
+      idx->depth[pos] = level;
+    }
+    free(ids);
+    XRETURN(nmissing == 0, EXIT_FAILURE, "%"PRId64" IDs of `%s' are not in `%s' (the levels must be nested)\n",
+            nmissing, basenames[level], basenames[level-1]);
+    idx->nlevel_ids[level] = nids;
+  }
+  return EXIT_SUCCESS;
+}
+
+int load_id_list(struct id_index *idx, const char *fname, const size_t id_bytes)
+{
+  XRETURN(id_bytes == 4 || id_bytes == 8, EXIT_FAILURE, "ID bytes = %zu must be either 4 or 8\n", id_bytes);
+  FILE *fp = my_fopen(fname, "r");
+  if(fp == NULL) {
+    return EXIT_FAILURE;
+  }
+  struct stat sb;
+  const int status = fstat(fileno(fp), &sb);
+  const int64_t nids = sb.st_size/id_bytes;
+  XRETURN(status == 0 && nids*(int64_t) id_bytes == sb.st_size, EXIT_FAILURE,
+          "The ID list `%s' must contain a whole number of %zu-byte IDs\n", fname, id_bytes);
+  //4-byte IDs are read into the upper half of the array and widened from the front
+  uint64_t *ids = malloc((nids > 0 ? nids:1) * sizeof(*ids));
+  XRETURN(ids != NULL, EXIT_FAILURE, "Could not allocate memory for the %"PRId64" IDs in `%s'\n", nids, fname);
+  char *buf = (char *) ids + (8 - id_bytes)*nids;
+  XRETURN(my_fread(buf, id_bytes, nids, fp) == (size_t) nids, EXIT_FAILURE, "Could not read the %"PRId64" IDs in `%s'\n", nids, fname);
+  fclose(fp);
+  if(id_bytes == 4) {
+    for(int64_t i=0;i<nids;i++) {
+      uint32_t id;
+      memcpy(&id, buf + i*sizeof(id), sizeof(id));
+      ids[i] = id;
+    }
+  }
+  if(build_id_index(idx, ids, nids) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  my_snprintf(idx->source, MAXLEN, "%s", fname);
+  return EXIT_SUCCESS;
+}
+
+int id_index_select(const struct id_index *idx, const void *ids, const size_t id_bytes, const int64_t nids, const int nlevels,
+                    const size_t index_offset, uint32_t **dest, int64_t *nselected)
+{
+  XRETURN(id_bytes == 4 || id_bytes == 8, EXIT_FAILURE, "ID bytes = %zu must be either 4 or 8\n", id_bytes);
+  XRETURN(nlevels <= idx->nlevels, EXIT_FAILURE, "The ID index has %d levels, requested %d levels\n", idx->nlevels, nlevels);
+  const uint64_t *keys = idx->keys;
+  const uint64_t *filter = idx->filter;
+  const int64_t n = idx->nids;
+  //with one bit per ID (and a single level), the filter is exact -> no search is needed
+  const int exact_filter = (idx->filter_shift == 0 && idx->depth == NULL);
+  uint64_t batch[ID_INDEX_BATCH], bit[ID_INDEX_BATCH];
+  int64_t k[ID_INDEX_BATCH];
+  int where[ID_INDEX_BATCH];
+  for(int64_t i=0;i<nids;i+=ID_INDEX_BATCH) {
+    const int nbatch = (nids - i) > ID_INDEX_BATCH ? ID_INDEX_BATCH:(int) (nids - i);
+    //the filter words of the whole batch are requested before any of them is tested. IDs outside
+    //the range of the index are pointed at bit 0 -> rejected by the range check
+    for(int j=0;j<nbatch;j++) {
+      batch[j] = (id_bytes == 4) ? ((const uint32_t *) ids)[i+j]:((const uint64_t *) ids)[i+j];
+      const int inside = batch[j] >= idx->min_id && batch[j] <= idx->max_id;
+      bit[j] = inside ? id_filter_bit(idx, batch[j]):0;
+      __builtin_prefetch(&filter[bit[j] >> 6]);
+    }
+    int ncandidates = 0;
+    for(int j=0;j<nbatch;j++) {
+      const int keep = batch[j] >= idx->min_id && batch[j] <= idx->max_id && ((filter[bit[j] >> 6] >> (bit[j] & 63)) & 1);
+      batch[ncandidates] = batch[j];
+      where[ncandidates] = j;
+      ncandidates += keep;
+    }
+    if(ncandidates == 0) {
+      continue;
+    }
+    if(exact_filter) {
+      for(int j=0;j<ncandidates;j++) {
+        if(dest != NULL) {
+          dest[0][nselected[0]] = index_offset + i + where[j];
+        }
+        nselected[0]++;
+      }
+      continue;
+    }
+
+    /* Every level above the last one is complete -> the candidates take height-1 steps in lock-step
+       without any bounds checks, with the cache line three levels further down prefetched */
+    for(int j=0;j<ncandidates;j++) {
+      k[j] = 1;
+    }
+    for(int level=0;level<idx->height-1;level++) {
+      for(int j=0;j<ncandidates;j++) {
+        k[j] = 2*k[j] + (keys[k[j]] < batch[j]);
+        __builtin_prefetch(&keys[8*k[j]]);
+      }
+    }
+    for(int j=0;j<ncandidates;j++) {
+      if(k[j] <= n) {
+        k[j] = 2*k[j] + (keys[k[j]] < batch[j]);
+      }
+      const int64_t pos = k[j] >> __builtin_ffsll(~k[j]);
+      if(pos == 0 || keys[pos] != batch[j]) {
+        continue;
+      }
+      const int depth = idx->depth != NULL ? idx->depth[pos]:0;
+      for(int l=0;l<nlevels && l<=depth;l++) {
+        if(dest != NULL) {
+          dest[l][nselected[l]] = index_offset + i + where[j];
+        }
+        nselected[l]++;
+      }
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+void free_id_index(struct id_index *idx)
+{
+  free(idx->keys);
+  free(idx->depth);
+  free(idx->filter);
+  idx->keys = NULL;
+  idx->depth = NULL;
+  idx->filter = NULL;
+  idx->nids = 0;
+}
@@ -0,0 +1,72 @@
+/* File: id_index.h */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "gadget_utils.h"
+#include "sampling.h"
+
+/* Maximum number of bits of the filter in front of the search per ID in the index. Every bit covers
+   an equal range of IDs -> a particle whose bit is clear is rejected with a single load, and IDs that
+   are close together (as in most snapshot files) hit the same cache lines of the filter. With 8 bits
+   per ID, ~12% of the particles that are not in a randomly spread index still go through the search */
+#ifndef ID_INDEX_FILTER_BITS_PER_ID
+#define ID_INDEX_FILTER_BITS_PER_ID  8
+#endif
+
+/* Number of IDs tested together. The searches of a batch descend the tree in lock-step -> the
+   cache misses of different IDs overlap instead of being paid one after the other */
+#ifndef ID_INDEX_BATCH
+#define ID_INDEX_BATCH  64
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* Membership index of a set of particle IDs, with the deepest level that contains each ID.
+       The (unique) IDs are stored in Eytzinger order -> the implicit binary search tree in breadth-first
+       order, i.e., the children of keys[k] are keys[2k] and keys[2k+1]. The top of the tree shares a few
+       cache lines and the 8 descendants three levels below a node share one cache line (prefetched) */
+    struct id_index
+    {
+        int64_t nids;
+        uint64_t *keys;//keys[1..nids] (keys[0] is unused), 64-byte aligned
+        uint8_t *depth;//deepest level of every ID, in the same order as keys (NULL -> every ID is only in level 0)
+        int height;//number of levels of the tree
+        uint64_t min_id, max_id;
+        uint64_t *filter;//bit b covers the IDs min_id + [b, b+1) << filter_shift -> a clear bit means none of them is in the index
+        int filter_shift;//0 -> one bit per ID (the filter is exact)
+        int nlevels;
+        int64_t nlevel_ids[MAX_SUBSAMPLE_LEVELS];//number of IDs in every level
+        double mass[MAX_SUBSAMPLE_LEVELS];//particle mass in the header of every level
+        char source[MAXLEN];//where the IDs came from
+    };
+
+    /* Builds a single-level index over nids IDs. The IDs are sorted (and de-duplicated) in place
+       and the array is freed once the index is built */
+    extern int build_id_index(struct id_index *idx, uint64_t *ids, const int64_t nids);
+
+    /* Builds a single-level index from a list of IDs -> the raw (native-endian) 4- or 8-byte IDs,
+       same as the IDs of the snapshot (id_bytes) */
+    extern int load_id_list(struct id_index *idx, const char *fname, const size_t id_bytes);
+
+    /* Builds the index of the particles in the nested outputs <basenames[level]>.<ifile> of an earlier
+       run -> every level must be a subset of the previous one */
+    extern int build_id_index_from_snapshots(struct id_index *idx, const int nlevels, char (*basenames)[MAXLEN]);
+
+    /* Position of id in idx->keys (-1 if the ID is not in the index) */
+    extern int64_t id_index_find(const struct id_index *idx, const uint64_t id);
+
+    /* Same as idhash_select_levels, except that a particle is selected at every level that contains its ID.
+       The IDs are tested ID_INDEX_BATCH at a time */
+    extern int id_index_select(const struct id_index *idx, const void *ids, const size_t id_bytes, const int64_t nids, const int nlevels,
+                               const size_t index_offset, uint32_t **dest, int64_t *nselected);
+    extern void free_id_index(struct id_index *idx);
+
+#ifdef __cplusplus
+}
+#endif
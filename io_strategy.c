@@ -0,0 +1,772 @@
+/* File: io_strategy.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "io_strategy.h"
+#include "macros.h"
+#include "utils.h"
+#include "sampling.h"
+#include "uring_io.h"
+#include "odirect_io.h"
+#include "workspace.h"
+
+/* Opens the input without mapping it */
+static int open_fd(struct io_source *src, const char *inputfile, const unsigned queue_depth)
+{
+  memset(src, 0, sizeof(*src));
+  src->inputfile = inputfile;
+  src->queue_depth = queue_depth;
+  src->fd = open(inputfile, O_RDONLY);
+  if(src->fd < 0) {
+    fprintf(stderr,"Error (in function %s, line # %d) while opening input file = `%s'\n",__FUNCTION__,__LINE__,inputfile);
+    perror(NULL);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+static int close_fd(struct io_source *src)
+{
+  //we are only reading, unlikely to be error
+  close(src->fd);
+  src->fd = -1;
+  return EXIT_SUCCESS;
+}
+
+/* Opens and maps the entire input file */
+static int open_mmap(struct io_source *src, const char *inputfile, const unsigned queue_depth)
+{
+  if(open_fd(src, inputfile, queue_depth) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  struct stat sb;
+  if(fstat(src->fd, &sb) < 0) {
+    perror(NULL);
+    close_fd(src);
+    return EXIT_FAILURE;
+  }
+  src->memblock = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, src->fd, 0);
+  if(src->memblock == MAP_FAILED) {
+    fprintf(stderr,"Error: Could not mmap input file = `%s'\n", inputfile);
+    perror(NULL);
+    src->memblock = NULL;
+    close_fd(src);
+    return EXIT_FAILURE;
+  }
+  src->mapped_bytes = sb.st_size;
+  return EXIT_SUCCESS;
+}
+
+static int close_mmap(struct io_source *src)
+{
+  munmap(src->memblock, src->mapped_bytes);
+  src->memblock = NULL;
+  src->mapped_bytes = 0;
+  return close_fd(src);
+}
+
+//keeps calling write until all nbytes have been written (a run can exceed the maximum transfer of one write)
+static int write_all(int out_fd, const char *buf, size_t nbytes)
+{
+  while(nbytes > 0) {
+    ssize_t bytes_written = write(out_fd, buf, nbytes);
+    XRETURN(bytes_written > 0, EXIT_FAILURE, "Expected to write bytes = %zu but wrote %zd instead\n", nbytes, bytes_written);
+    buf += bytes_written;
+    nbytes -= bytes_written;
+  }
+  return EXIT_SUCCESS;
+}
+
+/* Sets cursors[ichunk] to the first record of every chunk of nrec_per_chunk selected records */
+static void locate_selection_chunks(const struct selection *sel, const size_t nrec_per_chunk, const size_t nchunks, struct selection_cursor *cursors)
+{
+  struct selection_cursor c = {.pos = 0, .offset = 0};
+  for(size_t ichunk=0;ichunk<nchunks;ichunk++) {
+    cursors[ichunk] = c;
+    selection_skip(sel, &c, nrec_per_chunk);
+  }
+}
+
+static int pread_copy_field(const struct io_source *src, int out_fd, const off_t in_offset, const off_t out_offset,
+                            const int dest_npart, const size_t itemsize, const struct selection *sel)
+{
+  (void) out_offset;
+  const size_t nrec_per_buf = PREAD_BUFSIZE/itemsize > 0 ? PREAD_BUFSIZE/itemsize:1;
+  const size_t bufsize = ((size_t) dest_npart < nrec_per_buf ? (size_t) dest_npart:nrec_per_buf) * itemsize;
+  char *buf = workspace_get(thread_workspace(), WORKSPACE_STAGING, bufsize);
+  XRETURN(buf != NULL, EXIT_FAILURE, "Could not allocate %zu bytes for the read buffer\n", bufsize);
+  //one pread per run of consecutive records
+  int status = EXIT_SUCCESS;
+  struct selection_cursor c = {.pos = 0, .offset = 0};
+  size_t start, count;
+  while(status == EXIT_SUCCESS && (count = selection_peek_run(sel, &c, &start)) > 0) {
+    selection_advance(sel, &c, count);
+    for(size_t i=0;i<count && status == EXIT_SUCCESS;i+=nrec_per_buf) {
+      const size_t nbytes = ((count - i) > nrec_per_buf ? nrec_per_buf:(count - i)) * itemsize;
+      ssize_t bytes_read = pread(src->fd, buf, nbytes, in_offset + (start + i)*itemsize);
+      if(bytes_read != (ssize_t) nbytes) {
+        fprintf(stderr,"Expected to read bytes = %zu but read %zd instead\n", nbytes, bytes_read);
+        status = EXIT_FAILURE;
+        break;
+      }
+      status = write_all(out_fd, buf, nbytes);
+    }
+  }
+  return status;
+}
+
+static int mmap_copy_field(const struct io_source *src, int out_fd, const off_t in_offset, const off_t out_offset,
+                           const int dest_npart, const size_t itemsize, const struct selection *sel)
+{
+  (void) out_offset;
+  (void) dest_npart;
+  const char *in_field = src->memblock + in_offset;
+  struct selection_cursor c = {.pos = 0, .offset = 0};
+  size_t start, count;
+  while((count = selection_peek_run(sel, &c, &start)) > 0) {
+    selection_advance(sel, &c, count);
+    const int status = write_all(out_fd, in_field + start*itemsize, count*itemsize);
+    if(status != EXIT_SUCCESS) {
+      return status;
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+static int writev_copy_field(const struct io_source *src, int out_fd, const off_t in_offset, const off_t out_offset,
+                             const int dest_npart, const size_t itemsize, const struct selection *sel)
+{
+  (void) out_offset;
+  (void) dest_npart;
+  char *in_field = src->memblock + in_offset;
+  //vector writes with one iovec per run. Each writev takes at most IOV_MAX runs and WRITEV_MAXBYTES (longer runs are split)
+  struct iovec *iov = workspace_get(thread_workspace(), WORKSPACE_IOV, IOV_MAX * sizeof(*iov));
+  XRETURN(iov != NULL, EXIT_FAILURE, "Could not allocate memory for %d iovecs\n", IOV_MAX);
+  int niov = 0;
+  size_t nbytes = 0;
+  struct selection_cursor c = {.pos = 0, .offset = 0};
+  size_t start, count;
+  while((count = selection_peek_run(sel, &c, &start)) > 0) {
+    selection_advance(sel, &c, count);
+    char *base = in_field + start*itemsize;
+    size_t nleft = count*itemsize;
+    while(nleft > 0) {
+      const size_t len = nleft < (WRITEV_MAXBYTES - nbytes) ? nleft:(WRITEV_MAXBYTES - nbytes);
+      iov[niov].iov_base = base;
+      iov[niov].iov_len = len;
+      niov++;
+      nbytes += len;
+      base += len;
+      nleft -= len;
+      if(niov == IOV_MAX || nbytes == WRITEV_MAXBYTES) {
+        ssize_t bytes_written = writev(out_fd, iov, niov);
+        XRETURN(bytes_written == (ssize_t) nbytes, EXIT_FAILURE, "Expected to write bytes = %zu but wrote %zd instead\n",nbytes, bytes_written);
+        niov = 0;
+        nbytes = 0;
+      }
+    }
+  }
+  if(niov > 0) {
+    ssize_t bytes_written = writev(out_fd, iov, niov);
+    XRETURN(bytes_written == (ssize_t) nbytes, EXIT_FAILURE, "Expected to write bytes = %zu but wrote %zd instead\n",nbytes, bytes_written);
+  }
+  return EXIT_SUCCESS;
+}
+
+static int sendfile_copy_field(const struct io_source *src, int out_fd, const off_t in_offset, const off_t out_offset,
+                               const int dest_npart, const size_t itemsize, const struct selection *sel)
+{
+  (void) out_offset;
+  (void) dest_npart;
+  struct selection_cursor c = {.pos = 0, .offset = 0};
+  size_t start, count;
+  while((count = selection_peek_run(sel, &c, &start)) > 0) {
+    selection_advance(sel, &c, count);
+    off_t input_offset = in_offset + start*itemsize;
+    size_t nleft = count*itemsize;
+    while(nleft > 0) {
+      ssize_t bytes_written = sendfile(out_fd, src->fd, &input_offset, nleft);
+      XRETURN(bytes_written > 0, EXIT_FAILURE, "Expected to write bytes = %zu but wrote %zd instead\n",nleft, bytes_written);
+      nleft -= bytes_written;
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+
+/* Staging buffer for the gather and fused strategies. Each field gets its own section of the
+   buffer; the sections are written to the output offset of the corresponding field */
+struct gather_buffer
+{
+  int out_fd;
+  int nfields;
+  size_t nrec_per_buf;
+  size_t nbuffered;
+  char *buf;
+  const char *in_fields[GATHER_MAXFIELDS];
+  char *bufs[GATHER_MAXFIELDS];
+  size_t itemsizes[GATHER_MAXFIELDS];
+  off_t out_offsets[GATHER_MAXFIELDS];
+};
+
+/* Sets up the staging buffer for (at most) max_npart records of every field. The buffer is the
+   staging buffer in the workspace of the thread running the chunk -> the chunks of a thread never
+   overlap (no chunk has a scheduling point). The records are written starting at out_offsets */
+static int gather_buffer_init(struct gather_buffer *g, int out_fd, const int nfields, const char *in_memblock, const off_t *in_offsets,
+                              const off_t *out_offsets, const size_t *itemsizes, const size_t max_npart)
+{
+  XRETURN(nfields > 0 && nfields <= GATHER_MAXFIELDS, EXIT_FAILURE, "Number of fields = %d must be in [1, %d]\n", nfields, GATHER_MAXFIELDS);
+  size_t recsize = 0;
+  for(int k=0;k<nfields;k++) {
+    recsize += itemsizes[k];
+  }
+  g->nrec_per_buf = GATHER_BUFSIZE/recsize;
+  XRETURN(g->nrec_per_buf > 0, EXIT_FAILURE, "Gather buffer size = %zu bytes must be at least one record (%zu bytes)\n", (size_t) GATHER_BUFSIZE, recsize);
+  if(max_npart < g->nrec_per_buf) {
+    g->nrec_per_buf = max_npart > 0 ? max_npart:1;
+  }
+  g->buf = workspace_get(thread_workspace(), WORKSPACE_STAGING, g->nrec_per_buf*recsize);
+  XRETURN(g->buf != NULL, EXIT_FAILURE, "Could not allocate %zu bytes for the gather buffer\n", g->nrec_per_buf*recsize);
+
+  g->out_fd = out_fd;
+  g->nfields = nfields;
+  g->nbuffered = 0;
+  size_t buf_offset = 0;
+  for(int k=0;k<nfields;k++) {
+    g->in_fields[k] = in_memblock + in_offsets[k];
+    g->bufs[k] = g->buf + buf_offset;
+    g->itemsizes[k] = itemsizes[k];
+    g->out_offsets[k] = out_offsets[k];
+    buf_offset += g->nrec_per_buf*itemsizes[k];
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/* Writes out the buffered records of every field */
+static int gather_buffer_flush(struct gather_buffer *g)
+{
+  for(int k=0;k<g->nfields;k++) {
+    const size_t nbytes = g->nbuffered*g->itemsizes[k];
+    int status = pwrite_all(g->out_fd, g->bufs[k], nbytes, g->out_offsets[k]);
+    if(status != EXIT_SUCCESS) {
+      return status;
+    }
+    g->out_offsets[k] += nbytes;
+  }
+  g->nbuffered = 0;
+  return EXIT_SUCCESS;
+}
+
+/* Gathers nrec selected records, starting at the cursor (which is advanced), for all of the
+   fields -> one memcpy per field for every (part of a) run */
+static int gather_buffer_add(struct gather_buffer *g, const struct selection *sel, struct selection_cursor *c, size_t nrec)
+{
+  size_t ind;
+  while(nrec > 0) {
+    size_t n = selection_peek_run(sel, c, &ind);
+    if(n == 0) {
+      break;
+    }
+    n = n < nrec ? n:nrec;
+    n = n < (g->nrec_per_buf - g->nbuffered) ? n:(g->nrec_per_buf - g->nbuffered);
+    const size_t j = g->nbuffered;
+    for(int k=0;k<g->nfields;k++) {
+      memcpy(g->bufs[k] + j*g->itemsizes[k], g->in_fields[k] + ind*g->itemsizes[k], n*g->itemsizes[k]);
+    }
+    g->nbuffered += n;
+    nrec -= n;
+    selection_advance(sel, c, n);
+    if(g->nbuffered == g->nrec_per_buf) {
+      int status = gather_buffer_flush(g);
+      if(status != EXIT_SUCCESS) {
+        return status;
+      }
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+static int gather_buffer_finish(struct gather_buffer *g)
+{
+  int status = gather_buffer_flush(g);
+  g->buf = NULL;
+  return status;
+}
+
+static int gather_copy_field(const struct io_source *src, int out_fd, const off_t in_offset, const off_t out_offset,
+                             const int dest_npart, const size_t itemsize, const struct selection *sel)
+{
+  //gather the records into a large staging buffer and write the entire buffer with one pwrite
+  const size_t nrec_per_buf = GATHER_BUFSIZE/itemsize;
+  XRETURN(nrec_per_buf > 0, EXIT_FAILURE, "Gather buffer size = %zu bytes must be at least one record (%zu bytes)\n", (size_t) GATHER_BUFSIZE, itemsize);
+
+  /* The output location of every record is fixed by its rank in the selection -> the chunks are
+     independent and are copied as tasks. Threads that have run out of files (waiting at the
+     end of the loop over files) pick up the chunks of this file */
+  const size_t nchunks = (dest_npart + nrec_per_buf - 1)/nrec_per_buf;
+  struct selection_cursor *cursors = workspace_get(thread_workspace(), WORKSPACE_CURSORS, nchunks * sizeof(*cursors));
+  XRETURN(cursors != NULL, EXIT_FAILURE, "Could not allocate memory for %zu chunks\n", nchunks);
+  locate_selection_chunks(sel, nrec_per_buf, nchunks, cursors);
+  int status = EXIT_SUCCESS;
+#ifdef _OPENMP
+#pragma omp taskloop grainsize(1) shared(status)
+#endif
+  for(size_t ichunk=0;ichunk<nchunks;ichunk++) {
+    int chunk_status;
+#ifdef _OPENMP
+#pragma omp atomic read
+#endif
+    chunk_status = status;
+    if(chunk_status != EXIT_SUCCESS) {
+      continue;
+    }
+    const size_t i = ichunk*nrec_per_buf;
+    const size_t nleft = ((dest_npart - i) > nrec_per_buf) ? nrec_per_buf:(dest_npart - i);
+    const off_t chunk_out_offset = out_offset + i*itemsize;
+    struct gather_buffer gather;
+    chunk_status = gather_buffer_init(&gather, out_fd, 1, src->memblock, &in_offset, &chunk_out_offset, &itemsize, nleft);
+    if(chunk_status == EXIT_SUCCESS) {
+      struct selection_cursor c = cursors[ichunk];
+      chunk_status = gather_buffer_add(&gather, sel, &c, nleft);
+      const int finish_status = gather_buffer_finish(&gather);
+      chunk_status = (chunk_status == EXIT_SUCCESS) ? finish_status:chunk_status;
+    }
+    if(chunk_status != EXIT_SUCCESS) {
+#ifdef _OPENMP
+#pragma omp atomic write
+#endif
+      status = chunk_status;
+    }
+  }
+  if(status != EXIT_SUCCESS) {
+    return status;
+  }
+
+  //pwrite does not move the file offset -> the padding bytes are written with write after this field
+  const off_t end_offset = out_offset + (off_t) dest_npart*itemsize;
+  if(lseek(out_fd, end_offset, SEEK_SET) != end_offset) {
+    perror(NULL);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+#if ODIRECT_ALIGNMENT > WORKSPACE_ALIGNMENT
+#error The O_DIRECT buffers come from the workspace and need ODIRECT_ALIGNMENT <= WORKSPACE_ALIGNMENT
+#endif
+
+/* Buffer for copy_range_all (with up to COPY_RANGE_BOUNCE_BUFSIZE bytes) from the workspace of the thread */
+static void * copy_range_bounce_buffer(const size_t nbytes, size_t *bufsize)
+{
+  *bufsize = nbytes < COPY_RANGE_BOUNCE_BUFSIZE ? nbytes:COPY_RANGE_BOUNCE_BUFSIZE;
+  return workspace_get(thread_workspace(), WORKSPACE_BOUNCE, *bufsize);
+}
+
+/* Copies the runs of consecutive records that span at least COPY_RANGE_MIN_BYTES inside the kernel
+   (reflinked on filesystems that support it) and gathers the records in between into a staging buffer */
+static int copy_range_copy_field(const struct io_source *src, int out_fd, const off_t in_offset, const off_t out_offset,
+                                 const int dest_npart, const size_t itemsize, const struct selection *sel)
+{
+  const char *in_field = src->memblock + in_offset;
+  const size_t nrec_per_buf = GATHER_BUFSIZE/itemsize;
+  XRETURN(nrec_per_buf > 0, EXIT_FAILURE, "Gather buffer size = %zu bytes must be at least one record (%zu bytes)\n", (size_t) GATHER_BUFSIZE, itemsize);
+  const size_t min_run = (COPY_RANGE_MIN_BYTES + itemsize - 1)/itemsize;
+  const size_t bufsize = ((size_t) dest_npart < nrec_per_buf ? (size_t) dest_npart:nrec_per_buf) * itemsize;
+  char *gather_buf = workspace_get(thread_workspace(), WORKSPACE_STAGING, bufsize);
+  XRETURN(gather_buf != NULL, EXIT_FAILURE, "Could not allocate %zu bytes for the gather buffer\n", bufsize);
+  size_t bounce_size;
+  void *bounce = copy_range_bounce_buffer((size_t) dest_npart*itemsize, &bounce_size);
+  XRETURN(bounce != NULL, EXIT_FAILURE, "Could not allocate %zu bytes for the copy buffer\n", bounce_size);
+
+  //the buffered records are consecutive in the output, starting at rank buf_first
+  size_t nbuffered = 0, buf_first = 0, rank = 0;
+  int status = EXIT_SUCCESS;
+  struct selection_cursor c = {.pos = 0, .offset = 0};
+  size_t start, count;
+  while(status == EXIT_SUCCESS && (count = selection_peek_run(sel, &c, &start)) > 0) {
+    selection_advance(sel, &c, count);
+    if(count >= min_run) {
+      if(nbuffered > 0) {
+        status = pwrite_all(out_fd, gather_buf, nbuffered*itemsize, out_offset + buf_first*itemsize);
+        nbuffered = 0;
+      }
+      if(status == EXIT_SUCCESS) {
+        status = copy_range_all(src->fd, in_offset + start*itemsize, out_fd, out_offset + rank*itemsize, count*itemsize, bounce, bounce_size);
+      }
+    } else {
+      for(size_t i=0;i<count && status == EXIT_SUCCESS;) {
+        if(nbuffered == 0) {
+          buf_first = rank + i;
+        }
+        const size_t n = (count - i) < (nrec_per_buf - nbuffered) ? (count - i):(nrec_per_buf - nbuffered);
+        memcpy(gather_buf + nbuffered*itemsize, in_field + (start + i)*itemsize, n*itemsize);
+        nbuffered += n;
+        i += n;
+        if(nbuffered == nrec_per_buf) {
+          status = pwrite_all(out_fd, gather_buf, nbuffered*itemsize, out_offset + buf_first*itemsize);
+          nbuffered = 0;
+        }
+      }
+    }
+    rank += count;
+  }
+  if(status == EXIT_SUCCESS && nbuffered > 0) {
+    status = pwrite_all(out_fd, gather_buf, nbuffered*itemsize, out_offset + buf_first*itemsize);
+  }
+  if(status != EXIT_SUCCESS) {
+    return status;
+  }
+
+  //the writes are positional -> the padding bytes are written with write after this field
+  const off_t end_offset = out_offset + (off_t) dest_npart*itemsize;
+  if(lseek(out_fd, end_offset, SEEK_SET) != end_offset) {
+    perror(NULL);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+#ifdef USE_IO_URING
+static int uring_copy_field(const struct io_source *src, int out_fd, const off_t in_offset, const off_t out_offset,
+                            const int dest_npart, const size_t itemsize, const struct selection *sel)
+{
+  //the ring and the staging buffers of the thread are re-used for every field and every file.
+  //The extra entries guarantee there is always space to queue the writes
+  struct workspace *ws = thread_workspace();
+  struct uring *ring = workspace_uring(ws, src->queue_depth + URING_NBUFS);
+  XRETURN(ring != NULL, EXIT_FAILURE, "Could not set up io_uring with %u entries\n", src->queue_depth + URING_NBUFS);
+  char *staging = workspace_get(ws, WORKSPACE_STAGING, uring_staging_bytes(src->queue_depth));
+  XRETURN(staging != NULL, EXIT_FAILURE, "Could not allocate %zu bytes for the io_uring staging buffers\n", uring_staging_bytes(src->queue_depth));
+  //keeps up to queue_depth reads (one per run) in flight and writes the staging buffers asynchronously
+  int status = uring_gather_records(ring, staging, src->fd, out_fd, in_offset, out_offset, itemsize, sel, src->queue_depth);
+  if(status != EXIT_SUCCESS) {
+    workspace_release_uring(ws);
+    return status;
+  }
+
+  //the writes are positional -> the padding bytes are written with write after this field
+  const off_t end_offset = out_offset + (off_t) dest_npart*itemsize;
+  if(lseek(out_fd, end_offset, SEEK_SET) != end_offset) {
+    perror(NULL);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+#endif
+
+
+int write_fields_frame(const struct io_output *out, const int dest_npart)
+{
+  XRETURN(pwrite_all(out->fd, out->prefix, out->prefix_bytes, 0) == EXIT_SUCCESS, EXIT_FAILURE,
+          "Could not write the header to output file `%s'\n", out->outputfile);
+  for(int k=0;k<out->nfields;k++) {
+    const int field_disk_size = out->itemsizes[k]*dest_npart;
+    int status = EXIT_SUCCESS;
+    if(out->labels != NULL) {
+      char record[GADGET_LABEL_RECORD_BYTES];
+      fill_gadget_label_record(record, out->labels[k], field_disk_size);
+      status = pwrite_all(out->fd, record, sizeof(record), out->out_offsets[k] - sizeof(field_disk_size) - sizeof(record));
+    }
+    if(status == EXIT_SUCCESS) {
+      status = pwrite_all(out->fd, &field_disk_size, sizeof(field_disk_size), out->out_offsets[k] - sizeof(field_disk_size));
+    }
+    if(status == EXIT_SUCCESS) {
+      status = pwrite_all(out->fd, &field_disk_size, sizeof(field_disk_size), out->out_offsets[k] + field_disk_size);
+    }
+    if(status != EXIT_SUCCESS) {
+      return status;
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+/* Copies the selected records for all of the fields. The selection is split into chunks of
+   GATHER_BUFSIZE; the output location of each chunk follows from the rank of its first record,
+   so the chunks are written in parallel (as tasks) */
+static int fused_copy_fields(const struct io_source *src, const struct io_output *out, const int dest_npart,
+                             const struct selection *sel)
+{
+  int status = write_fields_frame(out, dest_npart);
+  if(status != EXIT_SUCCESS) {
+    return status;
+  }
+  size_t recsize = 0;
+  for(int k=0;k<out->nfields;k++) {
+    recsize += out->itemsizes[k];
+  }
+  const size_t nrec_per_chunk = GATHER_BUFSIZE/recsize > 0 ? GATHER_BUFSIZE/recsize:1;
+  const size_t nchunks = (dest_npart + nrec_per_chunk - 1)/nrec_per_chunk;
+  struct selection_cursor *cursors = workspace_get(thread_workspace(), WORKSPACE_CURSORS, nchunks * sizeof(*cursors));
+  XRETURN(cursors != NULL, EXIT_FAILURE, "Could not allocate memory for %zu chunks\n", nchunks);
+  locate_selection_chunks(sel, nrec_per_chunk, nchunks, cursors);
+#ifdef _OPENMP
+#pragma omp taskloop grainsize(1) shared(status)
+#endif
+  for(size_t ichunk=0;ichunk<nchunks;ichunk++) {
+    const size_t i = ichunk*nrec_per_chunk;
+    const size_t n = ((dest_npart - i) > nrec_per_chunk) ? nrec_per_chunk:(dest_npart - i);
+    off_t chunk_out_offsets[GATHER_MAXFIELDS];
+    for(int k=0;k<out->nfields && k<GATHER_MAXFIELDS;k++) {
+      chunk_out_offsets[k] = out->out_offsets[k] + i*out->itemsizes[k];
+    }
+    struct gather_buffer gather;
+    int chunk_status = gather_buffer_init(&gather, out->fd, out->nfields, src->memblock, out->in_offsets, chunk_out_offsets, out->itemsizes, n);
+    if(chunk_status == EXIT_SUCCESS) {
+      struct selection_cursor c = cursors[ichunk];
+      chunk_status = gather_buffer_add(&gather, sel, &c, n);
+      const int finish_status = gather_buffer_finish(&gather);
+      chunk_status = (chunk_status == EXIT_SUCCESS) ? finish_status:chunk_status;
+    }
+    if(chunk_status != EXIT_SUCCESS) {
+#ifdef _OPENMP
+#pragma omp atomic write
+#endif
+      status = chunk_status;
+    }
+  }
+  return status;
+}
+
+/* Counts the particles selected by the id-hash in every chunk of IDHASH_PARALLEL_CHUNKSIZE
+   input particles. Returns the total number of selected particles (-1 on error) */
+int64_t idhash_count_chunks(const char *ids, const size_t id_bytes, const int64_t npart, const uint64_t key, const uint64_t threshold, int64_t *chunk_counts)
+{
+  const int64_t nchunks = (npart + IDHASH_PARALLEL_CHUNKSIZE - 1)/IDHASH_PARALLEL_CHUNKSIZE;
+#ifdef _OPENMP
+#pragma omp taskloop grainsize(1)
+#endif
+  for(int64_t ichunk=0;ichunk<nchunks;ichunk++) {
+    const int64_t i = ichunk*IDHASH_PARALLEL_CHUNKSIZE;
+    const int64_t n = (npart - i) > IDHASH_PARALLEL_CHUNKSIZE ? IDHASH_PARALLEL_CHUNKSIZE:(npart - i);
+    chunk_counts[ichunk] = idhash_select(ids + i*id_bytes, id_bytes, n, key, threshold, i, NULL);
+  }
+
+  int64_t nselected = 0;
+  for(int64_t ichunk=0;ichunk<nchunks;ichunk++) {
+    if(chunk_counts[ichunk] < 0) {
+      return -1;
+    }
+    nselected += chunk_counts[ichunk];
+  }
+  return nselected;
+}
+
+/* Streams the ID block and gathers the particles selected by the id-hash for all of the
+   fields, without an array of indices. The chunks of input particles are processed in
+   parallel -> the output location of each chunk comes from the prefix sum of chunk_counts */
+int write_idhash_subsample_of_fields(const struct io_source *src, const struct io_output *out, const int64_t npart,
+                                     const off_t in_id_offset, const size_t id_bytes, const uint64_t key, const uint64_t threshold,
+                                     const int64_t *chunk_counts)
+{
+  const int64_t nchunks = (npart + IDHASH_PARALLEL_CHUNKSIZE - 1)/IDHASH_PARALLEL_CHUNKSIZE;
+  int64_t nselected = 0;
+  for(int64_t ichunk=0;ichunk<nchunks;ichunk++) {
+    nselected += chunk_counts[ichunk];
+  }
+  int status = write_fields_frame(out, (int) nselected);
+  if(status != EXIT_SUCCESS) {
+    return status;
+  }
+
+  int64_t rank = 0;
+  for(int64_t ichunk=0;ichunk<nchunks;ichunk++) {
+    const int64_t chunk_rank = rank;
+    rank += chunk_counts[ichunk];
+    if(chunk_counts[ichunk] == 0) {
+      continue;
+    }
+#ifdef _OPENMP
+#pragma omp task shared(status) firstprivate(ichunk)
+#endif
+    {
+      off_t chunk_out_offsets[GATHER_MAXFIELDS];
+      for(int k=0;k<out->nfields && k<GATHER_MAXFIELDS;k++) {
+        chunk_out_offsets[k] = out->out_offsets[k] + chunk_rank*out->itemsizes[k];
+      }
+      struct gather_buffer gather;
+      int chunk_status = gather_buffer_init(&gather, out->fd, out->nfields, src->memblock, out->in_offsets, chunk_out_offsets, out->itemsizes,
+                                            chunk_counts[ichunk]);
+      if(chunk_status == EXIT_SUCCESS) {
+        uint32_t chunk_indices[IDHASH_CHUNKSIZE];
+        const int64_t iend = (ichunk + 1)*IDHASH_PARALLEL_CHUNKSIZE < npart ? (ichunk + 1)*IDHASH_PARALLEL_CHUNKSIZE:npart;
+        for(int64_t i=ichunk*IDHASH_PARALLEL_CHUNKSIZE;i<iend && chunk_status == EXIT_SUCCESS;i+=IDHASH_CHUNKSIZE) {
+          const int64_t n = (iend - i) > IDHASH_CHUNKSIZE ? IDHASH_CHUNKSIZE:(iend - i);
+          const int64_t nsel = idhash_select(src->memblock + in_id_offset + i*id_bytes, id_bytes, n, key, threshold, i, chunk_indices);
+          const struct selection chunk_sel = {.type = SELECTION_INDICES, .npart = nsel, .nparent = npart, .indices = chunk_indices};
+          struct selection_cursor c = {.pos = 0, .offset = 0};
+          chunk_status = gather_buffer_add(&gather, &chunk_sel, &c, nsel);
+        }
+        const int finish_status = gather_buffer_finish(&gather);
+        chunk_status = (chunk_status == EXIT_SUCCESS) ? finish_status:chunk_status;
+      }
+      if(chunk_status != EXIT_SUCCESS) {
+#ifdef _OPENMP
+#pragma omp atomic write
+#endif
+        status = chunk_status;
+      }
+    }
+  }
+#ifdef _OPENMP
+#pragma omp taskwait
+#endif
+  return status;
+}
+
+/* Streams the input with aligned O_DIRECT reads and writes the entire output file (including the header) with O_DIRECT */
+static int odirect_copy_fields(const struct io_source *src, const struct io_output *out, const int dest_npart,
+                               const struct selection *sel)
+{
+  //the input chunk and the output staging buffer (ODIRECT_BUFSIZE each) are re-used for every file
+  char *bufs = workspace_get(thread_workspace(), WORKSPACE_STAGING, (size_t) 2*ODIRECT_BUFSIZE);
+  XRETURN(bufs != NULL, EXIT_FAILURE, "Could not allocate the (aligned) O_DIRECT buffers (2 x %d bytes)\n", ODIRECT_BUFSIZE);
+  const int64_t bytes_read = odirect_subsample_file(src->inputfile, out->outputfile, out->prefix, out->prefix_bytes, out->nfields,
+                                                    out->in_offsets, out->itemsizes, out->labels, sel, dest_npart, bufs);
+  return bytes_read < 0 ? EXIT_FAILURE:EXIT_SUCCESS;
+}
+
+static const struct io_strategy io_strategies[NUM_IO_STRATEGIES] = {
+  {IO_STRATEGY_PREAD, "pread", 1, open_fd, pread_copy_field, NULL, close_fd},
+  {IO_STRATEGY_MMAP, "mmap", 1, open_mmap, mmap_copy_field, NULL, close_mmap},
+  {IO_STRATEGY_WRITEV, "writev", 1, open_mmap, writev_copy_field, NULL, close_mmap},
+  {IO_STRATEGY_SENDFILE, "sendfile", 1, open_fd, sendfile_copy_field, NULL, close_fd},
+  {IO_STRATEGY_GATHER, "gather", 1, open_mmap, gather_copy_field, NULL, close_mmap},
+  {IO_STRATEGY_FUSED, "fused", 1, open_mmap, NULL, fused_copy_fields, close_mmap},
+#ifdef USE_IO_URING
+  {IO_STRATEGY_IO_URING, "io_uring", 1, open_fd, uring_copy_field, NULL, close_fd},
+#else
+  {IO_STRATEGY_IO_URING, "io_uring", 0, open_fd, NULL, NULL, close_fd},
+#endif
+  {IO_STRATEGY_ODIRECT, "odirect", 1, open_fd, NULL, odirect_copy_fields, close_fd},
+  {IO_STRATEGY_COPY_RANGE, "copy_range", 1, open_mmap, copy_range_copy_field, NULL, close_mmap},
+};
+
+const struct io_strategy * get_io_strategy(const enum io_strategy_type type)
+{
+  if(type < 0 || type >= NUM_IO_STRATEGIES) {
+    return NULL;
+  }
+  return &io_strategies[type];
+}
+
+int parse_io_strategy_type(const char *name, enum io_strategy_type *type)
+{
+  if(strcmp(name, "auto") == 0) {
+    *type = IO_STRATEGY_AUTO;
+    return EXIT_SUCCESS;
+  }
+  for(int i=0;i<NUM_IO_STRATEGIES;i++) {
+    if(strcmp(name, io_strategies[i].name) == 0) {
+      if(io_strategies[i].available == 0) {
+        fprintf(stderr,"Error: I/O strategy = `%s' is not available in this build (compile with -DUSE_IO_URING)\n", name);
+        return EXIT_FAILURE;
+      }
+      *type = (enum io_strategy_type) i;
+      return EXIT_SUCCESS;
+    }
+  }
+  fprintf(stderr,"Error: Unknown I/O strategy = `%s'. Valid options are: `auto'", name);
+  for(int i=0;i<NUM_IO_STRATEGIES;i++) {
+    if(io_strategies[i].available) {
+      fprintf(stderr," `%s'", io_strategies[i].name);
+    }
+  }
+  fprintf(stderr,"\n");
+  return EXIT_FAILURE;
+}
+
+const char * io_strategy_type_name(const enum io_strategy_type type)
+{
+  if(type == IO_STRATEGY_AUTO) {
+    return "auto";
+  }
+  if(type < 0 || type >= NUM_IO_STRATEGIES) {
+    return "unknown";
+  }
+  return io_strategies[type].name;
+}
+
+/* Copies every field of a selection that is a single run of consecutive records with copy_file_range */
+static int copy_range_single_run(const struct io_source *src, const struct io_output *out, const int dest_npart, const size_t start,
+                                 double *field_seconds)
+{
+  size_t max_itemsize = 0;
+  for(int k=0;k<out->nfields;k++) {
+    max_itemsize = out->itemsizes[k] > max_itemsize ? out->itemsizes[k]:max_itemsize;
+  }
+  size_t bounce_size;
+  void *bounce = copy_range_bounce_buffer(max_itemsize*dest_npart, &bounce_size);
+  XRETURN(bounce != NULL, EXIT_FAILURE, "Could not allocate %zu bytes for the copy buffer\n", bounce_size);
+  int status = write_fields_frame(out, dest_npart);
+  for(int k=0;k<out->nfields && status == EXIT_SUCCESS;k++) {
+    struct timespec t0, t1;
+    current_utc_time(&t0);
+    status = copy_range_all(src->fd, out->in_offsets[k] + start*out->itemsizes[k], out->fd, out->out_offsets[k],
+                            out->itemsizes[k]*dest_npart, bounce, bounce_size);
+    current_utc_time(&t1);
+    if(field_seconds != NULL) {
+      field_seconds[k] = REALTIME_ELAPSED_NS(t0,t1)*1e-9;
+    }
+  }
+  return status;
+}
+
+int io_strategy_write(const struct io_strategy *strategy, const struct io_source *src, const struct io_output *out,
+                      const int dest_npart, const struct selection *sel, double *field_seconds)
+{
+  if(strategy->type != IO_STRATEGY_ODIRECT && dest_npart > 0 && sel->nruns == 1) {
+    struct selection_cursor c = {.pos = 0, .offset = 0};
+    size_t start = 0;
+    selection_peek_run(sel, &c, &start);
+    return copy_range_single_run(src, out, dest_npart, start, field_seconds);
+  }
+  if(strategy->copy_fields != NULL) {
+    for(int k=0;k<out->nfields && field_seconds != NULL;k++) {
+      field_seconds[k] = -1.0;
+    }
+    return strategy->copy_fields(src, out, dest_npart, sel);
+  }
+
+  //write each field (label record, padding, subsampled records, padding) in file order
+  XRETURN(lseek(out->fd, 0, SEEK_SET) == 0 && write(out->fd, out->prefix, out->prefix_bytes) == (ssize_t) out->prefix_bytes, EXIT_FAILURE,
+          "Could not write the header to output file `%s'\n", out->outputfile);
+  for(int k=0;k<out->nfields;k++) {
+    const int field_disk_size = out->itemsizes[k]*dest_npart;
+    if(out->labels != NULL) {
+      char record[GADGET_LABEL_RECORD_BYTES];
+      fill_gadget_label_record(record, out->labels[k], field_disk_size);
+      XRETURN(write(out->fd, record, sizeof(record)) == sizeof(record), EXIT_FAILURE,
+              "Could not write the label record to output file `%s'\n", out->outputfile);
+    }
+    XRETURN(write(out->fd, &field_disk_size, sizeof(field_disk_size)) == sizeof(field_disk_size), EXIT_FAILURE,
+            "Could not write the padding bytes to output file `%s'\n", out->outputfile);
+    struct timespec t0, t1;
+    current_utc_time(&t0);
+    const int status = strategy->copy_field(src, out->fd, out->in_offsets[k], out->out_offsets[k], dest_npart, out->itemsizes[k], sel);
+    if(status != EXIT_SUCCESS) {
+      return status;
+    }
+    current_utc_time(&t1);
+    if(field_seconds != NULL) {
+      field_seconds[k] = REALTIME_ELAPSED_NS(t0,t1)*1e-9;
+    }
+    XRETURN(write(out->fd, &field_disk_size, sizeof(field_disk_size)) == sizeof(field_disk_size), EXIT_FAILURE,
+            "Could not write the padding bytes to output file `%s'\n", out->outputfile);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,153 @@
+/* File: io_strategy.h */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "gadget_utils.h"
+#include "sampling.h"
+
+/* Size (in bytes) of the buffer used by the pread strategy. Each run of consecutive records is
+   read with one pread (runs that do not fit are read in pieces) */
+#ifndef PREAD_BUFSIZE
+#define PREAD_BUFSIZE  (1024*1024)
+#endif
+
+/* Maximum number of bytes written by one writev -> linux transfers at most ~2 GB per call */
+#ifndef WRITEV_MAXBYTES
+#define WRITEV_MAXBYTES  (1024*1024*1024)
+#endif
+
+/* Size (in bytes) of the staging buffer used by the gather and fused strategies. The selected
+   records are memcpy'ed out of the mmap'ed input into this buffer and each full buffer is
+   written out with a single pwrite. The buffer is part of the (page-aligned) per-thread workspace */
+#ifndef GATHER_BUFSIZE
+#define GATHER_BUFSIZE  (8*1024*1024)
+#endif
+
+#ifndef GATHER_MAXFIELDS
+#define GATHER_MAXFIELDS  GADGET_MAXBLOCKS
+#endif
+
+/* Number of input particles per (parallel) chunk for the streaming id-hash selection */
+#ifndef IDHASH_PARALLEL_CHUNKSIZE
+#define IDHASH_PARALLEL_CHUNKSIZE  (1 << 20)
+#endif
+
+/* Runs of consecutive selected records that span at least this many bytes are copied inside the
+   kernel with copy_file_range by the copy_range strategy (shorter runs are gathered and written) */
+#ifndef COPY_RANGE_MIN_BYTES
+#define COPY_RANGE_MIN_BYTES  (64*1024)
+#endif
+
+/* The strategy is chosen at run-time (--io-strategy). The compile-time flags only set the default */
+#if defined(USE_COPY_RANGE)
+#define IO_STRATEGY_DEFAULT  IO_STRATEGY_COPY_RANGE
+#elif defined(USE_ODIRECT)
+#define IO_STRATEGY_DEFAULT  IO_STRATEGY_ODIRECT
+#elif defined(USE_FUSED)
+#define IO_STRATEGY_DEFAULT  IO_STRATEGY_FUSED
+#elif defined(USE_GATHER)
+#define IO_STRATEGY_DEFAULT  IO_STRATEGY_GATHER
+#elif defined(USE_WRITEV)
+#define IO_STRATEGY_DEFAULT  IO_STRATEGY_WRITEV
+#elif defined(USE_MMAP)
+#define IO_STRATEGY_DEFAULT  IO_STRATEGY_MMAP
+#elif defined(USE_SENDFILE)
+#define IO_STRATEGY_DEFAULT  IO_STRATEGY_SENDFILE
+#elif defined(USE_IO_URING)
+#define IO_STRATEGY_DEFAULT  IO_STRATEGY_IO_URING
+#else
+#define IO_STRATEGY_DEFAULT  IO_STRATEGY_PREAD
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    enum io_strategy_type
+    {
+        IO_STRATEGY_PREAD=0,   /*!< pread + write, one run of consecutive records at a time */
+        IO_STRATEGY_MMAP,      /*!< mmap + write, one run at a time */
+        IO_STRATEGY_WRITEV,    /*!< mmap + writev of IOV_MAX runs */
+        IO_STRATEGY_SENDFILE,  /*!< in-kernel sendfile, one run at a time */
+        IO_STRATEGY_GATHER,    /*!< mmap + memcpy into large staging buffers + pwrite */
+        IO_STRATEGY_FUSED,     /*!< gather with a single pass over the runs for all of the fields */
+        IO_STRATEGY_IO_URING,  /*!< asynchronous reads + writes with io_uring (requires USE_IO_URING) */
+        IO_STRATEGY_ODIRECT,   /*!< aligned O_DIRECT streaming -> bypasses the page cache */
+        IO_STRATEGY_COPY_RANGE,/*!< copy_file_range for long runs of consecutive records, gather for the rest */
+        NUM_IO_STRATEGIES,
+        IO_STRATEGY_AUTO = NUM_IO_STRATEGIES /*!< pick the fastest strategy with a probe on the first file */
+    };
+
+    /* The input file, as opened by a strategy */
+    struct io_source
+    {
+        const char *inputfile;
+        int fd;
+        char *memblock;//the mmap'ed file (NULL for the strategies that do not map the input)
+        size_t mapped_bytes;
+        unsigned queue_depth;//number of reads kept in flight by the io_uring strategy
+    };
+
+    /* Layout of one output file. The prefix (the header including its padding) is at offset 0
+       and field k is a fortran block with its records starting at out_offsets[k]. labels is NULL
+       for format-1 output, otherwise each block is preceded by its format-2 label record */
+    struct io_output
+    {
+        const char *outputfile;
+        int fd;
+        const void *prefix;
+        size_t prefix_bytes;
+        int nfields;
+        const off_t *in_offsets;
+        const off_t *out_offsets;
+        const size_t *itemsizes;
+        const char (*labels)[GADGET_LABEL_LEN+1];
+    };
+
+    struct io_strategy
+    {
+        enum io_strategy_type type;
+        const char *name;
+        int available;//0 -> not compiled in
+        int (*open)(struct io_source *src, const char *inputfile, const unsigned queue_depth);
+        /* Copies the selected records (dest_npart records) of one field to the current offset
+           of out_fd (which must be out_offset) and leaves the file offset at the end of the field */
+        int (*copy_field)(const struct io_source *src, int out_fd, const off_t in_offset, const off_t out_offset,
+                          const int dest_npart, const size_t itemsize, const struct selection *sel);
+        /* Strategies that write the entire output file (header, every field and the padding) at once.
+           Used instead of copy_field if not NULL */
+        int (*copy_fields)(const struct io_source *src, const struct io_output *out, const int dest_npart,
+                           const struct selection *sel);
+        int (*close)(struct io_source *src);
+    };
+
+    extern const struct io_strategy * get_io_strategy(const enum io_strategy_type type);
+    extern int parse_io_strategy_type(const char *name, enum io_strategy_type *type);
+    extern const char * io_strategy_type_name(const enum io_strategy_type type);
+
+    /* Writes the complete output file -> with copy_fields if the strategy has it, otherwise the
+       prefix followed by every field (label record, padding, records, padding) in file order.
+       If the selection is a single run (e.g., fraction = 1.0), every field is copied with one
+       copy_file_range instead (except by the odirect strategy).
+       If field_seconds is not NULL, it gets the time spent on each field (-1 if the strategy
+       writes all of the fields at once) */
+    extern int io_strategy_write(const struct io_strategy *strategy, const struct io_source *src, const struct io_output *out,
+                                 const int dest_npart, const struct selection *sel, double *field_seconds);
+
+    /* Writes the label records and the padding around every field of the output (with pwrite) */
+    extern int write_fields_frame(const struct io_output *out, const int dest_npart);
+
+    /* Streaming id-hash selection for the fused strategy -> no array of indices is needed */
+    extern int64_t idhash_count_chunks(const char *ids, const size_t id_bytes, const int64_t npart, const uint64_t key, const uint64_t threshold,
+                                       int64_t *chunk_counts);
+    extern int write_idhash_subsample_of_fields(const struct io_source *src, const struct io_output *out, const int64_t npart,
+                                                const off_t in_id_offset, const size_t id_bytes, const uint64_t key, const uint64_t threshold,
+                                                const int64_t *chunk_counts);
+
+#ifdef __cplusplus
+}
+#endif
@@ -9,6 +9,8 @@
 #include <math.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <getopt.h>
+#include <errno.h>
 
 #ifndef SIZE_MAX
 #define SIZE_MAX (~(size_t)0)
@@ -24,224 +26,336 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
-/*for sendfile (in-kernel file to file copy, supposedly very fast) */
-#ifdef USE_SENDFILE
-#include <sys/sendfile.h>
+
+#include "macros.h"
+#include "utils.h"
+#include "progressbar.h"
+#include "gadget_utils.h"
+#include "sampling.h"
+#include "io_strategy.h"
+#include "snapshot_layout.h"
+#include "region.h"
+#include "metrics.h"
+#include "progress.h"
+#include "manifest.h"
+#include "workspace.h"
+#include "id_index.h"
+
+/* Number of particles written by each strategy during the `--io-strategy=auto' probe */
+#ifndef IO_PROBE_NPART
+#define IO_PROBE_NPART  (1 << 16)
 #endif
 
-#if defined(USE_MMAP)
-#include <sys/mman.h>
-#elif defined(USE_SENDFILE)
-#include <sys/sendfile.h>
-#else
+/* Number of timed probes per strategy (the fastest one counts) */
+#ifndef IO_PROBE_REPEATS
+#define IO_PROBE_REPEATS  2
 #endif
 
+/* Run-time options (set from the command-line) */
+struct subsample_options
+{
+  enum sampler_type sampler;
+  uint64_t seed;
+  enum io_strategy_type io_strategy;//how the selected records are copied from the input to the output files
+  unsigned queue_depth;//number of reads kept in flight by the io_uring strategy
+  int prefetch_depth;//number of input files (beyond the newest one being copied) to pull into the page cache ahead of time
+  int snapformat;//format of the output files (1 or 2), 0 -> same as the input files
+  int extra_blocks;//subsample every per-particle block in the input (e.g., POT, ACCEL) and not just POS, VEL and ID
+  const char *layout_cache;//file with the cached layout of the input snapshot (NULL -> no cache)
+  struct region region;//only keep particles inside this region (type REGION_NONE -> all particles)
+  const char *region_cache;//directory with the cached cell index of every input file (NULL -> no cache)
+  const char *metrics_file;//per-file, per-phase timings are written here (NULL -> not written)
+  double progress_interval;//seconds between the progress reports (0 -> no reports)
+  const char *manifest_file;//completion manifest (NULL -> <first output filename>.manifest)
+  int resume;//only redo the input files without valid outputs in the manifest
+  int exact;//the first argument holds the exact total number of particles of every level (split over the files)
+  const struct id_index *track;//keep the particles with these IDs instead of a random selection (NULL -> random)
+  const char *id_list_file;//raw IDs of the candidate particles (NULL -> all particles), read with the ID width of the snapshot
+  const struct id_index *id_list;//only particles with these IDs are candidates, same as a region (NULL -> all particles)
+};
 
-#ifdef USE_WRITEV
-#ifndef USE_MMAP
-#error USE_MMAP must be enabled with USE_WRITEV
-#endif
-#include <sys/uio.h>
-#endif
+/* Accumulates the bytes copied and the time spent copying the particle data */
+struct subsample_stats
+{
+  int64_t npart_written;
+  size_t bytes_copied;
+  double copy_time;
+  int64_t pagecache_bytes;//input + output bytes resident in the page cache once each file is done
+  int64_t selection_bytes;//memory used by the runs and bitmaps of every level (the 32-bit indices are used in place)
+  int64_t index_bytes;//memory used by the 32-bit indices from the samplers (kept, the runs are built from them)
+  int64_t nselections[NUM_SELECTION_TYPES];//number of selections stored as each type
+  struct file_metrics *metrics;//per-phase timings of the file (NULL -> not recorded)
+  struct progress_reporter *progress;//shared progress counters (NULL -> not reported)
+};
 
-#include <gsl/gsl_rng.h>
 
-#include "macros.h"
-#include "utils.h"
-#include "progressbar.h"
-#include "gadget_utils.h"
+/* What selects the particles from the IDs: the id-hash with the thresholds of nlevels
+   levels, or (if idx is not NULL) the membership in the index */
+struct id_selector
+{
+  int nlevels;
+  uint64_t key;
+  const uint64_t *thresholds;
+  const struct id_index *idx;
+};
 
+/* Selects from the nids IDs of one chunk (the first one is particle index_offset of the file) */
+static int select_id_chunk(const struct id_selector *sel, const void *ids, const size_t id_bytes, const int64_t nids, const size_t index_offset,
+                           uint32_t **dest, int64_t *nselected)
+{
+  if(sel->idx != NULL) {
+      return id_index_select(sel->idx, ids, id_bytes, nids, sel->nlevels, index_offset, dest, nselected);
+  }
+  return idhash_select_levels(ids, id_bytes, nids, sel->key, sel->nlevels, sel->thresholds, index_offset, dest, nselected);
+}
 
-/* Copied straight from https://fossies.org/dox/gsl-2.2.1/shuffle_8c_source.html*/
-/* Adapted to generate array indices. The returned random indices are in increasing order */
-int gsl_ran_arr_index (const gsl_rng * r, size_t * dest, const size_t k, const size_t n)
+/* Runs the selection over the ID block of the input file -> directly on the mapped file if the
+   strategy maps the input, otherwise reading the IDs in chunks with pread. nselected[l] is
+   incremented by the number of particles selected at level l and, unless dest is NULL, the
+   indices are stored in dest[l] */
+static int select_ids_from_file(const struct io_source *src, const off_t id_offset, const size_t id_bytes, const int64_t npart,
+                                const struct id_selector *sel, uint32_t **dest, int64_t *nselected)
 {
-  /* Choose k out of n items, return an array x[] of the k items.
-      These items will preserve the relative order of the original
-      input -- you can use shuffle() to randomize the output if you
-      wish */
- 
-  if (k > n) {
-	fprintf(stderr,"k=%zu is greater than n=%zu. Cannot sample more than n items\n",
-			k, n);
-	return EXIT_FAILURE;
+  if(src->memblock != NULL) {
+      return select_id_chunk(sel, src->memblock + id_offset, id_bytes, npart, 0, dest, nselected);
   }
-  if(k == n) {
-	for(size_t i=0;i<n;i++) {
-	  dest[i] = i;
-	}
-  } else {
-	size_t j=0;
-	for (size_t i = 0; i < n && j < k; i++) {
-	  if ((n - i) * gsl_rng_uniform (r) < k - j) {
-		dest[j] = i;
-		j++ ;
-	  }
-	}
+  const int in_fd = src->fd;
+  uint64_t ids[IDHASH_CHUNKSIZE];
+  for(int64_t i=0;i<npart;i+=IDHASH_CHUNKSIZE) {
+      const int64_t n = (npart - i) > IDHASH_CHUNKSIZE ? IDHASH_CHUNKSIZE:(npart - i);
+      const size_t nbytes = n*id_bytes;
+      ssize_t bytes_read = pread(in_fd, ids, nbytes, id_offset + i*id_bytes);
+      XRETURN(bytes_read == (ssize_t) nbytes, EXIT_FAILURE, "Expected to read bytes = %zu but read %zd instead\n", nbytes, bytes_read);
+      const int status = select_id_chunk(sel, ids, id_bytes, n, i, dest, nselected);
+      if(status != EXIT_SUCCESS) {
+          return status;
+      }
   }
- 
   return EXIT_SUCCESS;
 }
- 
 
-int write_random_subsample_of_field(int in_fd, int out_fd, off_t in_offset, off_t out_offset, const int dest_npart, const size_t itemsize, size_t *random_indices
-#ifdef USE_MMAP
-									,char *in_memblock
-#endif
-)
+/* The (nested) id-hash selection over the ID block of the input file */
+int idhash_select_from_file(const struct io_source *src, const off_t id_offset, const size_t id_bytes, const int64_t npart, const uint64_t key,
+                            const int nlevels, const uint64_t *thresholds, uint32_t **dest, int64_t *nselected)
 {
-#ifdef USE_MMAP
-  in_memblock += in_offset;//These are here so that I don't lose the original pointer from mmap
-#endif
-
-#ifndef USE_MMAP
-  size_t buf[itemsize];
-#endif
+  const struct id_selector sel = {.nlevels = nlevels, .key = key, .thresholds = thresholds, .idx = NULL};
+  return select_ids_from_file(src, id_offset, id_bytes, npart, &sel, dest, nselected);
+}
 
-  int interrupted=0;
-  
-#ifndef _OPENMP  
-  init_my_progressbar(dest_npart,&interrupted);
-#endif
-  
-#ifdef USE_WRITEV
-  //vector writes. Loop has to be re-written in units of IOV_MAX
-  for(int i=0;i<dest_npart;i+=IOV_MAX) {
-#ifndef _OPENMP        
-      my_progressbar(i,&interrupted);//progress-bar will be jumpy
-#endif      
-      const int nleft = ((dest_npart - i) > IOV_MAX) ? IOV_MAX:(dest_npart - i);
-      struct iovec iov[IOV_MAX];
-      for(int j=0;j<nleft;j++){
-          const size_t ind = random_indices[j];
-          const size_t offset_in_field = ind * itemsize;
-          iov[j].iov_base = in_memblock + offset_in_field;
-          iov[j].iov_len = itemsize;
-      }
-      random_indices += nleft;
-      
-      ssize_t bytes_written = writev(out_fd, iov, nleft);
-      XRETURN(bytes_written == nleft*itemsize, EXIT_FAILURE, "Expected to write bytes = %zu but wrote %zd instead\n",nleft*itemsize, bytes_written);
-  }
-#else  //Not using WRITEV -> 3 options here i) MMAP + write ii) sendfile iii) pread + write
-  for(int i=0;i<dest_npart;i++) {
-#ifndef _OPENMP        
-	my_progressbar(i,&interrupted);
-#endif    
-	const size_t ind = random_indices[i];
-	size_t offset_in_field = ind * itemsize;
-#if defined(USE_MMAP)
-	ssize_t bytes_written = write(out_fd, in_memblock + offset_in_field, itemsize);
-#elif defined(USE_SENDFILE)
-	off_t input_offset = in_offset + offset_in_field;
-	ssize_t bytes_written = sendfile(out_fd, in_fd, &input_offset, itemsize);
-#else
-	ssize_t bytes_read = pread(in_fd, &buf, itemsize, in_offset + offset_in_field);
-	XRETURN(bytes_read == itemsize, EXIT_FAILURE, "Expected to read bytes = %zu but read %zd instead\n",itemsize, bytes_read);
-	ssize_t bytes_written = write(out_fd, &buf, itemsize);
-#endif//default case (pread + write)
+/* Selects the particles whose IDs are in the index. dest[l] gets the indices of the particles at level l */
+int id_index_select_from_file(const struct io_source *src, const off_t id_offset, const size_t id_bytes, const int64_t npart,
+                              const struct id_index *idx, const int nlevels, uint32_t **dest, int64_t *nselected)
+{
+  const struct id_selector sel = {.nlevels = nlevels, .key = 0, .thresholds = NULL, .idx = idx};
+  return select_ids_from_file(src, id_offset, id_bytes, npart, &sel, dest, nselected);
+}
 
-	XRETURN(bytes_written == itemsize, EXIT_FAILURE, "Expected to write bytes = %zu but wrote %zd instead\n",itemsize, bytes_written);
-	out_offset += itemsize;
+/* Collects the blocks to be subsampled (in file order): POS, VEL and ID and, with extra_blocks, every
+   other block that contains one fixed-size record per particle. Returns the number of fields (-1 on error) */
+int get_subsample_fields(const struct gadget_block_index *index, const int npart, const size_t id_bytes, const int extra_blocks,
+                         off_t *in_offsets, size_t *itemsizes, char (*labels)[GADGET_LABEL_LEN+1], const char *inputfile)
+{
+  const char required[][GADGET_LABEL_LEN+1] = {"POS ", "VEL ", "ID  "};
+  const size_t required_itemsizes[] = {sizeof(float)*3, sizeof(float)*3, id_bytes};
+  XRETURN(npart > 0, -1, "Input file `%s' does not contain any particles\n", inputfile);
+  for(int k=0;k<3;k++) {
+      const struct gadget_block *block = find_gadget_block(index, required[k]);
+      XRETURN(block != NULL, -1, "Input file `%s' does not contain the `%s' block\n", inputfile, required[k]);
+      XRETURN(block->nbytes == (int64_t) required_itemsizes[k]*npart, -1,
+              "Block `%s' in input file `%s' contains %"PRId64" bytes, expected %zu bytes for %d particles\n",
+              required[k], inputfile, block->nbytes, required_itemsizes[k]*npart, npart);
   }
-#endif //end of WRITEV
 
-#ifndef _OPENMP    
-  finish_myprogressbar(&interrupted);
-#endif
-  
-  return EXIT_SUCCESS;
+  int nfields = 0;
+  for(int i=0;i<index->nblocks;i++) {
+      const struct gadget_block *block = &(index->blocks[i]);
+      if(strcmp(block->label, "HEAD") == 0 || find_gadget_block(index, block->label) != block) {
+          continue;
+      }
+      int is_required = 0;
+      for(int k=0;k<3;k++) {
+          is_required |= (strcmp(block->label, required[k]) == 0);
+      }
+      if(is_required == 0) {
+          if(extra_blocks == 0) {
+              continue;
+          }
+          if(block->nbytes == 0 || block->nbytes % npart != 0) {
+              fprintf(stderr,"Warning: Skipping block `%s' in input file `%s' (%"PRId64" bytes is not a whole number of bytes per particle)\n",
+                      block->label, inputfile, block->nbytes);
+              continue;
+          }
+      }
+      in_offsets[nfields] = block->offset;
+      itemsizes[nfields] = block->nbytes/npart;
+      memcpy(labels[nfields], block->label, sizeof(labels[nfields]));
+      nfields++;
+  }
+  return nfields;
 }
 
+/* Computes the offset of the records of every field in an output file with dest_npart particles
+   (every block is preceded by a label record of label_bytes). Returns the size of the output file */
+off_t get_output_offsets(const int nfields, const size_t *itemsizes, const int dest_npart, const off_t label_bytes, off_t *out_offsets)
+{
+  const off_t header_disk_size = label_bytes + 4 + sizeof(struct io_header) + 4;  //header
+  off_t outputfile_size = header_disk_size;
+  for(int k=0;k<nfields;k++) {
+      out_offsets[k] = outputfile_size + label_bytes + 4;
+      outputfile_size += label_bytes + 4 + itemsizes[k]*dest_npart + 4;
+  }
+  return outputfile_size;
+}
 
-int subsample_single_gadgetfile(const int dest_npart, const char *inputfile, const char *outputfile, const size_t id_bytes, const gsl_rng *rng, const double fraction, const int64_t nparttotal)
+/* Subsamples one input file into nlevels nested output files. outputfiles[0] gets the
+   largest fraction and every following level is a subset of the previous one. The input
+   file is opened once (by the I/O strategy) and the particles for all of the levels are
+   selected in one step. On return, level_npart contains the number of particles in each level */
+int subsample_single_gadgetfile(const int nlevels, int *level_npart, const char *inputfile, const struct gadget_file_layout *layout,
+                                char (*outputfiles)[MAXLEN], const size_t id_bytes, const uint64_t seed, const double *fractions,
+                                const int64_t *nparttotals, const struct subsample_options *options, struct subsample_stats *stats)
 {
-  if(dest_npart <= 0) {
-	fprintf(stderr,"Error: Desired number of particles =%d in the subsampled file must be > 0\n",dest_npart);
-	return EXIT_FAILURE;
+  XRETURN(nlevels > 0 && nlevels <= MAX_SUBSAMPLE_LEVELS, EXIT_FAILURE, "Number of subsample levels = %d must be in [1, %d]\n",
+          nlevels, MAX_SUBSAMPLE_LEVELS);
+  //the number of particles selected by the id-hash sampler (or inside the region) is only known after reading the file.
+  //A list of IDs limits the candidates the same way as a region (and both together keep the listed particles inside the region)
+  const int region_select = (options->region.type != REGION_NONE || options->id_list != NULL);
+  for(int level=0;level<nlevels;level++) {
+	if(level_npart[level] <= 0 && options->sampler != SAMPLER_IDHASH && region_select == 0 && options->exact == 0 && options->track == NULL) {
+	  fprintf(stderr,"Error: Desired number of particles =%d in the subsampled file must be > 0\n",level_npart[level]);
+	  return EXIT_FAILURE;
+	}
   }
   struct timespec tstart, t0, t1;
   current_utc_time(&tstart);
 
-  int in_fd=-1;
-  int out_fd=-1;
   int status = EXIT_FAILURE;
-  in_fd = open(inputfile, O_RDONLY);
-  if(in_fd < 0) {
-	fprintf(stderr,"Error (in function %s, line # %d) while opening input file = `%s'\n",__FUNCTION__,__LINE__,inputfile);
-	perror(NULL);
+  const struct io_strategy *strategy = get_io_strategy(options->io_strategy);
+  XRETURN(strategy != NULL && strategy->available, EXIT_FAILURE, "I/O strategy = %d is not available\n", (int) options->io_strategy);
+  struct file_metrics *metrics = stats != NULL ? stats->metrics:NULL;
+  struct io_source src;
+  if(strategy->open(&src, inputfile, options->queue_depth) != EXIT_SUCCESS) {
 	return EXIT_FAILURE;
   }
+  current_utc_time(&t0);
+  add_file_metrics(metrics, -1, METRICS_OPEN, NULL, (int64_t) src.mapped_bytes, REALTIME_ELAPSED_NS(tstart,t0)*1e-9);
 
-#ifdef USE_MMAP
-  struct stat sb;
-  if(fstat(in_fd, &sb) < 0) {
-	perror(NULL);
-	return EXIT_FAILURE;
-  }
-  char *in_memblock = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, in_fd, 0);
-#endif
-
-
-  //Check that that the output file does not exist.
-  {
-	FILE *fp = fopen(outputfile,"r");
+  //Check that that the output files do not exist.
+  for(int level=0;level<nlevels;level++) {
+	FILE *fp = fopen(outputfiles[level],"r");
 	if(fp != NULL) {
 	  fclose(fp);
 	  fprintf(stderr,"Warning: Output file = `%s' should not exist. "
-			  "Aborting so as to avoid accidentally over-writing regular fles\n",outputfile);
+			  "Aborting so as to avoid accidentally over-writing regular fles\n",outputfiles[level]);
 	  return EXIT_FAILURE;
 	}
   }
 
-  out_fd = open(outputfile, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);//set the mode since the file is being created
-  if(out_fd < 0) {
-	fprintf(stderr,"Error (in function %s, line # %d) while opening output file = `%s'\n",__FUNCTION__,__LINE__, outputfile);
-	perror(NULL);
+  /* The block offsets and the header come from the snapshot layout -> the input file is not re-scanned */
+  const struct gadget_block_index *in_index = &(layout->index);
+  const struct io_header hdr = in_index->header;
+  int dummy1=sizeof(struct io_header),dummy2=sizeof(struct io_header);
+
+  /* Offsets to the start of the particle data for each field in the input file */
+  off_t in_offsets[GADGET_MAXBLOCKS];
+  size_t itemsizes[GADGET_MAXBLOCKS];
+  char labels[GADGET_MAXBLOCKS][GADGET_LABEL_LEN+1];
+  const int nfields = get_subsample_fields(in_index, hdr.npart[1], id_bytes, options->extra_blocks, in_offsets, itemsizes, labels, inputfile);
+  if(nfields < 0) {
 	return EXIT_FAILURE;
   }
-
-  /* Reserve disk-space for dest_npart particles, written as a fortran binary */
-  const size_t pos_vel_itemsize = sizeof(float)*3;
-  const off_t header_disk_size = 4 + sizeof(struct io_header) + 4;  //header
-  const off_t pos_disk_size = 4 + pos_vel_itemsize*dest_npart + 4; //all 3 positions for each particle
-  const off_t vel_disk_size = 4 + pos_vel_itemsize*dest_npart + 4; //all 3 velocities for each particle
-  const off_t id_disk_size = 	4 + id_bytes*dest_npart + 4;//all particle IDs
-  
-  /* These are all of the fields to be written */
-  const off_t outputfile_size = header_disk_size + pos_disk_size + vel_disk_size + id_disk_size;
-
-  status = posix_fallocate(out_fd, 0, outputfile_size);
-  if(status < 0) {
-  	fprintf(stderr,"Error: Could not reserve disk space for %d particles (output file: `%s', expected file-size on disk = %zu bytes)\n",
-  			dest_npart, outputfile, (size_t) outputfile_size);
-  	perror(NULL);
-  	return status;
+  const off_t in_id_start_offset = find_gadget_block(in_index, "ID")->offset;
+  size_t max_itemsize = 0, record_size = 0;
+  for(int k=0;k<nfields;k++) {
+	max_itemsize = itemsizes[k] > max_itemsize ? itemsizes[k]:max_itemsize;
+	record_size += itemsizes[k];
   }
 
+  const uint64_t idhash = idhash_key(options->seed);
+  uint64_t idhash_thresh[MAX_SUBSAMPLE_LEVELS];
+  for(int level=0;level<nlevels;level++) {
+	idhash_thresh[level] = idhash_threshold(fractions[level]);
+  }
+  //every buffer of the selection comes from the workspace of the thread -> re-used for the next file
+  struct workspace *ws = thread_workspace();
+  XRETURN(ws != NULL, EXIT_FAILURE, "No workspace for the thread subsampling `%s'\n", inputfile);
 
-  struct io_header hdr;
-  int dummy1=0,dummy2=0;
-  const off_t pos_start_offset = header_disk_size + 4;
-  const off_t vel_start_offset = header_disk_size + pos_disk_size + 4;
-  const off_t id_start_offset = header_disk_size + pos_disk_size + vel_disk_size + 4;
+  //the fused strategy streams a single id-hash level without an array of indices
+  const int stream_idhash = (strategy->type == IO_STRATEGY_FUSED && options->sampler == SAMPLER_IDHASH && nlevels == 1 && region_select == 0 &&
+                             options->track == NULL);
+  uint32_t *level_indices[MAX_SUBSAMPLE_LEVELS] = {NULL};
+  int64_t *idhash_chunk_counts = NULL;
 
-  read(in_fd, &dummy1, 4);
-  read(in_fd, &hdr, sizeof(struct io_header));
-  read(in_fd, &dummy2, 4);
-  if(dummy1 != 256 || dummy2 != 256) {
-	fprintf(stderr,"Error: Padding bytes for header = %d (front) and %d (end) should be exactly 256\n",dummy1, dummy2);
-	return EXIT_FAILURE;
+  /* Only the particles inside the region are candidates for the selection. The cell index of
+     the file limits the positions that are read to the cells that overlap the region. The
+     candidates are kept in the workspace -> nothing to release on the early returns below */
+  uint32_t *region_indices = NULL;
+  int64_t nregion = hdr.npart[1];
+  if(region_select) {
+	if(options->region.type != REGION_NONE) {
+	  nregion = region_select_indices(&(options->region), hdr.BoxSize, inputfile, options->region_cache, src.fd, src.memblock,
+									  find_gadget_block(in_index, "POS")->offset, hdr.npart[1], ws, &region_indices);
+	  if(nregion < 0) {
+		return EXIT_FAILURE;
+	  }
+	}
+	if(options->id_list != NULL) {
+	  //the ID block is streamed once and the IDs are tested against the list in batches
+	  uint32_t *listed = workspace_get(ws, WORKSPACE_CANDIDATES, hdr.npart[1] * sizeof(*listed));
+	  XRETURN(listed != NULL, EXIT_FAILURE, "Could not allocate memory for the listed particles of %d particles\n", hdr.npart[1]);
+	  int64_t nlisted = 0;
+	  if(id_index_select_from_file(&src, in_id_start_offset, id_bytes, hdr.npart[1], options->id_list, 1, &listed, &nlisted) != EXIT_SUCCESS) {
+		return EXIT_FAILURE;
+	  }
+	  if(region_indices != NULL) {
+		nregion = intersect_sorted_indices(region_indices, nregion, listed, nlisted);
+	  } else {
+		region_indices = listed;
+		nregion = nlisted;
+	  }
+	}
+	if(options->sampler != SAMPLER_IDHASH) {
+	  for(int level=0;level<nlevels;level++) {
+		level_npart[level] = fractions[level] * nregion;
+	  }
+	}
   }
-#ifdef USE_MMAP
-  if(fraction == 1.0) {
-	XRETURN(dest_npart == hdr.npart[1],EXIT_FAILURE,
-			"for fraction = 1.0, input npart = %d must equal subsampled npart = %d\n",hdr.npart[1], dest_npart);
-	/* XRETURN(sb.st_size == outputfile_size, EXIT_FAILURE, */
-	/* 		"for fraction = 1.0, input (=%zu bytes) and output file sizes (=%zu bytes) must be the same",sb.st_size, outputfile_size); */
+  if(options->track != NULL) {
+	//no level can hold more than every particle in the file -> the indices are stored in the pass that counts them
+	int64_t nselected[MAX_SUBSAMPLE_LEVELS] = {0};
+	for(int level=0;level<nlevels;level++) {
+	  level_indices[level] = workspace_get(ws, WORKSPACE_INDICES + level, hdr.npart[1] * sizeof(*level_indices[level]));
+	  XRETURN(level_indices[level] != NULL, EXIT_FAILURE, "Could not allocate memory for %d tracked indices\n", hdr.npart[1]);
+	}
+	status = id_index_select_from_file(&src, in_id_start_offset, id_bytes, hdr.npart[1], options->track, nlevels, level_indices, nselected);
+	if(status != EXIT_SUCCESS) {
+	  return EXIT_FAILURE;
+	}
+	for(int level=0;level<nlevels;level++) {
+	  level_npart[level] = (int) nselected[level];
+	}
+  } else if(options->sampler == SAMPLER_IDHASH) {
+	int64_t nselected[MAX_SUBSAMPLE_LEVELS] = {0};
+	if(stream_idhash) {
+	  //per-chunk counts are required to write the chunks in parallel
+	  idhash_chunk_counts = workspace_get(ws, WORKSPACE_CHUNK_COUNTS,
+									  ((hdr.npart[1] + IDHASH_PARALLEL_CHUNKSIZE - 1)/IDHASH_PARALLEL_CHUNKSIZE + 1) * sizeof(*idhash_chunk_counts));
+	  XRETURN(idhash_chunk_counts != NULL, EXIT_FAILURE, "Could not allocate memory for the id-hash chunk counts\n");
+	  nselected[0] = idhash_count_chunks(src.memblock + in_id_start_offset, id_bytes, hdr.npart[1], idhash, idhash_thresh[0], idhash_chunk_counts);
+	  status = nselected[0] < 0 ? EXIT_FAILURE:EXIT_SUCCESS;
+	} else {
+	  status = idhash_select_from_file(&src, in_id_start_offset, id_bytes, hdr.npart[1], idhash, nlevels, idhash_thresh, NULL, nselected);
+	}
+	if(status != EXIT_SUCCESS) {
+	  return EXIT_FAILURE;
+	}
+	for(int level=0;level<nlevels;level++) {
+	  level_npart[level] = (int) nselected[level];
+	}
   }
-#endif
-
+  //the levels are nested -> the first level contains the most particles
+  XRETURN(level_npart[0]*max_itemsize < INT_MAX, EXIT_FAILURE,
+		  "Padding bytes will overflow for %d particles in the subsampled file `%s'\n", level_npart[0], outputfiles[0]);
 
   for(int type=0;type<6;type++) {
 	if(type==1) {
@@ -257,92 +371,192 @@ int subsample_single_gadgetfile(const int dest_npart, const char *inputfile, con
   }
 
   /* The number of subsampled particles wanted can at most be the numbers present in the file*/
-  if(dest_npart > hdr.npart[1]) {
+  if(level_npart[0] > hdr.npart[1]) {
 	fprintf(stderr,"Error: Number of subsampled particles = %d exceeds the number of particles in the file = %d\n",
-			dest_npart,  hdr.npart[1]);
+			level_npart[0],  hdr.npart[1]);
 	return EXIT_FAILURE;
   }
 
-  struct io_header out_hdr = hdr;
-  out_hdr.npart[1] = dest_npart;
-  out_hdr.npartTotal[1] = nparttotal;
-  out_hdr.npartTotalHighWord[1] = (nparttotal >> 32);
-  out_hdr.mass[1] /= fraction;
+  //create the (nested) arrays of random indices for all of the levels in one step
+  struct selection level_selections[MAX_SUBSAMPLE_LEVELS] = {{0}};
+  if(stream_idhash == 0) {
+	//the random samplers write the first level straight into a bitmap if that is smaller than its indices
+	uint64_t *level_bitmap = NULL;
+	if(options->track == NULL && options->sampler != SAMPLER_IDHASH && region_select == 0) {
+	  const size_t bitmap_bytes = plan_bitmap_selection(&(level_selections[0]), level_npart[0], hdr.npart[1]);
+	  if(bitmap_bytes > 0) {
+		level_bitmap = workspace_get(ws, WORKSPACE_SELECTIONS, bitmap_bytes);
+		XRETURN(level_bitmap != NULL, EXIT_FAILURE, "Could not allocate %zu bytes for the bitmap of %d random indices\n", bitmap_bytes, level_npart[0]);
+	  }
+	}
+	for(int level=(level_bitmap != NULL) ? 1:0;level<nlevels && options->track == NULL;level++) {
+	  level_indices[level] = workspace_get(ws, WORKSPACE_INDICES + level, level_npart[level] * sizeof(*level_indices[level]));
+	  XRETURN(level_indices[level] != NULL, EXIT_FAILURE, "Could not allocate memory for %d random indices\n", level_npart[level]);
+	}
+	if(options->track != NULL) {
+	  status = EXIT_SUCCESS;//already selected while reading the IDs
+	} else if(options->sampler == SAMPLER_IDHASH) {
+	  int64_t nselected[MAX_SUBSAMPLE_LEVELS] = {0};
+	  status = idhash_select_from_file(&src, in_id_start_offset, id_bytes, hdr.npart[1], idhash, nlevels, idhash_thresh, level_indices, nselected);
+	  for(int level=0;level<nlevels;level++) {
+		status |= (nselected[level] == level_npart[level]) ? EXIT_SUCCESS:EXIT_FAILURE;
+		//the id-hash decision does not depend on the position -> keep the selected particles inside the region
+		if(region_select) {
+		  level_npart[level] = (int) intersect_sorted_indices(level_indices[level], level_npart[level], region_indices, nregion);
+		}
+	  }
+	} else {
+	  size_t k[MAX_SUBSAMPLE_LEVELS];
+	  for(int level=0;level<nlevels;level++) {
+		k[level] = level_npart[level];
+	  }
+	  status = random_subsample_nested_indices(options->sampler, seed, nlevels, level_bitmap, level_indices, k, (size_t) nregion);
+	  //the random indices are positions within the (increasing) list of particles inside the region
+	  for(int level=0;level<nlevels && region_select && status == EXIT_SUCCESS;level++) {
+		for(int i=0;i<level_npart[level];i++) {
+		  level_indices[level][i] = region_indices[level_indices[level][i]];
+		}
+	  }
+	}
+	if(status != EXIT_SUCCESS) {
+	  return status;
+	}
+	//each level is kept as runs or 32-bit indices (whichever is smaller), or as the bitmap from the sampler, and copied one run at a time
+	for(int level=0;level<nlevels;level++) {
+	  if(level == 0 && level_bitmap != NULL) {
+		build_bitmap_selection(&(level_selections[level]), level_bitmap);
+	  } else {
+		status |= workspace_selection(ws, level, &(level_selections[level]), level_indices[level], level_npart[level], hdr.npart[1]);
+	  }
+	  if(stats != NULL) {
+		stats->selection_bytes += level_selections[level].type == SELECTION_INDICES ? 0:selection_bytes(&(level_selections[level]));
+		stats->index_bytes += level_indices[level] != NULL ? level_npart[level] * sizeof(*level_indices[level]):0;
+		stats->nselections[level_selections[level].type]++;
+	  }
+	}
+	if(status != EXIT_SUCCESS) {
+	  return status;
+	}
+  }
+  current_utc_time(&t1);
+  add_file_metrics(metrics, -1, METRICS_SELECT, NULL, 0, REALTIME_ELAPSED_NS(t0,t1)*1e-9);
 
-  write(out_fd, &dummy1, sizeof(dummy1));
-  write(out_fd, &out_hdr, sizeof(struct io_header));
-  write(out_fd, &dummy2, sizeof(dummy2));
-  
+  /* Write the levels in decreasing order of size. The records of each level are a subset of
+     the records just copied for the previous level -> served from the page cache */
+  for(int level=0;level<nlevels;level++) {
+    const char *outputfile = outputfiles[level];
+    const int dest_npart = level_npart[level];
+    const double fraction = fractions[level];
+    const int64_t nparttotal = nparttotals[level];
+    struct selection *sel = &(level_selections[level]);
 
-  //create an array of random indices
-  size_t *random_indices = calloc(dest_npart, sizeof(*random_indices));
-  status = gsl_ran_arr_index(rng, random_indices, (size_t) dest_npart, (size_t) hdr.npart[1]);
+    if(fraction == 1.0 && region_select == 0 && options->track == NULL) {
+      XRETURN(dest_npart == hdr.npart[1],EXIT_FAILURE,
+              "for fraction = 1.0, input npart = %d must equal subsampled npart = %d\n",hdr.npart[1], dest_npart);
+    }
 
-  //write positions
-  current_utc_time(&t0);
-  int posvel_disk_size=pos_vel_itemsize*dest_npart;
-  write(out_fd, &posvel_disk_size, sizeof(posvel_disk_size));
-  status = write_random_subsample_of_field(in_fd, out_fd, pos_start_offset, -1,dest_npart, pos_vel_itemsize, random_indices
-#ifdef USE_MMAP
-											   ,in_memblock
-#endif
-											   );
-  if(status != EXIT_SUCCESS) {
-	return status;
-  }
-  write(out_fd, &posvel_disk_size, sizeof(posvel_disk_size));
-  current_utc_time(&t1);
-  double pos_time = REALTIME_ELAPSED_NS(t0,t1)*1e-9;
+    current_utc_time(&t0);
+    int out_fd = open(outputfile, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);//set the mode since the file is being created
+    if(out_fd < 0) {
+      fprintf(stderr,"Error (in function %s, line # %d) while opening output file = `%s'\n",__FUNCTION__,__LINE__, outputfile);
+      perror(NULL);
+      return EXIT_FAILURE;
+    }
 
-  //write velocities
-  write(out_fd, &posvel_disk_size, sizeof(posvel_disk_size));
-  status = write_random_subsample_of_field(in_fd, out_fd, vel_start_offset, -1,dest_npart, pos_vel_itemsize, random_indices
-#ifdef USE_MMAP
-											   ,in_memblock
-#endif
-											   );
-  if(status != EXIT_SUCCESS) {
-	return status;
-  }
-  write(out_fd, &posvel_disk_size, sizeof(posvel_disk_size));
-  current_utc_time(&t0);
-  double vel_time = REALTIME_ELAPSED_NS(t1, t0)*1e-9;
+    /* Reserve disk-space for dest_npart particles, written as a fortran binary. Every block
+       is preceded by a label record for format-2 output */
+    const int out_snapformat = options->snapformat > 0 ? options->snapformat:in_index->snapformat;
+    const off_t label_bytes = (out_snapformat == 2) ? GADGET_LABEL_RECORD_BYTES:0;
+    const off_t header_disk_size = label_bytes + 4 + sizeof(struct io_header) + 4;  //header
+    off_t out_offsets[GADGET_MAXBLOCKS];
+    const off_t outputfile_size = get_output_offsets(nfields, itemsizes, dest_npart, label_bytes, out_offsets);
 
+    status = posix_fallocate(out_fd, 0, outputfile_size);
+    if(status < 0) {
+    	fprintf(stderr,"Error: Could not reserve disk space for %d particles (output file: `%s', expected file-size on disk = %zu bytes)\n",
+    			dest_npart, outputfile, (size_t) outputfile_size);
+    	perror(NULL);
+    	return status;
+    }
+    current_utc_time(&t1);
+    add_file_metrics(metrics, level, METRICS_FALLOCATE, NULL, (int64_t) outputfile_size, REALTIME_ELAPSED_NS(t0,t1)*1e-9);
 
-  //write ids
-  int id_size = id_bytes * dest_npart;
-  write(out_fd, &id_size, sizeof(id_size)); 
-  status = write_random_subsample_of_field(in_fd, out_fd, vel_start_offset, -1,dest_npart, id_bytes, random_indices
-#ifdef USE_MMAP
-                                           ,in_memblock
-#endif
-                                           );
-  if(status != EXIT_SUCCESS) {
-	return status;
-  }
-  write(out_fd, &id_size, sizeof(id_size));
-  current_utc_time(&t1);
-  double id_time = REALTIME_ELAPSED_NS(t0,t1)*1e-9;
+    struct io_header out_hdr = hdr;
+    out_hdr.npart[1] = dest_npart;
+    out_hdr.npartTotal[1] = nparttotal;
+    out_hdr.npartTotalHighWord[1] = (nparttotal >> 32);
+    out_hdr.mass[1] /= fraction;
 
-  free(random_indices);
+    char prefix[GADGET_LABEL_RECORD_BYTES + 4 + sizeof(struct io_header) + 4];
+    if(label_bytes > 0) {
+      fill_gadget_label_record(prefix, "HEAD", sizeof(struct io_header));
+    }
+    memcpy(prefix + label_bytes, &dummy1, sizeof(dummy1));
+    memcpy(prefix + label_bytes + sizeof(dummy1), &out_hdr, sizeof(out_hdr));
+    memcpy(prefix + label_bytes + sizeof(dummy1) + sizeof(out_hdr), &dummy2, sizeof(dummy2));
+    const struct io_output out = {.outputfile = outputfile, .fd = out_fd, .prefix = prefix, .prefix_bytes = header_disk_size,
+                                  .nfields = nfields, .in_offsets = in_offsets, .out_offsets = out_offsets, .itemsizes = itemsizes,
+                                  .labels = label_bytes > 0 ? (const char (*)[GADGET_LABEL_LEN+1]) labels:NULL};
 
-  //close the input file -> we are only reading, unlikely to be error
-  close(in_fd);
+    double field_seconds[GADGET_MAXBLOCKS];
+    current_utc_time(&t0);
+    if(stream_idhash) {
+      //stream through the ID block -> select and gather one chunk at a time
+      status = write_idhash_subsample_of_fields(&src, &out, hdr.npart[1], in_id_start_offset, id_bytes, idhash, idhash_thresh[0], idhash_chunk_counts);
+      field_seconds[0] = -1.0;
+    } else {
+      status = io_strategy_write(strategy, &src, &out, dest_npart, sel, field_seconds);
+    }
+    if(status != EXIT_SUCCESS) {
+      return status;
+    }
+    current_utc_time(&t1);
+    const double copy_time = REALTIME_ELAPSED_NS(t0,t1)*1e-9;
+    if(nfields > 0 && field_seconds[0] < 0.0) {
+      add_file_metrics(metrics, level, METRICS_FIELDS, NULL, (int64_t) (record_size*dest_npart), copy_time);
+    } else {
+      for(int k=0;k<nfields;k++) {
+        add_file_metrics(metrics, level, METRICS_FIELD, labels[k], (int64_t) (itemsizes[k]*dest_npart), field_seconds[k]);
+      }
+    }
 
-#ifdef USE_MMAP
-  munmap(in_memblock, sb.st_size);
-#endif
+    if(stats != NULL) {
+      stats->npart_written += dest_npart;
+      stats->bytes_copied += record_size*dest_npart;
+      stats->copy_time += copy_time;
+      progress_add(stats->progress, dest_npart, (int64_t) (record_size*dest_npart));
+    }
+
+    //check for error code here since disk quota might be hit
+    current_utc_time(&t0);
+    status = close(out_fd);
+    if(status != EXIT_SUCCESS){
+      fprintf(stderr,"Error while closing output file = `%s'\n",outputfile);
+      perror(NULL);
+      return status;
+    }
+    current_utc_time(&t1);
+    add_file_metrics(metrics, level, METRICS_CLOSE, NULL, 0, REALTIME_ELAPSED_NS(t0,t1)*1e-9);
+    if(stats != NULL) {
+      const int64_t out_resident = get_pagecache_resident_bytes(outputfile);
+      stats->pagecache_bytes += (out_resident > 0 ? out_resident:0);
+    }
+  }//loop over levels
 
-  //check for error code here since disk quota might be hit
-  status = close(out_fd);
-  if(status != EXIT_SUCCESS){
-	fprintf(stderr,"Error while closing output file = `%s'\n",outputfile);
-	perror(NULL);
-	return status;
+  //close the input file -> we are only reading, unlikely to be error
+  strategy->close(&src);
+
+  if(stats != NULL) {
+    const int64_t in_resident = get_pagecache_resident_bytes(inputfile);
+    stats->pagecache_bytes += (in_resident > 0 ? in_resident:0);
   }
   current_utc_time(&t1);
-  /* fprintf(stderr,"Done with file. Total time taken = %8.4lf seconds (pos_time = %6.3e vel_time = %6.3e id_time = %6.3e seconds)\n",REALTIME_ELAPSED_NS(tstart,t1)*1e-9, */
-  /*   	  pos_time,vel_time,id_time); */
+  if(metrics != NULL) {
+    metrics->npart = hdr.npart[1];
+    metrics->seconds = REALTIME_ELAPSED_NS(tstart,t1)*1e-9;
+  }
+  /* fprintf(stderr,"Done with file. Total time taken = %8.4lf seconds (copy_time = %6.3e seconds for %d fields)\n",REALTIME_ELAPSED_NS(tstart,t1)*1e-9, */
+  /*   	  copy_time, nfields); */
 
   return EXIT_SUCCESS;
 }
@@ -350,54 +564,275 @@ int subsample_single_gadgetfile(const int dest_npart, const char *inputfile, con
 
 
 
-int main(int argc,char **argv) 
+/* Writes a probe subsample of one input file with one strategy. The probe reads the first
+   (at most) IO_PROBE_NPART/fraction particles of every field -> the distance between the
+   selected records is the same as in the full run */
+static int write_io_probe(const struct io_strategy *strategy, const char *inputfile, const char *probefile, const struct subsample_options *options,
+                          const struct io_output *layout_out, const int dest_npart, const struct selection *sel, double *elapsed)
 {
-  const char argnames[][100]={"fraction","input file","output file"};
-  int nargs=sizeof(argnames)/(sizeof(char)*100);
-  char input_filename[MAXLEN];
-  char output_filename[MAXLEN];
-  struct timespec tstart,t0,t1;
-  int64_t nparticles_written=0,nparticles_withmass=0;
-  const gsl_rng_type * rng_type = gsl_rng_ranlxd1;
-  gsl_rng * all_procs_rng = gsl_rng_alloc(rng_type);
-  unsigned long seed = 42;
-  int64_t TotNumPart;
-  current_utc_time(&tstart);
+  struct timespec t0, t1;
+  struct io_source src;
+  current_utc_time(&t0);
+  if(strategy->open(&src, inputfile, options->queue_depth) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  struct io_output out = *layout_out;
+  out.outputfile = probefile;
+  out.fd = open(probefile, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+  XRETURN(out.fd >= 0, EXIT_FAILURE, "Could not create the probe file `%s'\n", probefile);
+  const off_t probefile_size = out.nfields > 0 ? out.out_offsets[out.nfields-1] + (off_t) (out.itemsizes[out.nfields-1]*dest_npart) + 4:(off_t) out.prefix_bytes;
+  int status = posix_fallocate(out.fd, 0, probefile_size) == 0 ? EXIT_SUCCESS:EXIT_FAILURE;
+  if(status == EXIT_SUCCESS) {
+    status = io_strategy_write(strategy, &src, &out, dest_npart, sel, NULL);
+  }
+  status |= close(out.fd) == 0 ? EXIT_SUCCESS:EXIT_FAILURE;
+  strategy->close(&src);
+  current_utc_time(&t1);
+  unlink(probefile);
+  *elapsed = REALTIME_ELAPSED_NS(t0,t1)*1e-9;
+  return status;
+}
 
-  if (argc != 4 )  {
-	fprintf(stderr,"ERROR: %s usage - <fraction>  <gadget snapshot name>  <output filename>\n",argv[0]);
-	fprintf(stderr,"Each file will be subsampled to get (roughly) that fraction for each particle-type\n");
-    fprintf(stderr,"\nFound: %d parameters\n ",argc-1);
-	int i;
-    for(i=1;i<argc;i++) {
-      if(i <= nargs)
-		fprintf(stderr,"\t\t %s = `%s' \n",argnames[i-1],argv[i]);
-      else
-		fprintf(stderr,"\t\t <> = `%s' \n",argv[i]);
+/* Times every available I/O strategy on a probe of the first input file (at the largest fraction)
+   and sets fastest to the quickest one. The probe output is written next to the output files ->
+   the timings include the filesystems of both the input and the output */
+static int select_io_strategy(const char *inputfile, const struct gadget_file_layout *layout, const char *probefile,
+                              const double fraction, const struct subsample_options *options, enum io_strategy_type *fastest)
+{
+  const struct io_header hdr = layout->index.header;
+  off_t in_offsets[GADGET_MAXBLOCKS], out_offsets[GADGET_MAXBLOCKS];
+  size_t itemsizes[GADGET_MAXBLOCKS];
+  char labels[GADGET_MAXBLOCKS][GADGET_LABEL_LEN+1];
+  const int nfields = get_subsample_fields(&(layout->index), hdr.npart[1], layout->id_bytes, options->extra_blocks, in_offsets, itemsizes, labels, inputfile);
+  if(nfields < 0) {
+    return EXIT_FAILURE;
+  }
+  int nwindow = fraction * hdr.npart[1] > IO_PROBE_NPART ? (int) (IO_PROBE_NPART/fraction):hdr.npart[1];
+  int dest_npart = fraction * nwindow;
+  if(dest_npart <= 0) {
+    dest_npart = 1;
+    nwindow = nwindow > 0 ? nwindow:1;
+  }
+  //the probe runs before the files are subsampled -> borrows the workspace of the thread
+  struct workspace *ws = thread_workspace();
+  uint32_t *indices = workspace_get(ws, WORKSPACE_INDICES, dest_npart * sizeof(*indices));
+  XRETURN(indices != NULL, EXIT_FAILURE, "Could not allocate memory for %d probe indices\n", dest_npart);
+  struct philox_stream rng;
+  philox_stream_init(&rng, options->seed, 0, 0);
+  int status = random_subsample_indices(SAMPLER_VITTER, &rng, indices, dest_npart, nwindow);
+  if(status != EXIT_SUCCESS) {
+    return status;
+  }
+  struct selection selection;
+  if(workspace_selection(ws, 0, &selection, indices, dest_npart, nwindow) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  //the probe output has the same format as the real output -> only the number of particles differs
+  const int out_snapformat = options->snapformat > 0 ? options->snapformat:layout->index.snapformat;
+  const off_t label_bytes = (out_snapformat == 2) ? GADGET_LABEL_RECORD_BYTES:0;
+  get_output_offsets(nfields, itemsizes, dest_npart, label_bytes, out_offsets);
+  struct io_header out_hdr = hdr;
+  out_hdr.npart[1] = dest_npart;
+  const int dummy = sizeof(struct io_header);
+  char prefix[GADGET_LABEL_RECORD_BYTES + 4 + sizeof(struct io_header) + 4];
+  if(label_bytes > 0) {
+    fill_gadget_label_record(prefix, "HEAD", sizeof(struct io_header));
+  }
+  memcpy(prefix + label_bytes, &dummy, sizeof(dummy));
+  memcpy(prefix + label_bytes + sizeof(dummy), &out_hdr, sizeof(out_hdr));
+  memcpy(prefix + label_bytes + sizeof(dummy) + sizeof(out_hdr), &dummy, sizeof(dummy));
+  const struct io_output out = {.outputfile = probefile, .fd = -1, .prefix = prefix, .prefix_bytes = label_bytes + 4 + sizeof(struct io_header) + 4,
+                                .nfields = nfields, .in_offsets = in_offsets, .out_offsets = out_offsets, .itemsizes = itemsizes,
+                                .labels = label_bytes > 0 ? (const char (*)[GADGET_LABEL_LEN+1]) labels:NULL};
+
+  //untimed warm-up -> every strategy sees the same (hot) page cache
+  double elapsed, best = -1.0;
+  status = write_io_probe(get_io_strategy(IO_STRATEGY_PREAD), inputfile, probefile, options, &out, dest_npart, &selection, &elapsed);
+  fprintf(stderr,"Probing the I/O strategies with %d out of %d particles of `%s'\n", dest_npart, nwindow, inputfile);
+  for(int i=0;i<NUM_IO_STRATEGIES && status == EXIT_SUCCESS;i++) {
+    const struct io_strategy *strategy = get_io_strategy((enum io_strategy_type) i);
+    if(strategy->available == 0) {
+      continue;
     }
-    if(i <= nargs) {
-      fprintf(stderr,"\nMissing required parameters: \n");
-      for(i=argc;i<=nargs;i++)
-		fprintf(stderr,"\t\t %20s = `?'\n",argnames[i-1]);
+    double fastest_time = -1.0;
+    for(int repeat=0;repeat<IO_PROBE_REPEATS && status == EXIT_SUCCESS;repeat++) {
+      status = write_io_probe(strategy, inputfile, probefile, options, &out, dest_npart, &selection, &elapsed);
+      fastest_time = (fastest_time < 0.0 || elapsed < fastest_time) ? elapsed:fastest_time;
+    }
+    fprintf(stderr,"\t %-10s : %8.3lf ms\n", strategy->name, fastest_time*1e3);
+    if(best < 0.0 || fastest_time < best) {
+      best = fastest_time;
+      *fastest = strategy->type;
     }
-	fprintf(stderr,"\n\n");
-    exit(EXIT_FAILURE);
   }
+  return status;
+}
 
-  double fraction = atof(argv[1]);
-  XRETURN(fraction > 0 && fraction <= 1.0, EXIT_FAILURE, "Subsample fraction = %lf needs to be in (0,1]", fraction);
-  strncpy(input_filename,argv[2],MAXLEN);
-  strncpy(output_filename,argv[3],MAXLEN);
-  XRETURN(strncmp(input_filename,output_filename,MAXLEN) != 0, EXIT_FAILURE, "Input filename = `%s' and output filename = `%s' are the same",input_filename, output_filename);
-  const int nfiles = get_gadget_nfiles(input_filename);
-  struct io_header header = get_gadget_header(input_filename);
-  TotNumPart = get_Numpart(&header);
+/* Splits the comma-separated lists of fractions and output filenames (one output per fraction).
+   The fractions must be in decreasing order so that every level is nested within the previous
+   one. If exact_npart is not NULL, the first list holds the (decreasing) total numbers of particles
+   instead and the fractions are left for the caller. Returns the number of levels (-1 on error) */
+int parse_subsample_levels(const char *fraction_list, const char *output_list, double *fractions, int64_t *exact_npart,
+                           char (*output_filenames)[MAXLEN])
+{
+  //the lists are split in place -> only the individual entries need to fit into MAXLEN
+  int nlevels = 0, noutputs = 0;
+  for(const char *next = fraction_list;*next != '\0';) {
+      const size_t len = strcspn(next, ",");
+      char tok[MAXLEN];
+      XRETURN(len < MAXLEN, -1, "Fraction `%.*s...' is longer than %d characters\n", 32, next, MAXLEN-1);
+      memcpy(tok, next, len);
+      tok[len] = '\0';
+      next += len + (next[len] == ',');
+      if(len == 0) {
+          continue;
+      }
+      XRETURN(nlevels < MAX_SUBSAMPLE_LEVELS, -1, "At most %d fractions can be specified\n", MAX_SUBSAMPLE_LEVELS);
+      if(exact_npart != NULL) {
+          char *end = NULL;
+          exact_npart[nlevels] = strtoll(tok, &end, 10);
+          XRETURN(end != tok && *end == '\0' && exact_npart[nlevels] > 0, -1, "Number of particles = `%s' needs to be a positive integer\n", tok);
+          XRETURN(nlevels == 0 || exact_npart[nlevels] < exact_npart[nlevels-1], -1,
+                  "Numbers of particles must be in decreasing order (found %"PRId64" after %"PRId64")\n", exact_npart[nlevels], exact_npart[nlevels-1]);
+          nlevels++;
+          continue;
+      }
+      fractions[nlevels] = atof(tok);
+      XRETURN(fractions[nlevels] > 0 && fractions[nlevels] <= 1.0, -1, "Subsample fraction = %lf needs to be in (0,1]\n", fractions[nlevels]);
+      XRETURN(nlevels == 0 || fractions[nlevels] < fractions[nlevels-1], -1,
+              "Subsample fractions must be in decreasing order (found %lf after %lf)\n", fractions[nlevels], fractions[nlevels-1]);
+      nlevels++;
+  }
+  for(const char *next = output_list;*next != '\0';) {
+      const size_t len = strcspn(next, ",");
+      const char *tok = next;
+      next += len + (next[len] == ',');
+      if(len == 0) {
+          continue;
+      }
+      XRETURN(noutputs < nlevels, -1, "Found more output filenames than the %d fraction(s)\n", nlevels);
+      XRETURN(len < MAXLEN, -1, "Output filename `%.*s...' is longer than %d characters\n", 32, tok, MAXLEN-1);
+      memcpy(output_filenames[noutputs], tok, len);
+      output_filenames[noutputs][len] = '\0';
+      noutputs++;
+  }
+  XRETURN(nlevels > 0 && noutputs == nlevels, -1, "Expected one output filename for each of the %d fraction(s), found %d\n", nlevels, noutputs);
+  return nlevels;
+}
+
+/* Subsamples every file <input_filename>.<ifile> of one snapshot into the nested outputs
+   <output_filenames[level]>.<ifile>. With options->track, the particles whose IDs are in the index
+   are kept (instead of a random selection). next_input (NULL -> none) is the snapshot that follows
+   in a batch -> its first files are prefetched while the last files of this one are copied.
+   With --exact, the fractions are set from the exact numbers of particles */
+static int subsample_snapshot(const char *progname, const char *level_list, const char *input_filename, const char *output_list,
+                              const int nlevels, char (*output_filenames)[MAXLEN], double *fractions, const int64_t *exact_npart,
+                              const char *next_input, struct subsample_options *opts, struct metrics_writer *metrics)
+{
+  //the adjustments for this snapshot (e.g., no prefetch with O_DIRECT) stay local
+  struct subsample_options options = *opts;
+  const unsigned long seed = options.seed;
+  struct timespec tstart,t0,t1;
+  current_utc_time(&tstart);
+  if(options.track != NULL) {
+      //the particles were already picked (inside the region, from the ID list, or the exact numbers) in the reference snapshot
+      options.region.type = REGION_NONE;
+      options.id_list_file = NULL;
+      options.exact = 0;
+  }
+  for(int level=0;level<nlevels;level++) {
+      XRETURN(strncmp(input_filename,output_filenames[level],MAXLEN) != 0, EXIT_FAILURE,
+              "Input filename = `%s' and output filename = `%s' are the same",input_filename, output_filenames[level]);
+  }
+  //the header and the block offsets of every file are read once (in parallel) and re-used everywhere
+  struct snapshot_layout layout;
+  current_utc_time(&t0);
+  if(build_snapshot_layout(input_filename, options.layout_cache, &layout) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+  }
+  current_utc_time(&t1);
+  const int nfiles = layout.nfiles;
+  struct io_header header = layout.files[0].index.header;
+  const int64_t TotNumPart = get_Numpart(&header);
   XRETURN(header.npartTotal[0] == 0 && header.npartTotalHighWord[0]  == 0, EXIT_FAILURE, "Subsampling will not work with gas particles");
 
-  fprintf(stderr,"Running `%s' on %d files with the following parameters \n",argv[0],nfiles);
+  fprintf(stderr,"Read the layout of %d files (%d scanned, %d from the cache) in %0.3lf seconds\n",
+          nfiles, layout.nscanned, nfiles - layout.nscanned, REALTIME_ELAPSED_NS(t0,t1)*1e-9);
+
+  //the IDs in the list have the same width as the IDs in the snapshot
+  struct id_index id_list;
+  options.id_list = NULL;
+  if(options.id_list_file != NULL) {
+      current_utc_time(&t0);
+      if(load_id_list(&id_list, options.id_list_file, layout.files[0].id_bytes) != EXIT_SUCCESS) {
+          return EXIT_FAILURE;
+      }
+      current_utc_time(&t1);
+      fprintf(stderr,"Indexed the %"PRId64" IDs in `%s' in %0.3lf seconds\n", id_list.nids, options.id_list_file, REALTIME_ELAPSED_NS(t0,t1)*1e-9);
+      options.id_list = &id_list;
+  }
+
+  /* With --exact, every level gets exactly the requested number of particles -> the fractions
+     (used for the probe and for the particle mass) follow from the totals */
+  int64_t npart_in_files = 0;
+  for(int ifile=0;ifile<nfiles;ifile++) {
+      npart_in_files += layout.files[ifile].index.header.npart[1];
+  }
+  if(options.exact) {
+      XRETURN(options.sampler != SAMPLER_IDHASH && options.region.type == REGION_NONE && options.id_list == NULL, EXIT_FAILURE,
+              "Exact numbers of particles (--exact) can not be combined with the id-hash sampler, a region or an ID list\n");
+      for(int level=0;level<nlevels;level++) {
+          XRETURN(exact_npart[level] <= npart_in_files, EXIT_FAILURE, "Can not select %"PRId64" particles out of the %"PRId64" in the snapshot\n",
+                  exact_npart[level], npart_in_files);
+          fractions[level] = exact_npart[level]/(double) npart_in_files;
+      }
+  }
+
+  const int auto_strategy = (options.io_strategy == IO_STRATEGY_AUTO);
+  if(auto_strategy) {
+      char inputfile[MAXLEN], probefile[MAXLEN];
+      my_snprintf(inputfile, MAXLEN, "%s.0", input_filename);
+      my_snprintf(probefile, MAXLEN, "%s.probe", output_filenames[0]);
+      if(select_io_strategy(inputfile, &(layout.files[0]), probefile, fractions[0], &options, &options.io_strategy) != EXIT_SUCCESS) {
+          fprintf(stderr,"Error: Could not probe the I/O strategies with the input file `%s' and the output file `%s'\n", inputfile, probefile);
+          return EXIT_FAILURE;
+      }
+      //the following snapshots of a batch keep the strategy picked by the probe
+      opts->io_strategy = options.io_strategy;
+  }
+  fprintf(stderr,"Running `%s' on %d files with the following parameters \n",progname,nfiles);
   fprintf(stderr,"\n\t\t ---------------------------------------------\n");
-  for(int i=1;i<=nargs;i++) {
-	fprintf(stderr,"\t\t %-25s = %s \n",argnames[i-1],argv[i]);
+  fprintf(stderr,"\t\t %-25s = %s \n","fraction",level_list);
+  fprintf(stderr,"\t\t %-25s = %s \n","input file",input_filename);
+  fprintf(stderr,"\t\t %-25s = %s \n","output file",output_list);
+  if(options.track != NULL) {
+      fprintf(stderr,"\t\t %-25s = %"PRId64" (from `%s')\n","tracked IDs", options.track->nids, options.track->source);
+  }
+  fprintf(stderr,"\t\t %-25s = %s \n","sampler", sampler_type_name(options.sampler));
+  fprintf(stderr,"\t\t %-25s = %lu \n","seed", seed);
+  fprintf(stderr,"\t\t %-25s = %s%s \n","I/O strategy", io_strategy_type_name(options.io_strategy), auto_strategy ? " (auto)":"");
+  if(options.io_strategy == IO_STRATEGY_IO_URING) {
+      fprintf(stderr,"\t\t %-25s = %u \n","io_uring queue depth", options.queue_depth);
+  }
+  if(options.io_strategy == IO_STRATEGY_ODIRECT) {
+      //O_DIRECT reads do not go through the page cache -> prefetching would only waste memory
+      options.prefetch_depth = 0;
+  }
+  fprintf(stderr,"\t\t %-25s = %d \n","prefetch depth", options.prefetch_depth);
+  if(options.id_list != NULL) {
+      fprintf(stderr,"\t\t %-25s = %"PRId64" IDs (from `%s')\n","ID list", options.id_list->nids, options.id_list->source);
+  }
+  if(options.region.type != REGION_NONE) {
+      fprintf(stderr,"\t\t %-25s = ","region");
+      print_region(stderr, &options.region);
+      fprintf(stderr," (BoxSize = %g)\n", header.BoxSize);
+  }
+  fprintf(stderr,"\t\t %-25s = %d (input format = %d)\n","output format",
+          options.snapformat > 0 ? options.snapformat:layout.files[0].index.snapformat, layout.files[0].index.snapformat);
+  fprintf(stderr,"\t\t %-25s = %s \n","extra blocks", options.extra_blocks ? "yes":"no");
+  if(options.metrics_file != NULL) {
+      fprintf(stderr,"\t\t %-25s = %s \n","metrics", options.metrics_file);
   }
 #ifdef _OPENMP
 #pragma omp parallel
@@ -415,67 +850,240 @@ int main(int argc,char **argv)
       return EXIT_FAILURE;
   }
   
-  size_t id_bytes;
+  const size_t id_bytes = layout.files[0].id_bytes;
   int interrupted=0;
   size_t seedtable[nfiles];
-  int64_t nparttotal=0;
+  int64_t nparttotal[MAX_SUBSAMPLE_LEVELS] = {0};
+  //number of particles of every level in every file (level-major)
+  int64_t *file_npart = malloc((size_t) nlevels * nfiles * sizeof(*file_npart));
+  XRETURN(file_npart != NULL, EXIT_FAILURE, "Could not allocate memory for the number of particles in %d files\n", nfiles);
   fprintf(stderr,"Checking all input files ...\n");
   init_my_progressbar(nfiles, &interrupted);
   for(int ifile=0;ifile<nfiles;ifile++) {
-      seedtable[ifile] = SIZE_MAX * gsl_rng_uniform(all_procs_rng);
-      char inputfile[MAXLEN];
-      my_snprintf(inputfile,MAXLEN,"%s.%d",input_filename, ifile);
+      //the seed of every file is drawn directly from its position in the stream of the seed
+      seedtable[ifile] = philox_random_u64(seed, 0, 0, ifile);
       if(ifile == 0) {
-          id_bytes = get_gadget_id_bytes(inputfile);
+          XRETURN(id_bytes == 4 || id_bytes == 8, EXIT_FAILURE, "Gadget ID bytes = %zu must be 4 or 8\n", id_bytes);
           fprintf(stderr,"Gadget ID bytes = %zu\n",id_bytes);
           interrupted=1;
       }
-      struct io_header hdr = get_gadget_header(inputfile);
-      const int dest_npart = fraction * hdr.npart[1];
+      const struct io_header hdr = layout.files[ifile].index.header;
+      const int dest_npart = fractions[0] * hdr.npart[1];
       XRETURN((int) (dest_npart*3*sizeof(float))  < INT_MAX, EXIT_FAILURE, 
-              "Padding bytes will overflow, please reduce the value of fraction (currently, fraction = %lf)\n",fraction);
+              "Padding bytes will overflow, please reduce the value of fraction (currently, fraction = %lf)\n",fractions[0]);
       my_progressbar(ifile,&interrupted);
-      nparttotal += dest_npart;
+      for(int level=0;level<nlevels;level++) {
+          file_npart[level*nfiles + ifile] = (int) (fractions[level] * hdr.npart[1]);
+          nparttotal[level] += file_npart[level*nfiles + ifile];
+      }
   }
   finish_myprogressbar(&interrupted);
   fprintf(stderr,"Checking all input files .....done\n\n");  
 
+  /* The truncated fraction of every file falls short of the total. With --exact, the total of
+     each level is split over the files (nested within the split of the previous level) with a
+     multivariate hypergeometric draw -> the same as the per-file counts of a uniform random
+     selection of that many particles from the entire snapshot */
+  if(options.exact) {
+      current_utc_time(&t0);
+      //level 0 is split over the particles in the input files, every other level over the previous level
+      int64_t *file_sizes = malloc(nfiles * sizeof(*file_sizes));
+      XRETURN(file_sizes != NULL, EXIT_FAILURE, "Could not allocate memory for the number of particles in %d files\n", nfiles);
+      for(int ifile=0;ifile<nfiles;ifile++) {
+          file_sizes[ifile] = layout.files[ifile].index.header.npart[1];
+      }
+      for(int level=0;level<nlevels;level++) {
+          const int64_t *sizes = (level == 0) ? file_sizes:&(file_npart[(level-1)*nfiles]);
+          if(multivariate_hypergeometric_split(seed, level, nfiles, sizes, exact_npart[level], &(file_npart[level*nfiles])) != EXIT_SUCCESS) {
+              free(file_sizes);
+              return EXIT_FAILURE;
+          }
+          nparttotal[level] = exact_npart[level];
+      }
+      free(file_sizes);
+      current_utc_time(&t1);
+      fprintf(stderr,"Split the exact numbers of particles over %d files in %0.3lf seconds\n\n", nfiles, REALTIME_ELAPSED_NS(t0,t1)*1e-9);
+  }
+  //the tracked particles are only found while reading the IDs -> the per-file numbers are estimates
+  for(int level=0;level<nlevels && options.track != NULL;level++) {
+      nparttotal[level] = options.track->nlevel_ids[level];
+  }
+
   
-  int numdone=0, errorflag=0, savestatus=0;
-  
-  init_my_progressbar(nfiles, &interrupted);
+  int errorflag=0, savestatus=0;
+  int64_t level_npart_written[MAX_SUBSAMPLE_LEVELS] = {0};
+
+  /* Every finished output is recorded in the manifest. A resumed run re-uses the same seedtable
+     -> the redone files are identical to the ones an uninterrupted run would have written */
+  char manifest_file[MAXLEN], manifest_params[5*MAXLEN];
+  if(options.manifest_file != NULL) {
+      my_snprintf(manifest_file, MAXLEN, "%s", options.manifest_file);
+  } else {
+      my_snprintf(manifest_file, MAXLEN, "%s.manifest", output_filenames[0]);
+  }
+  const int nparams = my_snprintf(manifest_params, sizeof(manifest_params), "fractions=%s input=%s outputs=%s nfiles=%d sampler=%s seed=%lu format=%d extra_blocks=%d "
+              "region=%d,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g%s%s%s%s%s", level_list, input_filename, output_list, nfiles, sampler_type_name(options.sampler), seed,
+              options.snapformat, options.extra_blocks, (int) options.region.type, options.region.center[0], options.region.center[1],
+              options.region.center[2], options.region.half[0], options.region.half[1], options.region.half[2], options.exact ? " exact":"",
+              options.id_list != NULL ? " ids=":"", options.id_list != NULL ? options.id_list->source:"",
+              options.track != NULL ? " tracked=":"", options.track != NULL ? options.track->source:"");
+  XRETURN(nparams >= 0 && nparams < (int) sizeof(manifest_params), EXIT_FAILURE,
+          "The parameters of the run do not fit into the %zu bytes of the manifest line\n", sizeof(manifest_params));
+  struct manifest manifest;
+  if(open_manifest(&manifest, manifest_file, manifest_params, options.resume, nfiles, nlevels) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+  }
+  int nfiles_done = 0;
+  if(options.resume) {
+      current_utc_time(&t0);
+      if(validate_manifest(&manifest, output_filenames, seedtable) != EXIT_SUCCESS) {
+          return EXIT_FAILURE;
+      }
+      for(int ifile=0;ifile<nfiles;ifile++) {
+          if(manifest_file_done(&manifest, ifile)) {
+              for(int level=0;level<nlevels;level++) {
+                  level_npart_written[level] += manifest_file_npart(&manifest, ifile, level);
+              }
+              nfiles_done++;
+              continue;
+          }
+          //partial (or missing) outputs are written again from scratch
+          for(int level=0;level<nlevels;level++) {
+              char outputfile[MAXLEN];
+              my_snprintf(outputfile, MAXLEN, "%s.%d", output_filenames[level], ifile);
+              XRETURN(unlink(outputfile) == 0 || errno == ENOENT, EXIT_FAILURE, "Could not remove the partial output file `%s'\n", outputfile);
+          }
+      }
+      current_utc_time(&t1);
+      fprintf(stderr,"Resuming from `%s': %d out of %d files are already done (validated in %0.3lf seconds)\n",
+              manifest_file, nfiles_done, nfiles, REALTIME_ELAPSED_NS(t0,t1)*1e-9);
+  }
+  //files are handed out in order, so the next files to start are the ones just past the newest file being copied.
+  //prefetched_upto is the highest file index that has been (or is being) prefetched
+  int prefetched_upto = 0;
+  struct subsample_stats allstats = {.npart_written = 0, .bytes_copied = 0, .copy_time = 0.0, .pagecache_bytes = 0, .selection_bytes = 0,
+                                     .index_bytes = 0, .nselections = {0}, .metrics = NULL, .progress = NULL};
+  //the worker threads only bump atomic counters, the reports are printed from a separate thread
+  struct progress_reporter *progress = NULL;
+  if(options.progress_interval > 0.0) {
+      progress = malloc(sizeof(*progress));
+      XRETURN(progress != NULL, EXIT_FAILURE, "Could not allocate memory for the progress reporter\n");
+      //the expected number of particles is not known with a region (or an ID list)
+      int64_t nrecords = 0;
+      for(int level=0;level<nlevels && options.region.type == REGION_NONE && options.id_list == NULL;level++) {
+          nrecords += nparttotal[level] - level_npart_written[level];
+      }
+      if(nfiles_done == nfiles) {
+          free(progress);
+          progress = NULL;
+      } else if(start_progress_reporter(progress, nfiles - nfiles_done, nrecords, options.progress_interval) != EXIT_SUCCESS) {
+          return EXIT_FAILURE;
+      }
+  }
 #ifdef _OPENMP
-#pragma omp parallel shared(numdone, savestatus)
+#pragma omp parallel shared(savestatus)
   {
-      int nthreads = omp_get_num_threads();
       int tid = omp_get_thread_num();
 #pragma omp for schedule(dynamic)
 #endif      
       for(int ifile=0;ifile<nfiles;ifile++) {
-          if(errorflag == 0) {
-              //Setup the rng
-              gsl_rng * rng = gsl_rng_alloc(rng_type);
-              gsl_rng_set(rng, seedtable[ifile]);
+          if(errorflag == 0 && manifest_file_done(&manifest, ifile) == 0) {
+              if(progress != NULL) {
+                  progress_file_started(progress);
+              }
 
+              char inputfile[MAXLEN],outputfiles[MAX_SUBSAMPLE_LEVELS][MAXLEN];
+              //warm up to prefetch_depth files ahead of this one. Each file is claimed by exactly one thread and
+              //the window never runs more than prefetch_depth files ahead of the newest file being copied. In a
+              //batch, the window runs on into the first files of the next snapshot
+              const int prefetch_end = next_input != NULL ? nfiles + options.prefetch_depth:nfiles;
+              const int prefetch_last = ifile + options.prefetch_depth < prefetch_end ? ifile + options.prefetch_depth:prefetch_end-1;
+              int prefetch_first;
 #ifdef _OPENMP
-#pragma omp atomic
-              numdone++;
+#pragma omp critical(prefetch_window)
+#endif
+              {
+                  prefetch_first = prefetched_upto + 1;
+                  if(prefetch_last > prefetched_upto) {
+                      prefetched_upto = prefetch_last;
+                  }
+              }
+              for(int jfile=prefetch_first;jfile<=prefetch_last;jfile++) {
+                  if(jfile >= nfiles) {
+                      my_snprintf(inputfile,MAXLEN,"%s.%d",next_input,jfile-nfiles);
+                  } else {
+                      my_snprintf(inputfile,MAXLEN,"%s.%d",input_filename,jfile);
+                  }
+                  prefetch_file(inputfile);
+              }
 
-              if(tid == 0) 
-#endif              
-                  my_progressbar(numdone,&interrupted);
-              
-              char inputfile[MAXLEN],outputfile[MAXLEN];
               my_snprintf(inputfile,MAXLEN,"%s.%d",input_filename,ifile);
-              my_snprintf(outputfile, MAXLEN,"%s.%d",output_filename,ifile);
-              struct io_header hdr = get_gadget_header(inputfile);
-              const int dest_npart = fraction * hdr.npart[1];
-              int status = subsample_single_gadgetfile(dest_npart, inputfile, outputfile, id_bytes, rng, fraction, nparttotal);
+              int dest_npart[MAX_SUBSAMPLE_LEVELS];
+              for(int level=0;level<nlevels;level++) {
+                  my_snprintf(outputfiles[level], MAXLEN,"%s.%d",output_filenames[level],ifile);
+                  dest_npart[level] = (int) file_npart[level*nfiles + ifile];
+              }
+              struct file_metrics file_metrics;
+#ifdef _OPENMP
+              init_file_metrics(&file_metrics, ifile, tid);
+#else
+              init_file_metrics(&file_metrics, ifile, 0);
+#endif
+              struct subsample_stats stats = {.npart_written = 0, .bytes_copied = 0, .copy_time = 0.0, .pagecache_bytes = 0,
+                                              .selection_bytes = 0, .index_bytes = 0, .nselections = {0},
+                                              .metrics = metrics != NULL ? &file_metrics:NULL, .progress = progress};
+              int status = subsample_single_gadgetfile(nlevels, dest_npart, inputfile, &(layout.files[ifile]), outputfiles, id_bytes, seedtable[ifile],
+                                                       fractions, nparttotal, &options, &stats);
+              for(int level=0;level<nlevels && status == EXIT_SUCCESS;level++) {
+                  status = record_manifest_output(&manifest, ifile, level, outputfiles[level], seedtable[ifile], dest_npart[level]);
+              }
+              if(status == EXIT_SUCCESS && metrics != NULL) {
+                  status = write_file_metrics(metrics, inputfile, &file_metrics);
+              }
+              free_file_metrics(&file_metrics);
               if(status != EXIT_SUCCESS) {
                   savestatus = status;
                   errorflag = 1;
               }
-              gsl_rng_free(rng);
+              for(int level=0;level<nlevels;level++) {
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+                  level_npart_written[level] += dest_npart[level];
+              }
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+              allstats.npart_written += stats.npart_written;
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+              allstats.bytes_copied += stats.bytes_copied;
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+              allstats.copy_time += stats.copy_time;
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+              allstats.pagecache_bytes += stats.pagecache_bytes;
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+              allstats.selection_bytes += stats.selection_bytes;
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+              allstats.index_bytes += stats.index_bytes;
+              for(int t=0;t<NUM_SELECTION_TYPES;t++) {
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+                  allstats.nselections[t] += stats.nselections[t];
+              }
+              if(progress != NULL) {
+                  progress_file_done(progress);
+              }
               
               /* #ifdef _OPENMP           */
               /* #pragma omp critical(info) */
@@ -496,16 +1104,406 @@ int main(int argc,char **argv)
   }//omp parallel region
 #endif  
 
-  gsl_rng_free(all_procs_rng);
-  finish_myprogressbar(&interrupted);
+  free_snapshot_layout(&layout);
+  free(file_npart);
+  if(close_manifest(&manifest) != EXIT_SUCCESS) {
+      errorflag = 1;
+      savestatus = EXIT_FAILURE;
+  }
+  if(progress != NULL) {
+      stop_progress_reporter(progress);
+      free(progress);
+  }
 
   if(errorflag != 0) {
       return savestatus;
   }
+
+  /* The id-hash sampler (and the region selection and the tracked IDs) only knows the number of selected particles
+     once all the files have been written -> update the total number and the particle mass in the headers */
+  if(options.sampler == SAMPLER_IDHASH || options.region.type != REGION_NONE || options.id_list != NULL || options.track != NULL) {
+      for(int level=0;level<nlevels;level++) {
+          nparttotal[level] = level_npart_written[level];
+          XRETURN(nparttotal[level] > 0, EXIT_FAILURE, "No particles were selected with fraction = %lf\n", fractions[level]);
+      }
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+      for(int ifile=0;ifile<nfiles;ifile++) {
+          for(int level=0;level<nlevels;level++) {
+              char outputfile[MAXLEN];
+              //inside a region (or the ID list), every particle still stands for 1/fraction particles of the full snapshot.
+              //The tracked particles keep the mass they have in the outputs of the reference snapshot
+              double mass = (options.region.type != REGION_NONE || options.id_list != NULL) ? header.mass[1]/fractions[level]:
+                  header.mass[1] * TotNumPart/(double) nparttotal[level];
+              if(options.track != NULL) {
+                  mass = options.track->mass[level];
+              }
+              my_snprintf(outputfile, MAXLEN,"%s.%d",output_filenames[level],ifile);
+              if(update_gadget_header_npartTotal(outputfile, 1, nparttotal[level], mass) != EXIT_SUCCESS) {
+                  errorflag = 1;
+              }
+          }
+      }
+      if(errorflag != 0) {
+          return EXIT_FAILURE;
+      }
+  }
   
   current_utc_time(&t1);
-  fprintf(stderr,"subsample_Gadget> Done. Wrote %"PRId64" particles to file `%s'. Time taken = %6.2lf mins\n",
-		  nparttotal,output_filename,REALTIME_ELAPSED_NS(tstart, t1)*1e-9/60.0);
+  for(int level=0;level<nlevels;level++) {
+      fprintf(stderr,"subsample_Gadget> Done. Wrote %"PRId64" particles to file `%s' (fraction = %lf). Time taken = %6.2lf mins\n",
+              nparttotal[level],output_filenames[level],fractions[level],REALTIME_ELAPSED_NS(tstart, t1)*1e-9/60.0);
+  }
+  if(allstats.copy_time > 0.0) {
+      fprintf(stderr,"subsample_Gadget> Copied %0.3lf GB of particle data. Copy bandwidth = %0.3lf MB/s per thread (%0.3lf MB/s overall)\n",
+              allstats.bytes_copied/(1024.0*1024.0*1024.0),
+              allstats.bytes_copied/(1024.0*1024.0*allstats.copy_time),
+              allstats.bytes_copied/(1024.0*1024.0*REALTIME_ELAPSED_NS(tstart, t1)*1e-9));
+      fprintf(stderr,"subsample_Gadget> Page cache footprint = %0.3lf MB (input + output bytes resident in the page cache as each file finished)\n",
+              allstats.pagecache_bytes/(1024.0*1024.0));
+  }
+  if(allstats.index_bytes + allstats.selection_bytes > 0) {
+      fprintf(stderr,"subsample_Gadget> Selections (summed over the files) used %0.3lf MB: %0.3lf MB of 32-bit indices from the samplers "
+              "and %0.3lf MB of runs built from them or bitmaps written in their place. Stored as:",
+              (allstats.index_bytes + allstats.selection_bytes)/(1024.0*1024.0), allstats.index_bytes/(1024.0*1024.0),
+              allstats.selection_bytes/(1024.0*1024.0));
+      for(int t=0;t<NUM_SELECTION_TYPES;t++) {
+          fprintf(stderr," %s = %"PRId64"%s", selection_type_name((enum selection_type) t), allstats.nselections[t], t < NUM_SELECTION_TYPES-1 ? ",":"\n");
+      }
+  }
+  if(options.id_list != NULL) {
+      free_id_index(&id_list);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/* Reads the snapshots of a batch -> one `<snapshot name> <comma-separated output filenames>' per line
+   (blank lines and lines starting with `#' are skipped). Returns the number of snapshots (-1 on error) */
+static int read_batch_list(const char *fname, char (**inputs)[MAXLEN], char (**outputs)[MAXLEN])
+{
+  FILE *fp = my_fopen(fname, "r");
+  if(fp == NULL) {
+      return -1;
+  }
+  int nsnapshots = 0, nalloc = 0;
+  char line[3*MAXLEN];
+  while(fgets(line, sizeof(line), fp) != NULL) {
+      char *saveptr;
+      const char *input = strtok_r(line, " \t\n", &saveptr);
+      if(input == NULL || input[0] == '#') {
+          continue;
+      }
+      const char *output_list = strtok_r(NULL, " \t\n", &saveptr);
+      XRETURN(output_list != NULL && strtok_r(NULL, " \t\n", &saveptr) == NULL, -1,
+              "Expected `<snapshot name> <output filenames>' for `%s' in the batch `%s'\n", input, fname);
+      if(nsnapshots == nalloc) {
+          nalloc = nalloc > 0 ? 2*nalloc:16;
+          *inputs = my_realloc(*inputs, MAXLEN, nalloc, "batch inputs");
+          *outputs = my_realloc(*outputs, MAXLEN, nalloc, "batch outputs");
+          XRETURN(*inputs != NULL && *outputs != NULL, -1, "Could not allocate memory for %d snapshots in the batch `%s'\n", nalloc, fname);
+      }
+      my_snprintf((*inputs)[nsnapshots], MAXLEN, "%s", input);
+      my_snprintf((*outputs)[nsnapshots], MAXLEN, "%s", output_list);
+      nsnapshots++;
+  }
+  fclose(fp);
+  XRETURN(nsnapshots > 0, -1, "The batch `%s' does not contain any snapshots\n", fname);
+  return nsnapshots;
+}
+
+int main(int argc,char **argv) 
+{
+  const char argnames[][100]={"fraction","input file","output file"};
+  int nargs=sizeof(argnames)/(sizeof(char)*100);
+  char input_filename[MAXLEN];
+  char output_filenames[MAX_SUBSAMPLE_LEVELS][MAXLEN];
+  double fractions[MAX_SUBSAMPLE_LEVELS];
+  struct timespec tstart,t0,t1;
+  int64_t nparticles_written=0,nparticles_withmass=0;
+  unsigned long seed = 42;
+  struct subsample_options options = {.sampler = SAMPLER_VITTER, .seed = seed, .io_strategy = IO_STRATEGY_DEFAULT, .queue_depth = 64, .prefetch_depth = 2, .snapformat = 0, .extra_blocks = 1, .layout_cache = NULL,
+                                        .region = {.type = REGION_NONE}, .region_cache = NULL, .metrics_file = NULL,
+                                        .progress_interval = PROGRESS_INTERVAL, .manifest_file = NULL, .resume = 0, .exact = 0, .track = NULL, .id_list_file = NULL, .id_list = NULL};
+  const char *batch_file = NULL;
+  current_utc_time(&tstart);
+
+  const struct option long_options[] = {
+    {"sampler", required_argument, NULL, 's'},
+    {"seed", required_argument, NULL, 'r'},
+    {"queue-depth", required_argument, NULL, 'q'},
+    {"prefetch-depth", required_argument, NULL, 'p'},
+    {"output-format", required_argument, NULL, 'f'},
+    {"no-extra-blocks", no_argument, NULL, 'n'},
+    {"layout-cache", required_argument, NULL, 'c'},
+    {"box", required_argument, NULL, 'B'},
+    {"sphere", required_argument, NULL, 'S'},
+    {"region-cache", required_argument, NULL, 'C'},
+    {"io-strategy", required_argument, NULL, 'i'},
+    {"metrics", required_argument, NULL, 'm'},
+    {"progress-interval", required_argument, NULL, 'P'},
+    {"manifest", required_argument, NULL, 'M'},
+    {"resume", no_argument, NULL, 'R'},
+    {"exact", no_argument, NULL, 'N'},
+    {"batch", required_argument, NULL, 'b'},
+    {"id-list", required_argument, NULL, 'I'},
+    {NULL, 0, NULL, 0}
+  };
+  int opt, bad_option=0;
+  while((opt = getopt_long(argc, argv, "s:r:q:p:f:nc:B:S:C:i:m:P:M:RNb:I:", long_options, NULL)) != -1) {
+      switch(opt) {
+      case 's':
+          if(parse_sampler_type(optarg, &options.sampler) != EXIT_SUCCESS) {
+              bad_option = 1;
+          }
+          break;
+      case 'r':
+          seed = strtoul(optarg, NULL, 10);
+          options.seed = seed;
+          break;
+      case 'q':
+          options.queue_depth = (unsigned) atoi(optarg);
+          if(options.queue_depth == 0) {
+              fprintf(stderr,"Error: queue depth = `%s' must be a positive integer\n", optarg);
+              bad_option = 1;
+          }
+          break;
+      case 'p':
+          options.prefetch_depth = atoi(optarg);
+          if(options.prefetch_depth < 0) {
+              fprintf(stderr,"Error: prefetch depth = `%s' must be a non-negative integer\n", optarg);
+              bad_option = 1;
+          }
+          break;
+      case 'f':
+          options.snapformat = atoi(optarg);
+          if(options.snapformat != 1 && options.snapformat != 2) {
+              fprintf(stderr,"Error: output format = `%s' must be 1 or 2\n", optarg);
+              bad_option = 1;
+          }
+          break;
+      case 'n':
+          options.extra_blocks = 0;
+          break;
+      case 'c':
+          options.layout_cache = optarg;
+          break;
+      case 'B':
+          if(parse_region(optarg, REGION_BOX, &options.region) != EXIT_SUCCESS) {
+              bad_option = 1;
+          }
+          break;
+      case 'S':
+          if(parse_region(optarg, REGION_SPHERE, &options.region) != EXIT_SUCCESS) {
+              bad_option = 1;
+          }
+          break;
+      case 'C':
+          options.region_cache = optarg;
+          break;
+      case 'i':
+          if(parse_io_strategy_type(optarg, &options.io_strategy) != EXIT_SUCCESS) {
+              bad_option = 1;
+          }
+          break;
+      case 'm':
+          options.metrics_file = optarg;
+          break;
+      case 'P':
+          options.progress_interval = atof(optarg);
+          if(options.progress_interval < 0.0) {
+              fprintf(stderr,"Error: progress interval = `%s' must be a non-negative number of seconds\n", optarg);
+              bad_option = 1;
+          }
+          break;
+      case 'M':
+          options.manifest_file = optarg;
+          break;
+      case 'R':
+          options.resume = 1;
+          break;
+      case 'N':
+          options.exact = 1;
+          break;
+      case 'b':
+          batch_file = optarg;
+          break;
+      case 'I':
+          options.id_list_file = optarg;
+          break;
+      default:
+          bad_option = 1;
+          break;
+      }
+  }
+  //discard the options but keep the program name as argv[0]
+  argv[optind-1] = argv[0];
+  argc -= optind-1;
+  argv += optind-1;
+
+  if (argc != 4 || bad_option)  {
+	fprintf(stderr,"ERROR: %s usage - [options] <fraction>  <gadget snapshot name>  <output filename>\n",argv[0]);
+	fprintf(stderr,"Each file will be subsampled to get (roughly) that fraction for each particle-type\n");
+	fprintf(stderr,"Nested subsamples are written in one pass with comma-separated lists, e.g., `0.1,0.01,0.001 snap out10,out1,out0.1'.\n"
+	        "Fractions must be decreasing and every subsample is a subset of the previous one\n");
+	fprintf(stderr,"Options:\n");
+	fprintf(stderr,"\t -s, --sampler=<vitter|reference|idhash>\n"
+	        "\t                                     algorithm to select the random particles (default `%s').\n"
+	        "\t                                     `reference' is the O(N) selection sampler (as in gsl), kept for statistical comparisons\n",
+	        sampler_type_name(SAMPLER_VITTER));
+	fprintf(stderr,"\t                                     `idhash' keeps a particle if a keyed hash of its ID is below the fraction. The\n"
+	        "\t                                     selection is independent of the number of threads and of the files\n");
+	fprintf(stderr,"\t -r, --seed=<unsigned long>          seed for the random number generator and the id-hash (default %lu)\n", seed);
+	fprintf(stderr,"\t -i, --io-strategy=<name|auto>       how the selected particles are copied to the output files (default `%s').\n"
+	        "\t                                     One of:", io_strategy_type_name(IO_STRATEGY_DEFAULT));
+	for(int i=0;i<NUM_IO_STRATEGIES;i++) {
+	  if(get_io_strategy((enum io_strategy_type) i)->available) {
+	    fprintf(stderr," `%s'", io_strategy_type_name((enum io_strategy_type) i));
+	  }
+	}
+	fprintf(stderr,"\n\t                                     `auto' times a short probe of every strategy on the first file and picks the fastest\n");
+	fprintf(stderr,"\t -q, --queue-depth=<int>             number of reads kept in flight per thread by the io_uring strategy (default %u)\n",
+	        options.queue_depth);
+	fprintf(stderr,"\t -p, --prefetch-depth=<int>          number of input files to read ahead into the page cache while the current files\n"
+	        "\t                                     are being copied, 0 disables the prefetch (default %d)\n", options.prefetch_depth);
+	fprintf(stderr,"\t -f, --output-format=<1|2>           Gadget snapshot format of the output files (default: same as the input)\n");
+	fprintf(stderr,"\t -n, --no-extra-blocks               only write the POS, VEL and ID blocks. By default, every other per-particle\n"
+	        "\t                                     block in the input (e.g., POT, ACCEL) is subsampled as well\n");
+	fprintf(stderr,"\t -c, --layout-cache=<file>           cache for the header and block offsets of every input file. Entries are\n"
+	        "\t                                     re-used if the size and mtime of the file are unchanged. The snapshots of\n"
+	        "\t                                     --batch use <file>.1, <file>.2, ... (in the order of the batch)\n");
+	fprintf(stderr,"\t -B, --box=<xmin,ymin,zmin,xmax,ymax,zmax>  only keep the particles inside the box (periodic with BoxSize; use\n"
+	        "\t                                     max > BoxSize to wrap around). The fraction then applies to the particles in the box\n");
+	fprintf(stderr,"\t -S, --sphere=<x,y,z,radius>         only keep the particles inside the sphere (periodic with BoxSize)\n");
+	fprintf(stderr,"\t -I, --id-list=<file>                only keep the particles whose IDs are in the file (e.g., the particles of a halo\n"
+	        "\t                                     catalogue) -> raw 4- or 8-byte IDs, the same size as the IDs in the snapshot.\n"
+	        "\t                                     The fraction then applies to the listed particles (use 1 to keep all of them)\n");
+	fprintf(stderr,"\t -C, --region-cache=<directory>      cache for the coarse cell index of every input file used by --box and --sphere.\n"
+	        "\t                                     Entries are re-used if the size and mtime of the file are unchanged\n");
+	fprintf(stderr,"\t -m, --metrics=<file>                per-file and per-phase timings (open, select, fallocate, every field, close) and a\n"
+	        "\t                                     final summary. JSON lines if the name ends in `.json' or `.jsonl', CSV otherwise\n");
+	fprintf(stderr,"\t -P, --progress-interval=<seconds>   seconds between the progress reports (percent done, GB/s, ETA and active\n"
+	        "\t                                     files), 0 disables the reports (default %g)\n", options.progress_interval);
+	fprintf(stderr,"\t -M, --manifest=<file>               every finished output file (size, checksum, seed) is recorded here\n"
+	        "\t                                     (default: <first output filename>.manifest)\n");
+	fprintf(stderr,"\t -R, --resume                        continue an interrupted run -> only the input files without valid outputs\n"
+	        "\t                                     in the manifest are redone. The parameters must be the same\n");
+	fprintf(stderr,"\t -N, --exact                         the first argument holds the exact total numbers of particles (e.g., `1000000,1000')\n"
+	        "\t                                     instead of fractions. The totals are split over the files with a multivariate\n"
+	        "\t                                     hypergeometric draw (not with --sampler=idhash, --box, --sphere or --id-list)\n");
+	fprintf(stderr,"\t -b, --batch=<file>                  more snapshots (e.g., later outputs of the simulation), one `<snapshot name> <output\n"
+	        "\t                                     filenames>' per line. Every snapshot keeps the particles (matched by ID) that were\n"
+	        "\t                                     selected in the first one. --manifest only applies to the first snapshot\n");
+    fprintf(stderr,"\nFound: %d parameters\n ",argc-1);
+	int i;
+    for(i=1;i<argc;i++) {
+      if(i <= nargs)
+		fprintf(stderr,"\t\t %s = `%s' \n",argnames[i-1],argv[i]);
+      else
+		fprintf(stderr,"\t\t <> = `%s' \n",argv[i]);
+    }
+    if(i <= nargs) {
+      fprintf(stderr,"\nMissing required parameters: \n");
+      for(i=argc;i<=nargs;i++)
+		fprintf(stderr,"\t\t %20s = `?'\n",argnames[i-1]);
+    }
+	fprintf(stderr,"\n\n");
+    exit(EXIT_FAILURE);
+  }
+
+  int64_t exact_npart[MAX_SUBSAMPLE_LEVELS] = {0};
+  const int nlevels = parse_subsample_levels(argv[1], argv[3], fractions, options.exact ? exact_npart:NULL, output_filenames);
+  if(nlevels < 0) {
+      return EXIT_FAILURE;
+  }
+  strncpy(input_filename,argv[2],MAXLEN);
+
+  //every snapshot of a batch re-uses the selection of the first one -> the same particles (by ID) in every output
+  int nbatch = 0;
+  char (*batch_inputs)[MAXLEN] = NULL, (*batch_outputs)[MAXLEN] = NULL;
+  if(batch_file != NULL) {
+      nbatch = read_batch_list(batch_file, &batch_inputs, &batch_outputs);
+      if(nbatch < 0) {
+          return EXIT_FAILURE;
+      }
+  }
+  struct metrics_writer *metrics = NULL;
+  if(options.metrics_file != NULL) {
+      metrics = malloc(sizeof(*metrics));
+      XRETURN(metrics != NULL, EXIT_FAILURE, "Could not allocate memory for the metrics writer\n");
+      if(open_metrics_writer(metrics, options.metrics_file) != EXIT_SUCCESS) {
+          return EXIT_FAILURE;
+      }
+  }
+  //one workspace per thread, re-used for every file (of every snapshot) the thread subsamples
+#ifdef _OPENMP
+  if(init_workspaces(omp_get_max_threads()) != EXIT_SUCCESS) {
+#else
+  if(init_workspaces(1) != EXIT_SUCCESS) {
+#endif
+      return EXIT_FAILURE;
+  }
+
+  if(subsample_snapshot(argv[0], argv[1], input_filename, argv[3], nlevels, output_filenames, fractions, exact_npart,
+                        nbatch > 0 ? batch_inputs[0]:NULL, &options, metrics) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+  }
+  if(nbatch > 0) {
+      //the particles are re-ordered between the outputs of a simulation -> matched by ID
+      struct id_index track;
+      current_utc_time(&t0);
+      if(build_id_index_from_snapshots(&track, nlevels, output_filenames) != EXIT_SUCCESS) {
+          return EXIT_FAILURE;
+      }
+      current_utc_time(&t1);
+      fprintf(stderr,"Indexed the %"PRId64" particle IDs of `%s' (and %d nested levels) in %0.3lf seconds\n\n",
+              track.nids, output_filenames[0], nlevels-1, REALTIME_ELAPSED_NS(t0,t1)*1e-9);
+      //every snapshot of the batch has its own (default) manifest and its own layout cache
+      struct subsample_options batch_options = options;
+      batch_options.track = &track;
+      batch_options.manifest_file = NULL;
+      char batch_layout_cache[MAXLEN];
+      for(int isnap=0;isnap<nbatch;isnap++) {
+          if(options.layout_cache != NULL) {
+              my_snprintf(batch_layout_cache, MAXLEN, "%s.%d", options.layout_cache, isnap+1);
+              batch_options.layout_cache = batch_layout_cache;
+          }
+          char snapshot_outputs[MAX_SUBSAMPLE_LEVELS][MAXLEN];
+          double snapshot_fractions[MAX_SUBSAMPLE_LEVELS];
+          memcpy(snapshot_fractions, fractions, sizeof(snapshot_fractions));
+          XRETURN(parse_subsample_levels(argv[1], batch_outputs[isnap], snapshot_fractions, options.exact ? exact_npart:NULL, snapshot_outputs) == nlevels,
+                  EXIT_FAILURE, "Snapshot `%s' in the batch `%s' needs one output filename for each of the %d levels\n",
+                  batch_inputs[isnap], batch_file, nlevels);
+          if(subsample_snapshot(argv[0], argv[1], batch_inputs[isnap], batch_outputs[isnap], nlevels, snapshot_outputs, snapshot_fractions, exact_npart,
+                                isnap + 1 < nbatch ? batch_inputs[isnap+1]:NULL, &batch_options, metrics) != EXIT_SUCCESS) {
+              return EXIT_FAILURE;
+          }
+      }
+      free_id_index(&track);
+      free(batch_inputs);
+      free(batch_outputs);
+  }
+
+  current_utc_time(&t1);
+  if(metrics != NULL) {
+#ifdef _OPENMP
+      const int nthreads = omp_get_max_threads();
+#else
+      const int nthreads = 1;
+#endif
+      if(close_metrics_writer(metrics, REALTIME_ELAPSED_NS(tstart, t1)*1e-9, nthreads) != EXIT_SUCCESS) {
+          return EXIT_FAILURE;
+      }
+      fprintf(stderr,"subsample_Gadget> Wrote the per-file metrics to `%s'\n", options.metrics_file);
+      free(metrics);
+  }
+  print_workspace_stats(stderr);
+  free_workspaces();
+  int64_t syscr = 0, syscw = 0;
+  if(get_io_syscalls(&syscr, &syscw) == EXIT_SUCCESS) {
+      fprintf(stderr,"subsample_Gadget> I/O system calls: reads = %"PRId64" writes = %"PRId64"\n", syscr, syscw);
+  }
 
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,226 @@
+/* File: manifest.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "manifest.h"
+#include "utils.h"
+#include "macros.h"
+
+#define MANIFEST_PARAMS_TAG  "# subsample_Gadget manifest: "
+
+static uint64_t checksum_word(uint64_t h, const uint64_t w)
+{
+  h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+  return h ^ (h >> 29);
+}
+
+/* Checksums everything after the header block of a (format-1 or format-2) Gadget file */
+static int checksum_gadget_file(const char *fname, int64_t *size, uint64_t *checksum)
+{
+  const int fd = open(fname, O_RDONLY);
+  if(fd < 0) {
+    return EXIT_FAILURE;
+  }
+  struct stat sb;
+  int32_t dummy = 0;
+  if(fstat(fd, &sb) < 0 || pread(fd, &dummy, sizeof(dummy), 0) != sizeof(dummy)) {
+    close(fd);
+    return EXIT_FAILURE;
+  }
+  //a format-2 file starts with the 8-byte label record
+  off_t offset = (dummy == GADGET_LABEL_LEN + 4 ? GADGET_LABEL_RECORD_BYTES:0) + 4 + sizeof(struct io_header) + 4;
+  char *buf = malloc(MANIFEST_CHECKSUM_BUFSIZE);
+  if(buf == NULL) {
+    close(fd);
+    return EXIT_FAILURE;
+  }
+  uint64_t h = 0xcbf29ce484222325ULL;
+  int status = EXIT_SUCCESS;
+  while(offset < sb.st_size) {
+    const size_t nbytes = (sb.st_size - offset) < MANIFEST_CHECKSUM_BUFSIZE ? (size_t) (sb.st_size - offset):MANIFEST_CHECKSUM_BUFSIZE;
+    if(pread(fd, buf, nbytes, offset) != (ssize_t) nbytes) {
+      status = EXIT_FAILURE;
+      break;
+    }
+    size_t i = 0;
+    for(;i + sizeof(uint64_t) <= nbytes;i+=sizeof(uint64_t)) {
+      uint64_t w;
+      memcpy(&w, buf + i, sizeof(w));
+      h = checksum_word(h, w);
+    }
+    if(i < nbytes) {
+      uint64_t w = 0;
+      memcpy(&w, buf + i, nbytes - i);
+      h = checksum_word(h, w);
+    }
+    offset += nbytes;
+  }
+  free(buf);
+  close(fd);
+  *size = sb.st_size;
+  *checksum = h;
+  return status;
+}
+
+static int read_manifest(struct manifest *m, const char *fname, const char *params)
+{
+  FILE *fp = fopen(fname, "r");
+  if(fp == NULL) {
+    return errno == ENOENT ? EXIT_SUCCESS:EXIT_FAILURE;//nothing finished yet
+  }
+  //the params line holds the (arbitrarily long) input and output names -> read whole with getline
+  char *line = NULL;
+  size_t linesize = 0;
+  int status = EXIT_SUCCESS;
+  if(getline(&line, &linesize, fp) < 0 || strncmp(line, MANIFEST_PARAMS_TAG, strlen(MANIFEST_PARAMS_TAG)) != 0 ||
+     strchr(line, '\n') == NULL) {
+    fprintf(stderr,"Error: `%s' is not a subsample_Gadget manifest (or its first line is incomplete)\n", fname);
+    status = EXIT_FAILURE;
+  } else {
+    line[strcspn(line, "\n")] = '\0';
+    if(strcmp(line + strlen(MANIFEST_PARAMS_TAG), params) != 0) {
+      fprintf(stderr,"Error: Can not resume -- the manifest `%s' was written by a run with different parameters.\n"
+              "Manifest: %s\nThis run: %s\n", fname, line + strlen(MANIFEST_PARAMS_TAG), params);
+      status = EXIT_FAILURE;
+    }
+  }
+  while(status == EXIT_SUCCESS && getline(&line, &linesize, fp) >= 0) {
+    int ifile, level;
+    struct manifest_entry e;
+    //the last line may be incomplete if the run died while writing it -> skipped
+    if(strchr(line, '\n') == NULL ||
+       sscanf(line, "%d %d %"SCNu64" %"SCNd64" %"SCNd64" %"SCNx64, &ifile, &level, &e.seed, &e.npart, &e.size, &e.checksum) != 6 ||
+       ifile < 0 || ifile >= m->nfiles || level < 0 || level >= m->nlevels) {
+      continue;
+    }
+    e.done = 1;
+    m->entries[ifile*m->nlevels + level] = e;
+  }
+  free(line);
+  fclose(fp);
+  return status;
+}
+
+int open_manifest(struct manifest *m, const char *fname, const char *params, const int resume, const int nfiles, const int nlevels)
+{
+  m->nfiles = nfiles;
+  m->nlevels = nlevels;
+  m->fp = NULL;
+  m->entries = calloc((size_t) nfiles * nlevels, sizeof(*(m->entries)));
+  XRETURN(m->entries != NULL, EXIT_FAILURE, "Could not allocate memory for the manifest of %d files\n", nfiles);
+  if(resume) {
+    if(read_manifest(m, fname, params) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+    }
+  } else {
+    FILE *fp = fopen(fname, "r");
+    if(fp != NULL) {
+      fclose(fp);
+      fprintf(stderr,"Error: Manifest `%s' already exists. Use --resume to continue that run, or remove it\n", fname);
+      return EXIT_FAILURE;
+    }
+  }
+
+  //the entries are always appended -> a resumed run keeps the entries of the earlier runs
+  m->fp = my_fopen(fname, "a");
+  if(m->fp == NULL) {
+    return EXIT_FAILURE;
+  }
+  if(fseek(m->fp, 0, SEEK_END) == 0 && ftell(m->fp) == 0) {
+    fprintf(m->fp, MANIFEST_PARAMS_TAG "%s\n", params);
+    fflush(m->fp);
+  }
+  return EXIT_SUCCESS;
+}
+
+int validate_manifest(struct manifest *m, char (*output_basenames)[MAXLEN], const size_t *seeds)
+{
+  int errorflag = 0;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for(int ifile=0;ifile<m->nfiles;ifile++) {
+    struct manifest_entry *entries = &(m->entries[ifile*m->nlevels]);
+    int valid = 1;
+    for(int level=0;level<m->nlevels && valid;level++) {
+      char outputfile[MAXLEN];
+      int64_t size;
+      uint64_t checksum;
+      if(entries[level].done == 0 || entries[level].seed != (uint64_t) seeds[ifile]) {
+        valid = 0;
+        break;
+      }
+      if(snprintf(outputfile, MAXLEN, "%s.%d", output_basenames[level], ifile) >= MAXLEN) {
+        errorflag = 1;
+        valid = 0;
+        break;
+      }
+      valid = (checksum_gadget_file(outputfile, &size, &checksum) == EXIT_SUCCESS &&
+               size == entries[level].size && checksum == entries[level].checksum);
+    }
+    //all of the levels of an input file are written together -> redo all of them
+    for(int level=0;level<m->nlevels && valid == 0;level++) {
+      entries[level].done = 0;
+    }
+  }
+  return errorflag == 0 ? EXIT_SUCCESS:EXIT_FAILURE;
+}
+
+int manifest_file_done(const struct manifest *m, const int ifile)
+{
+  for(int level=0;level<m->nlevels;level++) {
+    if(m->entries[ifile*m->nlevels + level].done == 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int64_t manifest_file_npart(const struct manifest *m, const int ifile, const int level)
+{
+  return m->entries[ifile*m->nlevels + level].npart;
+}
+
+int record_manifest_output(struct manifest *m, const int ifile, const int level, const char *outputfile,
+                           const uint64_t seed, const int64_t npart)
+{
+  struct manifest_entry e = {.done = 1, .seed = seed, .npart = npart};
+  XRETURN(checksum_gadget_file(outputfile, &e.size, &e.checksum) == EXIT_SUCCESS, EXIT_FAILURE,
+          "Could not checksum the output file `%s'\n", outputfile);
+  int status = EXIT_SUCCESS;
+#ifdef _OPENMP
+#pragma omp critical(manifest)
+#endif
+  {
+    m->entries[ifile*m->nlevels + level] = e;
+    fprintf(m->fp, "%d %d %"PRIu64" %"PRId64" %"PRId64" %016"PRIx64" %s\n", ifile, level, e.seed, e.npart, e.size, e.checksum, outputfile);
+    //flushed right away -> the entry survives if the run dies later
+    if(fflush(m->fp) != 0) {
+      status = EXIT_FAILURE;
+    }
+  }
+  XRETURN(status == EXIT_SUCCESS, EXIT_FAILURE, "Could not write the manifest entry for `%s'\n", outputfile);
+  return EXIT_SUCCESS;
+}
+
+int close_manifest(struct manifest *m)
+{
+  int status = EXIT_SUCCESS;
+  if(m->fp != NULL && fclose(m->fp) != 0) {
+    perror(NULL);
+    status = EXIT_FAILURE;
+  }
+  m->fp = NULL;
+  free(m->entries);
+  m->entries = NULL;
+  return status;
+}
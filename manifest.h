@@ -0,0 +1,59 @@
+/* File: manifest.h */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "gadget_utils.h"
+
+/* Size (in bytes) of the reads used to checksum an output file */
+#ifndef MANIFEST_CHECKSUM_BUFSIZE
+#define MANIFEST_CHECKSUM_BUFSIZE  (4*1024*1024)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* One finished output file */
+    struct manifest_entry
+    {
+        int done;
+        uint64_t seed;
+        int64_t npart;
+        int64_t size;
+        uint64_t checksum;//over everything after the header -> the headers are patched once all the files are done
+    };
+
+    /* Completion manifest of a run. The first line holds the parameters of the run and every
+       other line is appended (and flushed) as soon as an output file is finished:
+           <input file index> <level> <seed> <npart> <size in bytes> <checksum> <output file>
+       A resumed run must have the same parameters and only redoes the input files without
+       a valid entry for every level */
+    struct manifest
+    {
+        FILE *fp;
+        int nfiles;
+        int nlevels;
+        struct manifest_entry *entries;//nfiles x nlevels
+    };
+
+    /* Creates a new manifest (resume == 0, the file must not exist) or reads an existing one
+       (resume == 1, params must match) and re-opens it to append the new entries */
+    extern int open_manifest(struct manifest *m, const char *fname, const char *params, const int resume, const int nfiles, const int nlevels);
+
+    /* Checks the seed and the size and the checksum of every finished output file <output_basenames[level]>.<ifile>.
+       Input files with a missing or modified output (or a different seed) are marked as not done */
+    extern int validate_manifest(struct manifest *m, char (*output_basenames)[MAXLEN], const size_t *seeds);
+    extern int manifest_file_done(const struct manifest *m, const int ifile);
+    extern int64_t manifest_file_npart(const struct manifest *m, const int ifile, const int level);
+
+    /* Checksums outputfile and appends its entry (thread-safe) */
+    extern int record_manifest_output(struct manifest *m, const int ifile, const int level, const char *outputfile,
+                                      const uint64_t seed, const int64_t npart);
+    extern int close_manifest(struct manifest *m);
+
+#ifdef __cplusplus
+}
+#endif
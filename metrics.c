@@ -0,0 +1,218 @@
+/* File: metrics.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "metrics.h"
+#include "utils.h"
+#include "macros.h"
+
+static const char metrics_phase_names[NUM_METRICS_PHASES][16] = {"open", "select", "fallocate", "field", "fields", "close"};
+
+const char * metrics_phase_name(const enum metrics_phase phase)
+{
+  if(phase < 0 || phase >= NUM_METRICS_PHASES) {
+    return "unknown";
+  }
+  return metrics_phase_names[phase];
+}
+
+void init_file_metrics(struct file_metrics *m, const int ifile, const int thread)
+{
+  memset(m, 0, sizeof(*m));
+  m->ifile = ifile;
+  m->thread = thread;
+}
+
+int add_file_metrics(struct file_metrics *m, const int level, const enum metrics_phase phase, const char *field,
+                     const int64_t bytes, const double seconds)
+{
+  if(m == NULL) {
+    return EXIT_SUCCESS;
+  }
+  if(m->nrecords == m->maxrecords) {
+    const int maxrecords = m->maxrecords > 0 ? 2*m->maxrecords:32;
+    struct metrics_record *records = realloc(m->records, maxrecords * sizeof(*records));
+    XRETURN(records != NULL, EXIT_FAILURE, "Could not allocate memory for %d metrics records\n", maxrecords);
+    m->records = records;
+    m->maxrecords = maxrecords;
+  }
+  struct metrics_record *r = &(m->records[m->nrecords]);
+  r->level = level;
+  r->phase = phase;
+  //the labels are padded with spaces (e.g., "ID  ")
+  int len = 0;
+  for(;field != NULL && len < GADGET_LABEL_LEN && field[len] != '\0' && field[len] != ' ';len++) {
+    r->field[len] = field[len];
+  }
+  r->field[len] = '\0';
+  r->bytes = bytes;
+  r->seconds = seconds;
+  m->nrecords++;
+  return EXIT_SUCCESS;
+}
+
+void free_file_metrics(struct file_metrics *m)
+{
+  free(m->records);
+  m->records = NULL;
+  m->nrecords = m->maxrecords = 0;
+}
+
+/* Only the copy phases move the bytes -> the other phases report the bytes (mapped or reserved) but no bandwidth */
+static double bandwidth_MBps(const enum metrics_phase phase, const int64_t bytes, const double seconds)
+{
+  if(phase != METRICS_FIELD && phase != METRICS_FIELDS) {
+    return 0.0;
+  }
+  return (bytes > 0 && seconds > 0.0) ? bytes/(1024.0*1024.0)/seconds:0.0;
+}
+
+/* Writes str as a JSON string -> quotes, backslashes and control characters
+   (e.g., in a filename or in the label of a format 2 block) are escaped */
+static void write_json_string(FILE *fp, const char *str)
+{
+  fputc('"', fp);
+  for(const unsigned char *c = (const unsigned char *) str; *c != '\0'; c++) {
+    switch(*c) {
+    case '"':  fputs("\\\"", fp); break;
+    case '\\': fputs("\\\\", fp); break;
+    case '\b': fputs("\\b", fp); break;
+    case '\f': fputs("\\f", fp); break;
+    case '\n': fputs("\\n", fp); break;
+    case '\r': fputs("\\r", fp); break;
+    case '\t': fputs("\\t", fp); break;
+    default:
+      if(*c < 0x20) {
+        fprintf(fp, "\\u%04x", *c);
+      } else {
+        fputc(*c, fp);
+      }
+    }
+  }
+  fputc('"', fp);
+}
+
+int open_metrics_writer(struct metrics_writer *w, const char *fname)
+{
+  memset(w, 0, sizeof(*w));
+  const char *ext = strrchr(fname, '.');
+  w->json = (ext != NULL && (strcmp(ext, ".json") == 0 || strcmp(ext, ".jsonl") == 0));
+  w->fp = my_fopen(fname, "w");
+  if(w->fp == NULL) {
+    return EXIT_FAILURE;
+  }
+  if(w->json == 0) {
+    fprintf(w->fp, "file,thread,npart,level,phase,field,bytes,seconds,MB_per_s,count,max_seconds,max_file\n");
+  }
+  return EXIT_SUCCESS;
+}
+
+static void add_to_summary(struct metrics_writer *w, const int ifile, const struct metrics_record *r)
+{
+  int i;
+  for(i=0;i<w->nsummary;i++) {
+    const struct metrics_summary *s = &(w->summary[i]);
+    if(s->level == r->level && s->phase == r->phase && strcmp(s->field, r->field) == 0) {
+      break;
+    }
+  }
+  if(i == w->nsummary) {
+    if(w->nsummary == METRICS_MAXSUMMARY) {
+      return;
+    }
+    struct metrics_summary *s = &(w->summary[w->nsummary++]);
+    memset(s, 0, sizeof(*s));
+    s->level = r->level;
+    s->phase = r->phase;
+    memcpy(s->field, r->field, sizeof(s->field));
+    s->max_file = -1;
+  }
+  struct metrics_summary *s = &(w->summary[i]);
+  s->count++;
+  s->bytes += r->bytes;
+  s->seconds += r->seconds;
+  if(s->max_file < 0 || r->seconds > s->max_seconds) {
+    s->max_seconds = r->seconds;
+    s->max_file = ifile;
+  }
+}
+
+int write_file_metrics(struct metrics_writer *w, const char *inputfile, const struct file_metrics *m)
+{
+  if(w == NULL || w->fp == NULL) {
+    return EXIT_SUCCESS;
+  }
+  int status = EXIT_SUCCESS;
+#ifdef _OPENMP
+#pragma omp critical(metrics_writer)
+#endif
+  {
+    FILE *fp = w->fp;
+    if(w->json) {
+      fprintf(fp, "{\"file\": %d, \"input\": ", m->ifile);
+      write_json_string(fp, inputfile);
+      fprintf(fp, ", \"thread\": %d, \"npart\": %"PRId64", \"seconds\": %.6f, \"phases\": [", m->thread, m->npart, m->seconds);
+      for(int i=0;i<m->nrecords;i++) {
+        const struct metrics_record *r = &(m->records[i]);
+        fprintf(fp, "%s{\"level\": %d, \"phase\": \"%s\", \"field\": ", i > 0 ? ", ":"", r->level, metrics_phase_name(r->phase));
+        write_json_string(fp, r->field);
+        fprintf(fp, ", \"bytes\": %"PRId64", \"seconds\": %.6f, \"MB_per_s\": %.3f}", r->bytes, r->seconds, bandwidth_MBps(r->phase, r->bytes, r->seconds));
+      }
+      fprintf(fp, "]}\n");
+    } else {
+      for(int i=0;i<m->nrecords;i++) {
+        const struct metrics_record *r = &(m->records[i]);
+        fprintf(fp, "%d,%d,%"PRId64",%d,%s,%s,%"PRId64",%.6f,%.3f,,,\n", m->ifile, m->thread, m->npart, r->level,
+                metrics_phase_name(r->phase), r->field, r->bytes, r->seconds, bandwidth_MBps(r->phase, r->bytes, r->seconds));
+      }
+      fprintf(fp, "%d,%d,%"PRId64",-1,total,,0,%.6f,0.000,,,\n", m->ifile, m->thread, m->npart, m->seconds);
+    }
+    for(int i=0;i<m->nrecords;i++) {
+      add_to_summary(w, m->ifile, &(m->records[i]));
+    }
+    w->nfiles++;
+    if(ferror(fp)) {
+      status = EXIT_FAILURE;
+    }
+  }
+  XRETURN(status == EXIT_SUCCESS, EXIT_FAILURE, "Could not write the metrics for file %d\n", m->ifile);
+  return EXIT_SUCCESS;
+}
+
+/* Writes the aggregate summary (totals, bandwidth and the slowest file for every
+   level/phase/field) and closes the file */
+int close_metrics_writer(struct metrics_writer *w, const double wall_seconds, const int nthreads)
+{
+  if(w == NULL || w->fp == NULL) {
+    return EXIT_SUCCESS;
+  }
+  FILE *fp = w->fp;
+  if(w->json) {
+    fprintf(fp, "{\"summary\": {\"nfiles\": %d, \"nthreads\": %d, \"wall_seconds\": %.6f, \"phases\": [", w->nfiles, nthreads, wall_seconds);
+  }
+  for(int i=0;i<w->nsummary;i++) {
+    const struct metrics_summary *s = &(w->summary[i]);
+    if(w->json) {
+      fprintf(fp, "%s{\"level\": %d, \"phase\": \"%s\", \"field\": ", i > 0 ? ", ":"", s->level, metrics_phase_name(s->phase));
+      write_json_string(fp, s->field);
+      fprintf(fp, ", \"count\": %"PRId64", \"bytes\": %"PRId64", \"seconds\": %.6f, \"MB_per_s\": %.3f, \"max_seconds\": %.6f, \"max_file\": %d}",
+              s->count, s->bytes, s->seconds, bandwidth_MBps(s->phase, s->bytes, s->seconds), s->max_seconds, s->max_file);
+    } else {
+      fprintf(fp, "summary,%d,,%d,%s,%s,%"PRId64",%.6f,%.3f,%"PRId64",%.6f,%d\n", nthreads, s->level, metrics_phase_name(s->phase), s->field,
+              s->bytes, s->seconds, bandwidth_MBps(s->phase, s->bytes, s->seconds), s->count, s->max_seconds, s->max_file);
+    }
+  }
+  if(w->json) {
+    fprintf(fp, "]}}\n");
+  } else {
+    fprintf(fp, "summary,%d,,-1,wall,,0,%.6f,0.000,%d,,\n", nthreads, wall_seconds, w->nfiles);
+  }
+  const int status = fclose(fp);
+  w->fp = NULL;
+  XRETURN(status == 0, EXIT_FAILURE, "Could not close the metrics file\n");
+  return EXIT_SUCCESS;
+}
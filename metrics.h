@@ -0,0 +1,85 @@
+/* File: metrics.h */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "gadget_utils.h"
+
+/* Maximum number of distinct (level, phase, field) entries in the aggregate summary */
+#ifndef METRICS_MAXSUMMARY
+#define METRICS_MAXSUMMARY  1024
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    enum metrics_phase
+    {
+        METRICS_OPEN=0,     /*!< opening (and mapping) the input file */
+        METRICS_SELECT,     /*!< selecting the particles (region, id-hash or random indices) */
+        METRICS_FALLOCATE,  /*!< creating the output file and reserving its disk space */
+        METRICS_FIELD,      /*!< copying the records of one field */
+        METRICS_FIELDS,     /*!< copying every field at once (strategies that write the whole file) */
+        METRICS_CLOSE,      /*!< closing (flushing) the output file */
+        NUM_METRICS_PHASES
+    };
+
+    struct metrics_record
+    {
+        int level;//output level (-1 for the phases that only touch the input)
+        enum metrics_phase phase;
+        char field[GADGET_LABEL_LEN+1];//block label for METRICS_FIELD, empty otherwise
+        int64_t bytes;
+        double seconds;
+    };
+
+    /* Timings of all of the phases for one input file */
+    struct file_metrics
+    {
+        int ifile;
+        int thread;
+        int64_t npart;
+        double seconds;//total time spent on the file
+        int nrecords;
+        int maxrecords;
+        struct metrics_record *records;
+    };
+
+    /* Writes one entry per file (as soon as the file is done) and a final aggregate summary. The
+       format is JSON lines if the filename ends in `.json' or `.jsonl', CSV otherwise */
+    struct metrics_writer
+    {
+        FILE *fp;
+        int json;
+        int nfiles;
+        int nsummary;
+        struct metrics_summary
+        {
+            int level;
+            enum metrics_phase phase;
+            char field[GADGET_LABEL_LEN+1];
+            int64_t count;
+            int64_t bytes;
+            double seconds;
+            double max_seconds;//slowest file for this entry -> stragglers
+            int max_file;
+        } summary[METRICS_MAXSUMMARY];
+    };
+
+    extern const char * metrics_phase_name(const enum metrics_phase phase);
+
+    extern void init_file_metrics(struct file_metrics *m, const int ifile, const int thread);
+    extern int add_file_metrics(struct file_metrics *m, const int level, const enum metrics_phase phase, const char *field,
+                                const int64_t bytes, const double seconds);
+    extern void free_file_metrics(struct file_metrics *m);
+
+    extern int open_metrics_writer(struct metrics_writer *w, const char *fname);
+    extern int write_file_metrics(struct metrics_writer *w, const char *inputfile, const struct file_metrics *m);//thread-safe
+    extern int close_metrics_writer(struct metrics_writer *w, const double wall_seconds, const int nthreads);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,194 @@
+/* File: odirect_io.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "odirect_io.h"
+
+#if (ODIRECT_BUFSIZE % ODIRECT_ALIGNMENT) != 0
+#error ODIRECT_BUFSIZE must be a multiple of ODIRECT_ALIGNMENT
+#endif
+
+/* Opens the file with O_DIRECT. If the filesystem does not support O_DIRECT (EINVAL),
+   the file is opened without it (the reads/writes are still aligned) */
+int odirect_open(const char *fname, const int flags)
+{
+  int fd = open(fname, flags | O_DIRECT);
+  if(fd < 0 && errno == EINVAL) {
+	fprintf(stderr,"Warning: O_DIRECT is not supported for file `%s'. Continuing with regular (cached) I/O\n", fname);
+	fd = open(fname, flags);
+  }
+  if(fd < 0) {
+	fprintf(stderr,"Error: Could not open file `%s'\n", fname);
+	perror(NULL);
+  }
+  return fd;
+}
+
+
+/* Aligned output stream -> full buffers are written out with O_DIRECT */
+struct odirect_writer
+{
+  int fd;
+  char *buf;
+  size_t nbuffered;
+  off_t file_offset;
+};
+
+static int odirect_writer_flush(struct odirect_writer *w, const size_t nbytes)
+{
+  size_t nwritten = 0;
+  while(nwritten < nbytes) {
+	ssize_t bytes = pwrite(w->fd, w->buf + nwritten, nbytes - nwritten, w->file_offset + nwritten);
+	if(bytes <= 0) {
+	  fprintf(stderr,"Error in pwrite (O_DIRECT). Expected to write %zu bytes but wrote %zd bytes instead\n", nbytes - nwritten, bytes);
+	  perror(NULL);
+	  return EXIT_FAILURE;
+	}
+	nwritten += (size_t) bytes;
+  }
+  w->file_offset += nbytes;
+  w->nbuffered = 0;
+  return EXIT_SUCCESS;
+}
+
+static int odirect_writer_append(struct odirect_writer *w, const char *src, size_t nbytes)
+{
+  while(nbytes > 0) {
+	const size_t space = ODIRECT_BUFSIZE - w->nbuffered;
+	const size_t n = nbytes < space ? nbytes:space;
+	memcpy(w->buf + w->nbuffered, src, n);
+	w->nbuffered += n;
+	src += n;
+	nbytes -= n;
+	if(w->nbuffered == ODIRECT_BUFSIZE) {
+	  int status = odirect_writer_flush(w, ODIRECT_BUFSIZE);
+	  if(status != EXIT_SUCCESS) {
+		return status;
+	  }
+	}
+  }
+  return EXIT_SUCCESS;
+}
+
+/* The unaligned tail is zero-padded to the alignment, written with O_DIRECT and then
+   the file is truncated to the actual size */
+static int odirect_writer_finish(struct odirect_writer *w)
+{
+  const off_t file_size = w->file_offset + w->nbuffered;
+  if(w->nbuffered > 0) {
+	const size_t nbytes = ((w->nbuffered + ODIRECT_ALIGNMENT - 1)/ODIRECT_ALIGNMENT) * ODIRECT_ALIGNMENT;
+	memset(w->buf + w->nbuffered, 0, nbytes - w->nbuffered);
+	int status = odirect_writer_flush(w, nbytes);
+	if(status != EXIT_SUCCESS) {
+	  return status;
+	}
+  }
+  if(ftruncate(w->fd, file_size) != 0) {
+	perror(NULL);
+	return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+
+/* Appends the selected records of every field (as fortran blocks) to the output stream.
+   Returns the number of input bytes read (-1 on error) */
+static int64_t odirect_copy_fields(const int in_fd, const char *inputfile, char *in_buf, struct odirect_writer *w,
+                                   const int nfields, const off_t *in_offsets, const size_t *itemsizes, const char (*labels)[GADGET_LABEL_LEN+1],
+                                   const struct selection *sel, const size_t nindices)
+{
+  /* The selected runs are visited in file order (field by field, increasing index)
+     which is also the order in which they appear in the output */
+  int64_t total_read = 0;
+  off_t chunk_start = 0, chunk_end = 0;//input bytes [chunk_start, chunk_end) are in in_buf
+  for(int k=0;k<nfields;k++) {
+	const int field_disk_size = itemsizes[k]*nindices;
+	if(labels != NULL) {
+	  char record[GADGET_LABEL_RECORD_BYTES];
+	  fill_gadget_label_record(record, labels[k], field_disk_size);
+	  if(odirect_writer_append(w, record, sizeof(record)) != EXIT_SUCCESS) {
+		return -1;
+	  }
+	}
+	if(odirect_writer_append(w, (const char *) &field_disk_size, sizeof(field_disk_size)) != EXIT_SUCCESS) {
+	  return -1;
+	}
+	struct selection_cursor c = {.pos = 0, .offset = 0};
+	size_t start, count;
+	while((count = selection_peek_run(sel, &c, &start)) > 0) {
+	  selection_advance(sel, &c, count);
+	  off_t rec_start = in_offsets[k] + (off_t) (start*itemsizes[k]);
+	  const off_t rec_end = rec_start + (off_t) (count*itemsizes[k]);
+	  while(rec_start < rec_end) {
+		if(rec_start < chunk_start || rec_start >= chunk_end) {
+		  //read the aligned chunk containing rec_start (chunks without any selected records are skipped)
+		  chunk_start = (rec_start/ODIRECT_ALIGNMENT) * ODIRECT_ALIGNMENT;
+		  ssize_t nread;
+		  do {
+			nread = pread(in_fd, in_buf, ODIRECT_BUFSIZE, chunk_start);
+		  } while(nread < 0 && errno == EINTR);
+		  if(nread <= 0) {
+			fprintf(stderr,"Error: Could not read input file `%s' at offset %zu (O_DIRECT)\n", inputfile, (size_t) chunk_start);
+			perror(NULL);
+			return -1;
+		  }
+		  chunk_end = chunk_start + nread;
+		  total_read += nread;
+		  if(rec_start >= chunk_end) {
+			fprintf(stderr,"Error: Input file `%s' is truncated (expected a record at offset %zu)\n", inputfile, (size_t) rec_start);
+			return -1;
+		  }
+		}
+		//the run may straddle several chunks -> copy the part in this chunk
+		const off_t copy_end = rec_end < chunk_end ? rec_end:chunk_end;
+		if(odirect_writer_append(w, in_buf + (rec_start - chunk_start), copy_end - rec_start) != EXIT_SUCCESS) {
+		  return -1;
+		}
+		rec_start = copy_end;
+	  }
+	}
+	if(odirect_writer_append(w, (const char *) &field_disk_size, sizeof(field_disk_size)) != EXIT_SUCCESS) {
+	  return -1;
+	}
+  }
+  return total_read;
+}
+
+
+int64_t odirect_subsample_file(const char *inputfile, const char *outputfile, const void *prefix, const size_t prefix_bytes,
+                               const int nfields, const off_t *in_offsets, const size_t *itemsizes, const char (*labels)[GADGET_LABEL_LEN+1],
+                               const struct selection *sel, const size_t nindices, char *bufs)
+{
+  char *in_buf = bufs;
+  struct odirect_writer w = {.fd = -1, .buf = bufs + ODIRECT_BUFSIZE, .nbuffered = 0, .file_offset = 0};
+  const int in_fd = odirect_open(inputfile, O_RDONLY);
+  if(in_fd < 0) {
+	return -1;
+  }
+  w.fd = odirect_open(outputfile, O_WRONLY);
+  if(w.fd < 0) {
+	close(in_fd);
+	return -1;
+  }
+
+  int64_t bytes_read = -1;
+  if(odirect_writer_append(&w, prefix, prefix_bytes) == EXIT_SUCCESS) {
+	bytes_read = odirect_copy_fields(in_fd, inputfile, in_buf, &w, nfields, in_offsets, itemsizes, labels, sel, nindices);
+	if(bytes_read >= 0 && odirect_writer_finish(&w) != EXIT_SUCCESS) {
+	  bytes_read = -1;
+	}
+  }
+
+  close(in_fd);
+  if(close(w.fd) != 0) {
+	fprintf(stderr,"Error while closing output file = `%s'\n", outputfile);
+	perror(NULL);
+	bytes_read = -1;
+  }
+  return bytes_read;
+}
@@ -0,0 +1,43 @@
+/* File: odirect_io.h */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "gadget_utils.h"
+#include "sampling.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* Alignment (in bytes) for the offsets, lengths and buffers of the O_DIRECT reads and writes */
+#ifndef ODIRECT_ALIGNMENT
+#define ODIRECT_ALIGNMENT  4096
+#endif
+
+    /* Size (in bytes) of each input chunk and of the output staging buffer. Must be a multiple of ODIRECT_ALIGNMENT */
+#ifndef ODIRECT_BUFSIZE
+#define ODIRECT_BUFSIZE  (16*1024*1024)
+#endif
+
+    extern int odirect_open(const char *fname, const int flags);
+
+    /* Streams the input file with aligned O_DIRECT reads and writes the output file with
+       aligned O_DIRECT writes. The output consists of the `prefix' bytes (the header,
+       including its padding) followed by each field as a fortran block containing the
+       nindices records of the selection. If `labels' is not NULL, each field is
+       preceded by its format-2 label record. Input chunks that do not contain any selected
+       records are not read. bufs holds the input chunk and the output staging buffer
+       (2 x ODIRECT_BUFSIZE bytes, aligned to ODIRECT_ALIGNMENT). Returns the number of input
+       bytes read (-1 on error). */
+    extern int64_t odirect_subsample_file(const char *inputfile, const char *outputfile, const void *prefix, const size_t prefix_bytes,
+                                          const int nfields, const off_t *in_offsets, const size_t *itemsizes,
+                                          const char (*labels)[GADGET_LABEL_LEN+1], const struct selection *sel,
+                                          const size_t nindices, char *bufs);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,129 @@
+/* File: philox.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "philox.h"
+
+#define PHILOX_M0  0xD2511F53U
+#define PHILOX_M1  0xCD9E8D57U
+#define PHILOX_W0  0x9E3779B9U
+#define PHILOX_W1  0xBB67AE85U
+
+/* 53 random bits -> uniform in (0, 1) (never exactly 0 or 1) */
+static inline double bits_to_uniform(const uint32_t hi, const uint32_t lo)
+{
+  const uint64_t x = ((((uint64_t) hi) << 32) | lo) >> 11;
+  return (x + 0.5) * 0x1.0p-53;
+}
+
+void philox4x32_10(const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4])
+{
+  uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+  uint32_t k0 = key[0], k1 = key[1];
+  for(int r=0;r<PHILOX_ROUNDS;r++) {
+    if(r > 0) {
+      k0 += PHILOX_W0;
+      k1 += PHILOX_W1;
+    }
+    const uint64_t p0 = (uint64_t) PHILOX_M0 * c0;
+    const uint64_t p1 = (uint64_t) PHILOX_M1 * c2;
+    c0 = (uint32_t) (p1 >> 32) ^ c1 ^ k0;
+    c2 = (uint32_t) (p0 >> 32) ^ c3 ^ k1;
+    c1 = (uint32_t) p1;
+    c3 = (uint32_t) p0;
+  }
+  out[0] = c0;
+  out[1] = c1;
+  out[2] = c2;
+  out[3] = c3;
+}
+
+/* The rounds are applied to PHILOX_LANES counters at a time, with every lane in its own array
+   slot -> the loops over the lanes are vectorized (32x32 -> 64-bit multiplies) */
+void philox_uniforms(const uint32_t key[2], const uint32_t stream[2], const uint64_t counter, const size_t nblocks, double *out)
+{
+  size_t b = 0;
+  for(;b + PHILOX_LANES <= nblocks;b+=PHILOX_LANES) {
+    uint32_t c0[PHILOX_LANES], c1[PHILOX_LANES], c2[PHILOX_LANES], c3[PHILOX_LANES];
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+    for(int l=0;l<PHILOX_LANES;l++) {
+      const uint64_t c = counter + b + l;
+      c0[l] = (uint32_t) c;
+      c1[l] = (uint32_t) (c >> 32);
+      c2[l] = stream[0];
+      c3[l] = stream[1];
+    }
+    uint32_t k0 = key[0], k1 = key[1];
+    for(int r=0;r<PHILOX_ROUNDS;r++) {
+      if(r > 0) {
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+      }
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+      for(int l=0;l<PHILOX_LANES;l++) {
+        const uint64_t p0 = (uint64_t) PHILOX_M0 * c0[l];
+        const uint64_t p1 = (uint64_t) PHILOX_M1 * c2[l];
+        c0[l] = (uint32_t) (p1 >> 32) ^ c1[l] ^ k0;
+        c2[l] = (uint32_t) (p0 >> 32) ^ c3[l] ^ k1;
+        c1[l] = (uint32_t) p1;
+        c3[l] = (uint32_t) p0;
+      }
+    }
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+    for(int l=0;l<PHILOX_LANES;l++) {
+      out[2*(b + l)] = bits_to_uniform(c1[l], c0[l]);
+      out[2*(b + l) + 1] = bits_to_uniform(c3[l], c2[l]);
+    }
+  }
+
+  //the remaining (fewer than PHILOX_LANES) counters
+  for(;b<nblocks;b++) {
+    const uint64_t c = counter + b;
+    const uint32_t ctr[4] = {(uint32_t) c, (uint32_t) (c >> 32), stream[0], stream[1]};
+    uint32_t x[4];
+    philox4x32_10(ctr, key, x);
+    out[2*b] = bits_to_uniform(x[1], x[0]);
+    out[2*b + 1] = bits_to_uniform(x[3], x[2]);
+  }
+}
+
+void philox_stream_init(struct philox_stream *s, const uint64_t seed, const uint32_t stream0, const uint32_t stream1)
+{
+  s->key[0] = (uint32_t) seed;
+  s->key[1] = (uint32_t) (seed >> 32);
+  s->stream[0] = stream0;
+  s->stream[1] = stream1;
+  s->counter = 0;
+  s->pos = PHILOX_BLOCK;//the first uniform triggers the refill
+}
+
+void philox_stream_refill(struct philox_stream *s)
+{
+  philox_uniforms(s->key, s->stream, s->counter, PHILOX_BLOCK/2, s->uniforms);
+  s->counter += PHILOX_BLOCK/2;
+  s->pos = 0;
+}
+
+void philox_stream_seek(struct philox_stream *s, const uint64_t i)
+{
+  s->counter = i/2;
+  philox_stream_refill(s);
+  s->pos = (int) (i % 2);
+}
+
+uint64_t philox_random_u64(const uint64_t seed, const uint32_t stream0, const uint32_t stream1, const uint64_t i)
+{
+  const uint32_t ctr[4] = {(uint32_t) i, (uint32_t) (i >> 32), stream0, stream1};
+  const uint32_t key[2] = {(uint32_t) seed, (uint32_t) (seed >> 32)};
+  uint32_t x[4];
+  philox4x32_10(ctr, key, x);
+  return (((uint64_t) x[1]) << 32) | x[0];
+}
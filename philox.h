@@ -0,0 +1,60 @@
+/* File: philox.h */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Number of uniforms generated by each refill of a stream (must be even) */
+#ifndef PHILOX_BLOCK
+#define PHILOX_BLOCK  256
+#endif
+
+/* Number of counters run through the rounds together by the block generator -> one vector of 32-bit lanes */
+#ifndef PHILOX_LANES
+#define PHILOX_LANES  8
+#endif
+
+#define PHILOX_ROUNDS  10
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* Philox4x32-10 (Salmon et al., SC'11): a counter-based generator -> the i-th block of random
+       numbers is a function of (key, counter = i) alone, so any position of a stream can be
+       generated directly. The key is the seed; the upper half of the 128-bit counter selects one
+       of 2^64 independent streams and the lower half is the position within the stream. Every
+       counter gives 4 x 32 random bits -> two uniforms with 53 random bits each */
+    struct philox_stream
+    {
+        uint32_t key[2];
+        uint32_t stream[2];
+        uint64_t counter;//counter of the next block to generate
+        int pos;//next uniform in the buffer
+        double uniforms[PHILOX_BLOCK];
+    };
+
+    extern void philox4x32_10(const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4]);
+    /* Fills out with the 2*nblocks uniforms in (0, 1) of the counters [counter, counter + nblocks) of the stream */
+    extern void philox_uniforms(const uint32_t key[2], const uint32_t stream[2], const uint64_t counter, const size_t nblocks, double *out);
+
+    extern void philox_stream_init(struct philox_stream *s, const uint64_t seed, const uint32_t stream0, const uint32_t stream1);
+    /* Moves the stream to its i-th uniform */
+    extern void philox_stream_seek(struct philox_stream *s, const uint64_t i);
+    extern void philox_stream_refill(struct philox_stream *s);
+    /* The i-th 64-bit random number of the stream (stream0, stream1) of seed */
+    extern uint64_t philox_random_u64(const uint64_t seed, const uint32_t stream0, const uint32_t stream1, const uint64_t i);
+
+    /* Next uniform in (0, 1) */
+    static inline double philox_uniform(struct philox_stream *s)
+    {
+        if(s->pos == PHILOX_BLOCK) {
+            philox_stream_refill(s);
+        }
+        return s->uniforms[s->pos++];
+    }
+
+#ifdef __cplusplus
+}
+#endif
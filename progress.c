@@ -0,0 +1,123 @@
+/* File: progress.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "progress.h"
+#include "utils.h"
+#include "macros.h"
+
+static void print_progress(struct progress_reporter *p, const int final)
+{
+  struct timespec t1;
+  current_utc_time(&t1);
+  const double elapsed = REALTIME_ELAPSED_NS(p->tstart, t1)*1e-9;
+  const int64_t files_done = atomic_load_explicit(&p->files_done, memory_order_relaxed);
+  const int64_t files_active = atomic_load_explicit(&p->files_active, memory_order_relaxed);
+  const int64_t records_done = atomic_load_explicit(&p->records_done, memory_order_relaxed);
+  const int64_t bytes_done = atomic_load_explicit(&p->bytes_done, memory_order_relaxed);
+
+  double done = p->nrecords > 0 ? records_done/(double) p->nrecords:files_done/(double) p->nfiles;
+  done = done < 1.0 ? done:1.0;
+  if(final && files_done == p->nfiles) {
+    done = 1.0;
+  }
+  //the expected number of records is only an estimate (e.g., for the id-hash sampler) -> never claim 100% early
+  if(final == 0 && files_done < p->nfiles && done > 0.999) {
+    done = 0.999;
+  }
+  const double GBps = elapsed > 0.0 ? bytes_done/(1024.0*1024.0*1024.0)/elapsed:0.0;
+  char eta[64] = "--:--:--";
+  if(done > 0.0 && final == 0) {
+    const int64_t remaining = (int64_t) (elapsed * (1.0 - done)/done);
+    snprintf(eta, sizeof(eta), "%02"PRId64":%02"PRId64":%02"PRId64, remaining/3600, (remaining/60) % 60, remaining % 60);
+  } else if(final) {
+    snprintf(eta, sizeof(eta), "00:00:00");
+  }
+  fprintf(stderr,"%sprogress> %5.1lf%% | %"PRId64"/%"PRId64" files (%"PRId64" active) | %0.3lf GB written | %0.3lf GB/s | ETA %s%s",
+          p->tty ? "\r":"", 100.0*done, files_done, p->nfiles, files_active, bytes_done/(1024.0*1024.0*1024.0), GBps, eta,
+          p->tty && final == 0 ? "":"\n");
+}
+
+static void * progress_reporter_main(void *arg)
+{
+  struct progress_reporter *p = (struct progress_reporter *) arg;
+  pthread_mutex_lock(&p->lock);
+  while(p->stop == 0) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    const int64_t ns = deadline.tv_nsec + (int64_t) (p->interval*1e9);
+    deadline.tv_sec += ns / 1000000000;
+    deadline.tv_nsec = ns % 1000000000;
+    //sleeps for the interval unless stop_progress_reporter wakes the thread up
+    while(p->stop == 0 && pthread_cond_timedwait(&p->wakeup, &p->lock, &deadline) != ETIMEDOUT);
+    if(p->stop == 0) {
+      print_progress(p, 0);
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+int start_progress_reporter(struct progress_reporter *p, const int64_t nfiles, const int64_t nrecords, const double interval)
+{
+  XRETURN(nfiles > 0 && interval > 0.0, EXIT_FAILURE, "Number of files = %"PRId64" and the progress interval = %lf must be positive\n",
+          nfiles, interval);
+  p->nfiles = nfiles;
+  p->nrecords = nrecords > 0 ? nrecords:0;
+  p->interval = interval;
+  p->tty = isatty(fileno(stderr));
+  current_utc_time(&p->tstart);
+  atomic_init(&p->files_done, 0);
+  atomic_init(&p->files_active, 0);
+  atomic_init(&p->records_done, 0);
+  atomic_init(&p->bytes_done, 0);
+  p->stop = 0;
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->wakeup, NULL);
+  const int status = pthread_create(&p->thread, NULL, progress_reporter_main, p);
+  if(status != 0) {
+    fprintf(stderr,"Error: Could not start the progress reporter thread (error = %s)\n", strerror(status));
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+void progress_file_started(struct progress_reporter *p)
+{
+  atomic_fetch_add_explicit(&p->files_active, 1, memory_order_relaxed);
+}
+
+void progress_file_done(struct progress_reporter *p)
+{
+  atomic_fetch_sub_explicit(&p->files_active, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&p->files_done, 1, memory_order_relaxed);
+}
+
+void progress_add(struct progress_reporter *p, const int64_t records, const int64_t bytes)
+{
+  if(p == NULL) {
+    return;
+  }
+  atomic_fetch_add_explicit(&p->records_done, records, memory_order_relaxed);
+  atomic_fetch_add_explicit(&p->bytes_done, bytes, memory_order_relaxed);
+}
+
+/* Stops (and joins) the reporter thread and prints the final state */
+int stop_progress_reporter(struct progress_reporter *p)
+{
+  pthread_mutex_lock(&p->lock);
+  p->stop = 1;
+  pthread_cond_signal(&p->wakeup);
+  pthread_mutex_unlock(&p->lock);
+  const int status = pthread_join(p->thread, NULL);
+  print_progress(p, 1);
+  pthread_cond_destroy(&p->wakeup);
+  pthread_mutex_destroy(&p->lock);
+  return status == 0 ? EXIT_SUCCESS:EXIT_FAILURE;
+}
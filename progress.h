@@ -0,0 +1,50 @@
+/* File: progress.h */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/* Seconds between two progress reports */
+#ifndef PROGRESS_INTERVAL
+#define PROGRESS_INTERVAL  2.0
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* Progress of the parallel file loop. The worker threads only increment the (relaxed) atomic
+       counters and a separate low-frequency reporter thread prints percent done, throughput, ETA
+       and the number of files being copied -> no lock on the copy path */
+    struct progress_reporter
+    {
+        int64_t nfiles;
+        int64_t nrecords;//expected number of records, 0 -> unknown and the percentage is based on the files
+        double interval;//seconds between the reports
+        struct timespec tstart;
+        int tty;//rewrite one line on a terminal, print one line per report otherwise
+
+        _Atomic int64_t files_done;
+        _Atomic int64_t files_active;
+        _Atomic int64_t records_done;
+        _Atomic int64_t bytes_done;
+
+        int stop;
+        pthread_t thread;
+        pthread_mutex_t lock;
+        pthread_cond_t wakeup;
+    };
+
+    extern int start_progress_reporter(struct progress_reporter *p, const int64_t nfiles, const int64_t nrecords, const double interval);
+    extern void progress_file_started(struct progress_reporter *p);
+    extern void progress_file_done(struct progress_reporter *p);
+    extern void progress_add(struct progress_reporter *p, const int64_t records, const int64_t bytes);
+    extern int stop_progress_reporter(struct progress_reporter *p);
+
+#ifdef __cplusplus
+}
+#endif
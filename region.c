@@ -0,0 +1,536 @@
+/* File: region.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "region.h"
+#include "gadget_utils.h"
+#include "utils.h"
+
+#define REGION_CACHE_MAGIC    "SGREGION"
+#define REGION_CACHE_VERSION  1
+
+/* Cached cell index of one file. Followed by the cell offsets and the ranges if the file is ordered */
+struct region_cell_index_cache_header
+{
+  char magic[8];
+  int32_t version;
+  int32_t ngrid;
+  int32_t ordered;
+  int32_t unused;
+  int64_t file_size;//size and modification time of the snapshot file
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  int64_t npart;
+  int64_t nranges;
+  float min[3];
+  float max[3];
+};
+
+int parse_region(const char *spec, const enum region_type type, struct region *r)
+{
+  const int nvalues = type == REGION_BOX ? 6:4;
+  double values[6];
+  const char *s = spec;
+  for(int i=0;i<nvalues;i++) {
+    char *end = NULL;
+    values[i] = strtod(s, &end);
+    if(end == s || (i < nvalues - 1 && *end != ',') || (i == nvalues - 1 && *end != '\0')) {
+      fprintf(stderr,"Error: Could not parse region `%s' -- expected %s\n", spec,
+              type == REGION_BOX ? "xmin,ymin,zmin,xmax,ymax,zmax":"x,y,z,radius");
+      return EXIT_FAILURE;
+    }
+    s = end + 1;
+  }
+
+  r->type = type;
+  if(type == REGION_BOX) {
+    for(int k=0;k<3;k++) {
+      if(values[k+3] <= values[k]) {
+        fprintf(stderr,"Error: The box `%s' must have max > min along every axis (use max > BoxSize to wrap around)\n", spec);
+        return EXIT_FAILURE;
+      }
+      r->center[k] = 0.5*(values[k] + values[k+3]);
+      r->half[k] = 0.5*(values[k+3] - values[k]);
+    }
+  } else {
+    if(values[3] <= 0.0) {
+      fprintf(stderr,"Error: The radius of the sphere `%s' must be positive\n", spec);
+      return EXIT_FAILURE;
+    }
+    for(int k=0;k<3;k++) {
+      r->center[k] = values[k];
+      r->half[k] = values[3];
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+void print_region(FILE *fp, const struct region *r)
+{
+  if(r->type == REGION_BOX) {
+    fprintf(fp,"box [%g, %g] x [%g, %g] x [%g, %g]",
+            r->center[0] - r->half[0], r->center[0] + r->half[0],
+            r->center[1] - r->half[1], r->center[1] + r->half[1],
+            r->center[2] - r->half[2], r->center[2] + r->half[2]);
+  } else if(r->type == REGION_SPHERE) {
+    fprintf(fp,"sphere of radius %g around (%g, %g, %g)", r->half[0], r->center[0], r->center[1], r->center[2]);
+  }
+}
+
+/* Returns a pointer to the positions of particles [start, start + n) -> directly into the
+   mapped file if there is one, otherwise read into buf */
+static const float * read_positions(int in_fd, const char *in_memblock, const off_t pos_offset, const int64_t start, const int64_t n, float *buf)
+{
+  const off_t offset = pos_offset + (off_t) start * 3 * sizeof(float);
+  if(in_memblock != NULL) {
+    return (const float *) (in_memblock + offset);
+  }
+  const size_t nbytes = n * 3 * sizeof(float);
+  size_t nread = 0;
+  while(nread < nbytes) {
+    const ssize_t bytes = pread(in_fd, (char *) buf + nread, nbytes - nread, offset + nread);
+    if(bytes <= 0) {
+      fprintf(stderr,"Error: Could not read the positions of %"PRId64" particles starting at particle %"PRId64"\n", n, start);
+      perror(NULL);
+      return NULL;
+    }
+    nread += bytes;
+  }
+  return buf;
+}
+
+static inline int region_cell_1d(const float x, const float min, const float inv_width, const int ngrid)
+{
+  const int i = (int) ((x - min) * inv_width);
+  return i < 0 ? 0:(i >= ngrid ? ngrid - 1:i);
+}
+
+static void free_region_cell_index(struct region_cell_index *idx)
+{
+  free(idx->cell_offsets);
+  free(idx->ranges);
+  idx->cell_offsets = NULL;
+  idx->ranges = NULL;
+  idx->nranges = 0;
+}
+
+/* Two passes over the POS block -> the bounding box, then the runs of consecutive records within the same cell */
+static int build_region_cell_index(int in_fd, const char *in_memblock, const off_t pos_offset, const int64_t npart, struct region_cell_index *idx)
+{
+  const int ngrid = REGION_NGRID;
+  const int64_t ncells = (int64_t) ngrid * ngrid * ngrid;
+  memset(idx, 0, sizeof(*idx));
+  idx->ngrid = ngrid;
+  idx->npart = npart;
+  for(int k=0;k<3;k++) {
+    idx->min[k] = npart > 0 ? INFINITY:0.0f;
+    idx->max[k] = npart > 0 ? -INFINITY:0.0f;
+  }
+
+  float *buf = in_memblock == NULL ? malloc(REGION_CHUNKSIZE * 3 * sizeof(float)):NULL;
+  if(in_memblock == NULL && buf == NULL) {
+    fprintf(stderr,"Error: Could not allocate memory to read positions\n");
+    return EXIT_FAILURE;
+  }
+
+  for(int64_t start=0;start<npart;start+=REGION_CHUNKSIZE) {
+    const int64_t n = (npart - start) < REGION_CHUNKSIZE ? (npart - start):REGION_CHUNKSIZE;
+    const float *pos = read_positions(in_fd, in_memblock, pos_offset, start, n, buf);
+    if(pos == NULL) {
+      free(buf);
+      return EXIT_FAILURE;
+    }
+    for(int64_t j=0;j<n;j++) {
+      for(int k=0;k<3;k++) {
+        idx->min[k] = pos[3*j+k] < idx->min[k] ? pos[3*j+k]:idx->min[k];
+        idx->max[k] = pos[3*j+k] > idx->max[k] ? pos[3*j+k]:idx->max[k];
+      }
+    }
+  }
+
+  float inv_width[3];
+  for(int k=0;k<3;k++) {
+    inv_width[k] = idx->max[k] > idx->min[k] ? ngrid/(idx->max[k] - idx->min[k]):0.0f;
+  }
+
+  //more runs than this and the index would not save any reads
+  const int64_t max_nruns = npart/REGION_MIN_RUN_LENGTH > 1 ? npart/REGION_MIN_RUN_LENGTH:1;
+  int32_t *run_cells = malloc(max_nruns * sizeof(*run_cells));
+  struct region_range *runs = malloc(max_nruns * sizeof(*runs));
+  if(run_cells == NULL || runs == NULL) {
+    fprintf(stderr,"Error: Could not allocate memory for %"PRId64" runs of the cell index\n", max_nruns);
+    free(run_cells);free(runs);free(buf);
+    return EXIT_FAILURE;
+  }
+
+  int64_t nruns = 0;
+  int ordered = 1;
+  for(int64_t start=0;start<npart && ordered;start+=REGION_CHUNKSIZE) {
+    const int64_t n = (npart - start) < REGION_CHUNKSIZE ? (npart - start):REGION_CHUNKSIZE;
+    const float *pos = read_positions(in_fd, in_memblock, pos_offset, start, n, buf);
+    if(pos == NULL) {
+      free(run_cells);free(runs);free(buf);
+      return EXIT_FAILURE;
+    }
+    for(int64_t j=0;j<n;j++) {
+      const int32_t cell = (region_cell_1d(pos[3*j+0], idx->min[0], inv_width[0], ngrid) * ngrid +
+                            region_cell_1d(pos[3*j+1], idx->min[1], inv_width[1], ngrid)) * ngrid +
+        region_cell_1d(pos[3*j+2], idx->min[2], inv_width[2], ngrid);
+      if(nruns > 0 && run_cells[nruns-1] == cell) {
+        runs[nruns-1].count++;
+        continue;
+      }
+      if(nruns == max_nruns) {
+        ordered = 0;
+        break;
+      }
+      run_cells[nruns] = cell;
+      runs[nruns].start = (uint32_t) (start + j);
+      runs[nruns].count = 1;
+      nruns++;
+    }
+  }
+  free(buf);
+
+  idx->ordered = ordered;
+  if(ordered == 0) {
+    free(run_cells);free(runs);
+    return EXIT_SUCCESS;
+  }
+
+  //group the runs by cell (counting sort -> the runs within a cell stay in file order)
+  idx->cell_offsets = calloc(ncells + 1, sizeof(*(idx->cell_offsets)));
+  idx->ranges = malloc((nruns > 0 ? nruns:1) * sizeof(*(idx->ranges)));
+  if(idx->cell_offsets == NULL || idx->ranges == NULL) {
+    fprintf(stderr,"Error: Could not allocate memory for the cell index\n");
+    free(run_cells);free(runs);
+    free_region_cell_index(idx);
+    return EXIT_FAILURE;
+  }
+  for(int64_t i=0;i<nruns;i++) {
+    idx->cell_offsets[run_cells[i] + 1]++;
+  }
+  for(int64_t c=0;c<ncells;c++) {
+    idx->cell_offsets[c+1] += idx->cell_offsets[c];
+  }
+  int64_t *next = malloc(ncells * sizeof(*next));
+  if(next == NULL) {
+    fprintf(stderr,"Error: Could not allocate memory for the cell index\n");
+    free(run_cells);free(runs);
+    free_region_cell_index(idx);
+    return EXIT_FAILURE;
+  }
+  memcpy(next, idx->cell_offsets, ncells * sizeof(*next));
+  for(int64_t i=0;i<nruns;i++) {
+    idx->ranges[next[run_cells[i]]++] = runs[i];
+  }
+  idx->nranges = nruns;
+  free(next);free(run_cells);free(runs);
+  return EXIT_SUCCESS;
+}
+
+static void get_region_cache_filename(const char *cachedir, const char *inputfile, char *cachefile)
+{
+  const char *name = strrchr(inputfile, '/');
+  name = name != NULL ? name + 1:inputfile;
+  my_snprintf(cachefile, MAXLEN, "%s/%s.cellidx", cachedir, name);
+}
+
+/* Returns EXIT_SUCCESS only if the cached index matches the current file */
+static int read_region_cell_index_cache(const char *cachefile, const struct stat *sb, const int64_t npart, struct region_cell_index *idx)
+{
+  struct region_cell_index_cache_header hdr;
+  memset(idx, 0, sizeof(*idx));
+  FILE *fp = fopen(cachefile, "r");
+  if(fp == NULL) {
+    return EXIT_FAILURE;
+  }
+  int status = EXIT_FAILURE;
+  if(fread(&hdr, sizeof(hdr), 1, fp) == 1 &&
+     memcmp(hdr.magic, REGION_CACHE_MAGIC, sizeof(hdr.magic)) == 0 &&
+     hdr.version == REGION_CACHE_VERSION && hdr.ngrid == REGION_NGRID &&
+     hdr.file_size == (int64_t) sb->st_size &&
+     hdr.mtime_sec == (int64_t) sb->st_mtim.tv_sec && hdr.mtime_nsec == (int64_t) sb->st_mtim.tv_nsec &&
+     hdr.npart == npart) {
+    idx->ngrid = hdr.ngrid;
+    idx->ordered = hdr.ordered;
+    idx->npart = hdr.npart;
+    memcpy(idx->min, hdr.min, sizeof(idx->min));
+    memcpy(idx->max, hdr.max, sizeof(idx->max));
+    if(hdr.ordered == 0) {
+      status = EXIT_SUCCESS;
+    } else {
+      const int64_t ncells = (int64_t) hdr.ngrid * hdr.ngrid * hdr.ngrid;
+      idx->cell_offsets = malloc((ncells + 1) * sizeof(*(idx->cell_offsets)));
+      idx->ranges = malloc((hdr.nranges > 0 ? hdr.nranges:1) * sizeof(*(idx->ranges)));
+      if(idx->cell_offsets != NULL && idx->ranges != NULL &&
+         fread(idx->cell_offsets, sizeof(*(idx->cell_offsets)), ncells + 1, fp) == (size_t) (ncells + 1) &&
+         fread(idx->ranges, sizeof(*(idx->ranges)), hdr.nranges, fp) == (size_t) hdr.nranges &&
+         idx->cell_offsets[ncells] == hdr.nranges) {
+        idx->nranges = hdr.nranges;
+        status = EXIT_SUCCESS;
+      }
+    }
+  }
+  fclose(fp);
+  if(status != EXIT_SUCCESS) {
+    free_region_cell_index(idx);
+  }
+  return status;
+}
+
+/* Written to a temporary file first so that an interrupted write never leaves a truncated cache behind */
+static int write_region_cell_index_cache(const char *cachefile, const struct stat *sb, const struct region_cell_index *idx)
+{
+  struct region_cell_index_cache_header hdr;
+  char tmpfile[MAXLEN];
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, REGION_CACHE_MAGIC, sizeof(hdr.magic));
+  hdr.version = REGION_CACHE_VERSION;
+  hdr.ngrid = idx->ngrid;
+  hdr.ordered = idx->ordered;
+  hdr.file_size = sb->st_size;
+  hdr.mtime_sec = sb->st_mtim.tv_sec;
+  hdr.mtime_nsec = sb->st_mtim.tv_nsec;
+  hdr.npart = idx->npart;
+  hdr.nranges = idx->nranges;
+  memcpy(hdr.min, idx->min, sizeof(hdr.min));
+  memcpy(hdr.max, idx->max, sizeof(hdr.max));
+  my_snprintf(tmpfile, MAXLEN, "%s.tmp", cachefile);
+
+  FILE *fp = my_fopen(tmpfile, "w");
+  if(fp == NULL) {
+    return EXIT_FAILURE;
+  }
+  int status = EXIT_SUCCESS;
+  if(my_fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+    status = EXIT_FAILURE;
+  }
+  if(status == EXIT_SUCCESS && idx->ordered) {
+    const int64_t ncells = (int64_t) idx->ngrid * idx->ngrid * idx->ngrid;
+    if(my_fwrite(idx->cell_offsets, sizeof(*(idx->cell_offsets)), ncells + 1, fp) != (size_t) (ncells + 1) ||
+       my_fwrite(idx->ranges, sizeof(*(idx->ranges)), idx->nranges, fp) != (size_t) idx->nranges) {
+      status = EXIT_FAILURE;
+    }
+  }
+  if(fclose(fp) != 0 || status != EXIT_SUCCESS || rename(tmpfile, cachefile) != 0) {
+    fprintf(stderr,"Error: Could not write the cell index cache `%s'\n", cachefile);
+    perror(NULL);
+    remove(tmpfile);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+static int get_region_cell_index(const char *inputfile, const char *cachedir, int in_fd, const char *in_memblock, const off_t pos_offset,
+                                 const int64_t npart, struct region_cell_index *idx)
+{
+  char cachefile[MAXLEN];
+  struct stat sb;
+  if(cachedir == NULL) {
+    return build_region_cell_index(in_fd, in_memblock, pos_offset, npart, idx);
+  }
+  if(fstat(in_fd, &sb) != 0) {
+    fprintf(stderr,"Error: Could not stat snapshot file `%s'\n", inputfile);
+    perror(NULL);
+    return EXIT_FAILURE;
+  }
+  get_region_cache_filename(cachedir, inputfile, cachefile);
+  if(read_region_cell_index_cache(cachefile, &sb, npart, idx) == EXIT_SUCCESS) {
+    return EXIT_SUCCESS;
+  }
+  if(build_region_cell_index(in_fd, in_memblock, pos_offset, npart, idx) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  //a missing cache is not fatal -> only costs a re-build on the next run
+  write_region_cell_index_cache(cachefile, &sb, idx);
+  return EXIT_SUCCESS;
+}
+
+/* Marks the cells (along one axis) that overlap [center - half, center + half] -> periodic
+   distance between the centers of the cell and the region. The cells are widened slightly
+   so that a particle right at a cell boundary is never missed */
+static void get_overlapping_cells_1d(const int ngrid, const float min, const float max, const double center, const double half,
+                                     const double boxsize, int *overlap)
+{
+  const double width = (max - min)/ngrid;
+  for(int i=0;i<ngrid;i++) {
+    double dx = min + (i + 0.5)*width - center;
+    if(boxsize > 0.0) {
+      dx -= boxsize * round(dx/boxsize);
+    }
+    overlap[i] = fabs(dx) <= (0.51*width + half) ? 1:0;
+  }
+}
+
+static int compare_ranges(const void *a, const void *b)
+{
+  const struct region_range *ra = (const struct region_range *) a;
+  const struct region_range *rb = (const struct region_range *) b;
+  return ra->start < rb->start ? -1:(ra->start > rb->start ? 1:0);
+}
+
+/* The ranges of the cells that overlap the region, sorted and merged -> returns the number of ranges (-1 on error) */
+static int64_t get_overlapping_ranges(const struct region *r, const double boxsize, const struct region_cell_index *idx, struct region_range **dest)
+{
+  *dest = NULL;
+  if(idx->ordered == 0) {
+    *dest = malloc(sizeof(**dest));
+    if(*dest == NULL) {
+      return -1;
+    }
+    (*dest)[0].start = 0;
+    (*dest)[0].count = (uint32_t) idx->npart;
+    return idx->npart > 0 ? 1:0;
+  }
+
+  const int ngrid = idx->ngrid;
+  int overlap[3][REGION_NGRID];
+  for(int k=0;k<3;k++) {
+    get_overlapping_cells_1d(ngrid, idx->min[k], idx->max[k], r->center[k], r->half[k], boxsize, overlap[k]);
+  }
+
+  int64_t nranges = 0;
+  for(int ix=0;ix<ngrid;ix++) {
+    for(int iy=0;iy<ngrid && overlap[0][ix];iy++) {
+      for(int iz=0;iz<ngrid && overlap[1][iy];iz++) {
+        if(overlap[2][iz] == 0) continue;
+        const int64_t cell = ((int64_t) ix*ngrid + iy)*ngrid + iz;
+        nranges += idx->cell_offsets[cell+1] - idx->cell_offsets[cell];
+      }
+    }
+  }
+  if(nranges == 0) {
+    return 0;
+  }
+  struct region_range *ranges = malloc(nranges * sizeof(*ranges));
+  if(ranges == NULL) {
+    fprintf(stderr,"Error: Could not allocate memory for %"PRId64" ranges\n", nranges);
+    return -1;
+  }
+  int64_t n = 0;
+  for(int ix=0;ix<ngrid;ix++) {
+    for(int iy=0;iy<ngrid && overlap[0][ix];iy++) {
+      for(int iz=0;iz<ngrid && overlap[1][iy];iz++) {
+        if(overlap[2][iz] == 0) continue;
+        const int64_t cell = ((int64_t) ix*ngrid + iy)*ngrid + iz;
+        for(int64_t i=idx->cell_offsets[cell];i<idx->cell_offsets[cell+1];i++) {
+          ranges[n++] = idx->ranges[i];
+        }
+      }
+    }
+  }
+
+  //runs never overlap -> sorting and joining adjacent runs gives fewer, larger reads
+  qsort(ranges, nranges, sizeof(*ranges), compare_ranges);
+  n = 0;
+  for(int64_t i=1;i<nranges;i++) {
+    if(ranges[n].start + ranges[n].count == ranges[i].start) {
+      ranges[n].count += ranges[i].count;
+    } else {
+      ranges[++n] = ranges[i];
+    }
+  }
+  *dest = ranges;
+  return n + 1;
+}
+
+/* Branch-free test of a block of positions so that the compiler can vectorize the loop.
+   Returns the number of particles inside the region (appended to dest) */
+static int64_t select_positions_in_region(const struct region *r, const float boxsize, const float *pos, const int64_t n,
+                                          const int64_t index_offset, uint8_t *keep, uint32_t *dest)
+{
+  const float cx = r->center[0], cy = r->center[1], cz = r->center[2];
+  const float hx = r->half[0], hy = r->half[1], hz = r->half[2];
+  const float inv_boxsize = boxsize > 0.0f ? 1.0f/boxsize:0.0f;
+
+  if(r->type == REGION_SPHERE) {
+    const float rsqr = hx*hx;
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+    for(int64_t j=0;j<n;j++) {
+      float dx = pos[3*j+0] - cx;
+      float dy = pos[3*j+1] - cy;
+      float dz = pos[3*j+2] - cz;
+      dx -= boxsize * rintf(dx * inv_boxsize);
+      dy -= boxsize * rintf(dy * inv_boxsize);
+      dz -= boxsize * rintf(dz * inv_boxsize);
+      keep[j] = (dx*dx + dy*dy + dz*dz) <= rsqr;
+    }
+  } else {
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+    for(int64_t j=0;j<n;j++) {
+      float dx = pos[3*j+0] - cx;
+      float dy = pos[3*j+1] - cy;
+      float dz = pos[3*j+2] - cz;
+      dx -= boxsize * rintf(dx * inv_boxsize);
+      dy -= boxsize * rintf(dy * inv_boxsize);
+      dz -= boxsize * rintf(dz * inv_boxsize);
+      keep[j] = (fabsf(dx) <= hx) & (fabsf(dy) <= hy) & (fabsf(dz) <= hz);
+    }
+  }
+
+  int64_t nselected = 0;
+  for(int64_t j=0;j<n;j++) {
+    dest[nselected] = index_offset + j;
+    nselected += keep[j];
+  }
+  return nselected;
+}
+
+int64_t region_select_indices(const struct region *r, const double boxsize, const char *inputfile, const char *cachedir,
+                              int in_fd, const char *in_memblock, const off_t pos_offset, const int64_t npart,
+                              struct workspace *ws, uint32_t **dest)
+{
+  struct region_cell_index idx;
+  struct region_range *ranges = NULL;
+  *dest = NULL;
+  if(get_region_cell_index(inputfile, cachedir, in_fd, in_memblock, pos_offset, npart, &idx) != EXIT_SUCCESS) {
+    return -1;
+  }
+  const int64_t nranges = get_overlapping_ranges(r, boxsize, &idx, &ranges);
+  free_region_cell_index(&idx);
+  if(nranges < 0) {
+    return -1;
+  }
+
+  int64_t ncandidates = 0;
+  for(int64_t i=0;i<nranges;i++) {
+    ncandidates += ranges[i].count;
+  }
+  *dest = workspace_get(ws, WORKSPACE_REGION, ncandidates * sizeof(**dest));
+  uint8_t *keep = malloc(REGION_CHUNKSIZE * sizeof(*keep));
+  float *buf = in_memblock == NULL ? malloc(REGION_CHUNKSIZE * 3 * sizeof(float)):NULL;
+  if(*dest == NULL || keep == NULL || (in_memblock == NULL && buf == NULL)) {
+    fprintf(stderr,"Error: Could not allocate memory to select up to %"PRId64" particles in the region\n", ncandidates);
+    free(keep);free(buf);free(ranges);
+    *dest = NULL;
+    return -1;
+  }
+
+  int64_t nselected = 0;
+  for(int64_t i=0;i<nranges;i++) {
+    const int64_t end = (int64_t) ranges[i].start + ranges[i].count;
+    for(int64_t start=ranges[i].start;start<end;start+=REGION_CHUNKSIZE) {
+      const int64_t n = (end - start) < REGION_CHUNKSIZE ? (end - start):REGION_CHUNKSIZE;
+      const float *pos = read_positions(in_fd, in_memblock, pos_offset, start, n, buf);
+      if(pos == NULL) {
+        free(keep);free(buf);free(ranges);
+        *dest = NULL;
+        return -1;
+      }
+      nselected += select_positions_in_region(r, (float) boxsize, pos, n, start, keep, *dest + nselected);
+    }
+  }
+  free(keep);free(buf);free(ranges);
+  return nselected;
+}
@@ -0,0 +1,83 @@
+/* File: region.h */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "workspace.h"
+
+/* Number of cells (per dimension) of the coarse grid index built for each file */
+#ifndef REGION_NGRID
+#define REGION_NGRID  16
+#endif
+
+/* Number of positions tested per block */
+#ifndef REGION_CHUNKSIZE
+#define REGION_CHUNKSIZE  4096
+#endif
+
+/* The index is only useful if the particles in a file are (spatially) ordered, e.g., by
+   Peano-Hilbert key. If the records of a cell are split into more runs than
+   npart/REGION_MIN_RUN_LENGTH, the file is treated as unordered and fully scanned */
+#ifndef REGION_MIN_RUN_LENGTH
+#define REGION_MIN_RUN_LENGTH  8
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    enum region_type
+    {
+        REGION_NONE=0,
+        REGION_BOX,       /*!< axis-aligned box */
+        REGION_SPHERE,    /*!< sphere */
+    };
+
+    /* Query region. Both shapes are stored as a center and half-widths (the radius
+       for a sphere) so that periodic wrapping reduces to the distance from the center */
+    struct region
+    {
+        enum region_type type;
+        double center[3];
+        double half[3];
+    };
+
+    /* Consecutive records [start, start + count) of the POS block that fall within one cell */
+    struct region_range
+    {
+        uint32_t start;
+        uint32_t count;
+    };
+
+    /* Coarse grid over the bounding box of the particles in one file. The runs of records
+       in cell c are ranges[cell_offsets[c]] ... ranges[cell_offsets[c+1]-1] */
+    struct region_cell_index
+    {
+        int ngrid;
+        int ordered;//0 -> too fragmented, the whole POS block has to be scanned
+        float min[3];
+        float max[3];
+        int64_t npart;
+        int64_t nranges;
+        int64_t *cell_offsets;
+        struct region_range *ranges;
+    };
+
+    extern int parse_region(const char *spec, const enum region_type type, struct region *r);
+    extern void print_region(FILE *fp, const struct region *r);
+
+    /* Selects the particles inside the region (with periodic wrapping if boxsize > 0).
+       The cell index of the file is read from (or written to) cachedir if cachedir is not
+       NULL. The positions are read from in_memblock if it is not NULL, otherwise from in_fd.
+       On return, *dest (the region slot of the workspace ws, re-used for the next file) contains
+       the (increasing) indices of the selected particles. Returns the number of selected particles (-1 on error) */
+    extern int64_t region_select_indices(const struct region *r, const double boxsize, const char *inputfile, const char *cachedir,
+                                         int in_fd, const char *in_memblock, const off_t pos_offset, const int64_t npart,
+                                         struct workspace *ws, uint32_t **dest);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,844 @@
+/* File: sampling.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include <inttypes.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "sampling.h"
+#include "macros.h"
+
+#if (SAMPLING_CHUNKSIZE % 64) != 0
+#error SAMPLING_CHUNKSIZE must be a multiple of 64 (the chunks of a bitmap are written in parallel)
+#endif
+
+static const char sampler_names[NUM_SAMPLERS][16] = {"vitter", "reference", "idhash"};
+
+int parse_sampler_type(const char *name, enum sampler_type *sampler)
+{
+  for(int i=0;i<NUM_SAMPLERS;i++) {
+	if(strcmp(name, sampler_names[i]) == 0) {
+	  *sampler = (enum sampler_type) i;
+	  return EXIT_SUCCESS;
+	}
+  }
+  fprintf(stderr,"Error: Unknown sampler = `%s'. Valid options are:",name);
+  for(int i=0;i<NUM_SAMPLERS;i++) {
+	fprintf(stderr," `%s'",sampler_names[i]);
+  }
+  fprintf(stderr,"\n");
+  return EXIT_FAILURE;
+}
+
+const char * sampler_type_name(const enum sampler_type sampler)
+{
+  if(sampler < 0 || sampler >= NUM_SAMPLERS) {
+	return "unknown";
+  }
+  return sampler_names[sampler];
+}
+
+/* Where a sampler writes the selected indices (generated in increasing order): dest[j] = offset + index
+   or, for a bitmap, the bit of (offset + index) is set */
+struct index_sink
+{
+  uint32_t *dest;
+  uint64_t *bitmap;
+  size_t offset;
+};
+
+static inline void sink_put(const struct index_sink *out, const size_t j, const size_t index)
+{
+  const size_t i = out->offset + index;
+  if(out->bitmap != NULL) {
+	out->bitmap[i >> 6] |= ((uint64_t) 1) << (i & 63);
+  } else {
+	out->dest[j] = (uint32_t) i;
+  }
+}
+
+static int gsl_ran_arr_sink(struct philox_stream *r, const struct index_sink *out, const size_t k, const size_t n);
+static int vitter_ran_arr_sink(struct philox_stream *r, const struct index_sink *out, const size_t k, const size_t n);
+
+static int random_subsample_sink(const enum sampler_type sampler, struct philox_stream *r, const struct index_sink *out, const size_t k, const size_t n)
+{
+  if(n > (size_t) UINT32_MAX + 1) {
+	fprintf(stderr,"Error: n = %zu items can not be indexed with 32 bits\n", n);
+	return EXIT_FAILURE;
+  }
+  switch(sampler)
+	{
+	case SAMPLER_VITTER:
+	  return vitter_ran_arr_sink(r, out, k, n);
+	case SAMPLER_REFERENCE:
+	  return gsl_ran_arr_sink(r, out, k, n);
+	case SAMPLER_IDHASH:
+	  fprintf(stderr,"Error: the id-hash sampler selects particles based on the particle IDs and does not generate k random indices\n");
+	  return EXIT_FAILURE;
+	default:
+	  fprintf(stderr,"Error: sampler = %d is not implemented\n",sampler);
+	  return EXIT_FAILURE;
+	}
+}
+
+int random_subsample_indices(const enum sampler_type sampler, struct philox_stream *r, uint32_t *dest, const size_t k, const size_t n)
+{
+  const struct index_sink out = {.dest = dest, .bitmap = NULL, .offset = 0};
+  return random_subsample_sink(sampler, r, &out, k, n);
+}
+
+/* Selects k out of n indices in chunks of SAMPLING_CHUNKSIZE indices. The number selected in
+   every chunk comes from a multivariate hypergeometric split of k and each chunk is sampled with
+   its own stream (seed, chunk, level) -> the chunks are selected in parallel (as tasks) and the
+   result does not depend on the number of threads */
+static int random_subsample_chunked_sink(const enum sampler_type sampler, const uint64_t seed, const uint32_t level, const struct index_sink *out,
+										 const size_t k, const size_t n)
+{
+  if(k > n) {
+	fprintf(stderr,"k=%zu is greater than n=%zu. Cannot sample more than n items\n", k, n);
+	return EXIT_FAILURE;
+  }
+  const int64_t nchunks = (n + SAMPLING_CHUNKSIZE - 1)/SAMPLING_CHUNKSIZE;
+  if(nchunks <= 1) {
+	struct philox_stream r;
+	philox_stream_init(&r, seed, 0, level);
+	return random_subsample_sink(sampler, &r, out, k, n);
+  }
+  XRETURN(nchunks <= INT_MAX, EXIT_FAILURE, "Number of chunks = %"PRId64" is too large\n", nchunks);
+
+  int64_t *counts = malloc(2 * nchunks * sizeof(*counts));
+  XRETURN(counts != NULL, EXIT_FAILURE, "Could not allocate memory for %"PRId64" chunks\n", nchunks);
+  int64_t *offsets = counts + nchunks;
+  for(int64_t c=0;c<nchunks;c++) {
+	offsets[c] = (n - c*SAMPLING_CHUNKSIZE) < SAMPLING_CHUNKSIZE ? (int64_t) (n - c*SAMPLING_CHUNKSIZE):SAMPLING_CHUNKSIZE;
+  }
+  int status = multivariate_hypergeometric_split(seed, level, (int) nchunks, offsets, (int64_t) k, counts);
+  if(status != EXIT_SUCCESS) {
+	free(counts);
+	return status;
+  }
+  //the selected indices of every chunk follow the ones of the previous chunks
+  int64_t offset = 0;
+  for(int64_t c=0;c<nchunks;c++) {
+	offsets[c] = offset;
+	offset += counts[c];
+  }
+
+#ifdef _OPENMP
+#pragma omp taskloop grainsize(1) shared(status)
+#endif
+  for(int64_t c=0;c<nchunks;c++) {
+	const size_t start = c*SAMPLING_CHUNKSIZE;
+	const size_t nc = (n - start) < SAMPLING_CHUNKSIZE ? (n - start):SAMPLING_CHUNKSIZE;
+	struct philox_stream r;
+	philox_stream_init(&r, seed, (uint32_t) c, level);
+	const struct index_sink chunk_out = {.dest = out->dest != NULL ? out->dest + offsets[c]:NULL, .bitmap = out->bitmap, .offset = out->offset + start};
+	const int chunk_status = random_subsample_sink(sampler, &r, &chunk_out, counts[c], nc);
+	if(chunk_status != EXIT_SUCCESS) {
+#ifdef _OPENMP
+#pragma omp atomic write
+#endif
+	  status = chunk_status;
+	}
+  }
+  free(counts);
+  return status;
+}
+
+int random_subsample_chunked_indices(const enum sampler_type sampler, const uint64_t seed, const uint32_t level, uint32_t *dest,
+									 const size_t k, const size_t n)
+{
+  const struct index_sink out = {.dest = dest, .bitmap = NULL, .offset = 0};
+  return random_subsample_chunked_sink(sampler, seed, level, &out, k, n);
+}
+
+/* Same selection as random_subsample_chunked_indices, written as the bits of the selected indices
+   in bitmap (n bits, cleared first). The chunks start at multiples of 64 -> every chunk sets the
+   bits of its own words */
+int random_subsample_chunked_bitmap(const enum sampler_type sampler, const uint64_t seed, const uint32_t level, uint64_t *bitmap,
+									const size_t k, const size_t n)
+{
+  memset(bitmap, 0, ((n + 63)/64) * sizeof(*bitmap));
+  const struct index_sink out = {.dest = NULL, .bitmap = bitmap, .offset = 0};
+  return random_subsample_chunked_sink(sampler, seed, level, &out, k, n);
+}
+
+/* Replaces the (increasing) ranks with the positions of the rank-th set bits of the bitmap */
+static void bitmap_ranks_to_indices(const uint64_t *bitmap, uint32_t *ranks, const size_t nranks)
+{
+  size_t word = 0;
+  size_t nbefore = 0;//set bits in the words before `word'
+  for(size_t j=0;j<nranks;j++) {
+	size_t nset = __builtin_popcountll(bitmap[word]);
+	while(nbefore + nset <= ranks[j]) {
+	  nbefore += nset;
+	  word++;
+	  nset = __builtin_popcountll(bitmap[word]);
+	}
+	uint64_t w = bitmap[word];
+	for(size_t skip=ranks[j]-nbefore;skip>0;skip--) {
+	  w &= w - 1;//clear the lowest set bit
+	}
+	ranks[j] = (uint32_t) (word*64 + __builtin_ctzll(w));
+  }
+}
+
+/* Nested selection: k[0] out of n indices for the first level, and then k[l] out of the
+   k[l-1] indices of the previous level. Every level is a subset of the previous one and
+   remains in increasing order. If bitmap is not NULL, the first level is written to the
+   bitmap (n bits) instead of dest[0] */
+int random_subsample_nested_indices(const enum sampler_type sampler, const uint64_t seed, const int nlevels, uint64_t *bitmap, uint32_t **dest,
+									const size_t *k, const size_t n)
+{
+  int status = bitmap != NULL ? random_subsample_chunked_bitmap(sampler, seed, 0, bitmap, k[0], n):
+	random_subsample_chunked_indices(sampler, seed, 0, dest[0], k[0], n);
+  for(int l=1;l<nlevels && status == EXIT_SUCCESS;l++) {
+	if(k[l] > k[l-1]) {
+	  fprintf(stderr,"Error: Level %d requests %zu indices, more than the %zu indices in level %d\n", l, k[l], k[l-1], l-1);
+	  return EXIT_FAILURE;
+	}
+	//select positions within the previous level and then map them back to particle indices
+	status = random_subsample_chunked_indices(sampler, seed, (uint32_t) l, dest[l], k[l], k[l-1]);
+	if(status == EXIT_SUCCESS && l == 1 && bitmap != NULL) {
+	  bitmap_ranks_to_indices(bitmap, dest[l], k[l]);
+	  continue;
+	}
+	for(size_t j=0;j<k[l] && status == EXIT_SUCCESS;j++) {
+	  dest[l][j] = dest[l-1][dest[l][j]];
+	}
+  }
+  return status;
+}
+
+
+/* The finalizer from MurmurHash3 (fmix64) -> every input bit affects every output bit */
+static inline uint64_t fmix64(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/* splitmix64 -> the stream of random numbers used by one split of the multivariate hypergeometric draw */
+static inline uint64_t splitmix64_next(uint64_t *state)
+{
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/* Uniform in the open interval (0, 1) */
+static inline double splitmix64_uniform(uint64_t *state)
+{
+  return ((splitmix64_next(state) >> 11) + 0.5) * 0x1.0p-53;
+}
+
+static inline double log_factorial(const int64_t k)
+{
+  int sign;
+  return lgamma_r((double) k + 1.0, &sign);
+}
+
+/* Number of `good' items among `sample' items drawn (without replacement) from good + bad items.
+   Small samples are drawn one item at a time, larger ones with the ratio-of-uniforms method of
+   Stadlober (HRUA, as used by numpy) -> O(1) expected time, independent of the sample size */
+static int64_t hypergeometric_draw(const int64_t good, const int64_t bad, const int64_t sample, uint64_t *state)
+{
+  const int64_t total = good + bad;
+  if(sample <= 0 || good <= 0) {
+	return 0;
+  }
+  if(sample >= total) {
+	return good;
+  }
+  if(sample < 10 || sample > total - 10) {
+	const int64_t computed_sample = sample > total/2 ? total - sample:sample;
+	int64_t remaining_total = total, remaining_good = good;
+	for(int64_t i=0;i<computed_sample && remaining_good > 0 && remaining_total > remaining_good;i++) {
+	  remaining_total--;
+	  const uint64_t r = (uint64_t) (((unsigned __int128) splitmix64_next(state) * (uint64_t) (remaining_total + 1)) >> 64);
+	  if(r < (uint64_t) remaining_good) {
+		remaining_good--;
+	  }
+	}
+	if(remaining_total == remaining_good) {
+	  //only good items are left -> the rest of the sample is good
+	  int64_t ndrawn = total - remaining_total;
+	  remaining_good -= (computed_sample - ndrawn);
+	}
+	return sample > total/2 ? remaining_good:good - remaining_good;
+  }
+
+  const double D1 = 1.7155277699214135, D2 = 0.8989161620588988;
+  const int64_t computed_sample = sample < total - sample ? sample:total - sample;
+  const int64_t mingoodbad = good < bad ? good:bad;
+  const int64_t maxgoodbad = good < bad ? bad:good;
+  const double p = mingoodbad/(double) total;
+  const double q = maxgoodbad/(double) total;
+  const double a = computed_sample*p + 0.5;
+  const double var = (double) (total - computed_sample) * computed_sample * p * q/(total - 1);
+  const double c = sqrt(var + 0.5);
+  const double h = D1*c + D2;
+  const int64_t m = (int64_t) floor((double) (computed_sample + 1) * (mingoodbad + 1)/(total + 2));
+  const double g = log_factorial(m) + log_factorial(mingoodbad - m) + log_factorial(computed_sample - m) +
+	log_factorial(maxgoodbad - computed_sample + m);
+  const double min_sample = computed_sample < mingoodbad ? computed_sample:mingoodbad;
+  const double b = (min_sample + 1) < floor(a + 16*c) ? (min_sample + 1):floor(a + 16*c);
+  int64_t k;
+  while(1) {
+	const double u = splitmix64_uniform(state);
+	const double v = splitmix64_uniform(state);
+	const double x = a + h*(v - 0.5)/u;
+	if(x < 0.0 || x >= b) {
+	  continue;
+	}
+	k = (int64_t) floor(x);
+	const double t = g - (log_factorial(k) + log_factorial(mingoodbad - k) + log_factorial(computed_sample - k) +
+						  log_factorial(maxgoodbad - computed_sample + k));
+	if(u*(4.0 - u) - 3.0 <= t) {
+	  break;
+	}
+	if(u*(u - t) >= 1.0) {
+	  continue;
+	}
+	if(2.0*log(u) <= t) {
+	  break;
+	}
+  }
+  if(good > bad) {
+	k = computed_sample - k;
+  }
+  if(computed_sample < sample) {
+	k = good - k;
+  }
+  return k;
+}
+
+/* Splits the n items drawn from the bins [lo, hi) between the two halves of the range. Every
+   split has its own random stream (keyed by the range) -> the result does not depend on the
+   order in which the splits run */
+static void multivariate_hypergeometric_range(const uint64_t key, const int64_t *prefix, const int lo, const int hi, const int64_t n, int64_t *counts)
+{
+  if(hi - lo == 1) {
+	counts[lo] = n;
+	return;
+  }
+  const int mid = lo + (hi - lo)/2;
+  uint64_t state = key ^ fmix64((((uint64_t) lo) << 32) | (uint64_t) hi);
+  const int64_t nleft = hypergeometric_draw(prefix[mid] - prefix[lo], prefix[hi] - prefix[mid], n, &state);
+#ifdef _OPENMP
+#pragma omp task if(mid - lo > MVHYPER_TASK_NBINS)
+#endif
+  multivariate_hypergeometric_range(key, prefix, lo, mid, nleft, counts);
+  multivariate_hypergeometric_range(key, prefix, mid, hi, n - nleft, counts);
+}
+
+int multivariate_hypergeometric_split(const uint64_t seed, const uint64_t stream, const int nbins, const int64_t *sizes, const int64_t n,
+									  int64_t *counts)
+{
+  if(nbins <= 0) {
+	fprintf(stderr,"Error: Number of bins = %d must be positive\n", nbins);
+	return EXIT_FAILURE;
+  }
+  int64_t *prefix = malloc((nbins + 1) * sizeof(*prefix));
+  if(prefix == NULL) {
+	fprintf(stderr,"Error: Could not allocate memory for the prefix sum of %d bins\n", nbins);
+	return EXIT_FAILURE;
+  }
+  prefix[0] = 0;
+  for(int i=0;i<nbins;i++) {
+	prefix[i+1] = prefix[i] + sizes[i];
+  }
+  if(n < 0 || n > prefix[nbins]) {
+	fprintf(stderr,"Error: Can not draw %"PRId64" items out of %"PRId64"\n", n, prefix[nbins]);
+	free(prefix);
+	return EXIT_FAILURE;
+  }
+  const uint64_t key = fmix64(idhash_key(seed) + stream);
+#ifdef _OPENMP
+  if(omp_in_parallel()) {
+	//e.g., the chunks of one file inside the file loop -> the tasks go to the enclosing team
+#pragma omp taskgroup
+	multivariate_hypergeometric_range(key, prefix, 0, nbins, n, counts);
+  } else {
+#pragma omp parallel
+#pragma omp single
+	multivariate_hypergeometric_range(key, prefix, 0, nbins, n, counts);
+  }
+#else
+  multivariate_hypergeometric_range(key, prefix, 0, nbins, n, counts);
+#endif
+  free(prefix);
+  return EXIT_SUCCESS;
+}
+
+
+/* Copied straight from https://fossies.org/dox/gsl-2.2.1/shuffle_8c_source.html*/
+/* Adapted to generate array indices. The returned random indices are in increasing order */
+static int gsl_ran_arr_sink(struct philox_stream *r, const struct index_sink *out, const size_t k, const size_t n)
+{
+  /* Choose k out of n items, return an array x[] of the k items.
+      These items will preserve the relative order of the original
+      input -- you can use shuffle() to randomize the output if you
+      wish */
+ 
+  if (k > n) {
+	fprintf(stderr,"k=%zu is greater than n=%zu. Cannot sample more than n items\n",
+			k, n);
+	return EXIT_FAILURE;
+  }
+  if(k == n) {
+	for(size_t i=0;i<n;i++) {
+	  sink_put(out, i, i);
+	}
+  } else {
+	size_t j=0;
+	for (size_t i = 0; i < n && j < k; i++) {
+	  if ((n - i) * philox_uniform (r) < k - j) {
+		sink_put(out, j, i);
+		j++ ;
+	  }
+	}
+  }
+ 
+  return EXIT_SUCCESS;
+}
+
+int gsl_ran_arr_index (struct philox_stream * r, uint32_t * dest, const size_t k, const size_t n)
+{
+  const struct index_sink out = {.dest = dest, .bitmap = NULL, .offset = 0};
+  return gsl_ran_arr_sink(r, &out, k, n);
+}
+
+
+/* Vitter's Algorithm A: used by Algorithm D once the number of remaining
+   items is small compared to the number still to be selected. Selects k out of
+   the n items starting at index `start' (as the j-th and following selected items) */
+static void vitter_method_a(struct philox_stream *r, const struct index_sink *out, size_t j, size_t k, size_t n, size_t start)
+{
+  double top = (double) n - (double) k;
+  double nreal = (double) n;
+  size_t curr = start;
+  while(k >= 2) {
+	const double v = philox_uniform(r);
+	size_t skip = 0;
+	double quot = top/nreal;
+	while(quot > v) {
+	  skip++;
+	  top -= 1.0;
+	  nreal -= 1.0;
+	  quot = (quot * top)/nreal;
+	}
+	curr += skip;
+	sink_put(out, j++, curr++);
+	nreal -= 1.0;
+	k--;
+  }
+
+  //the last one
+  size_t skip = (size_t) floor(nreal * philox_uniform(r));
+  sink_put(out, j, curr + skip);
+}
+
+
+/* Vitter's Algorithm D (J.S. Vitter, ACM Trans. Math. Softw., 13(1), 58-67, 1987).
+   Instead of testing every one of the n items, the number of items to skip over
+   before the next selected item is drawn directly. Only O(k) random variates are
+   required and the selected indices are generated in increasing order. */
+static int vitter_ran_arr_sink(struct philox_stream *r, const struct index_sink *out, const size_t k, const size_t n)
+{
+  if (k > n) {
+	fprintf(stderr,"k=%zu is greater than n=%zu. Cannot sample more than n items\n",
+			k, n);
+	return EXIT_FAILURE;
+  }
+  if(k == 0) {
+	return EXIT_SUCCESS;
+  }
+  if(k == n) {
+	for(size_t i=0;i<n;i++) {
+	  sink_put(out, i, i);
+	}
+	return EXIT_SUCCESS;
+  }
+
+  /* Vitter recommends switching to Algorithm A when k > n/alpha with alpha ~ 13 */
+  const double negalphainv = -13.0;
+  size_t nleft = n;                   //items remaining (N in Vitter)
+  size_t kleft = k;                   //items yet to be selected (n in Vitter)
+  double nreal = (double) nleft;
+  double kreal = (double) kleft;
+  double kinv = 1.0/kreal;
+  double vprime = exp(log(philox_uniform(r)) * kinv);
+  size_t qu1 = nleft - kleft + 1;
+  double qu1real = nreal - kreal + 1.0;
+  double threshold = -negalphainv * kreal;
+  size_t curr = 0;
+  size_t j = 0;                       //items already selected
+
+  while(kleft > 1 && threshold < nreal) {
+	const double kmin1inv = 1.0/(kreal - 1.0);
+	size_t skip;
+	while(1) {
+	  double x;
+	  //Step D2: generate U and X
+	  while(1) {
+		x = nreal * (1.0 - vprime);
+		skip = (size_t) x;
+		if(skip < qu1) {
+		  break;
+		}
+		vprime = exp(log(philox_uniform(r)) * kinv);
+	  }
+	  const double u = philox_uniform(r);
+	  const double negskipreal = -(double) skip;
+
+	  //Step D3: accept the skip if U <= h(skip)/c*g(X)
+	  const double y1 = exp(log(u * nreal/qu1real) * kmin1inv);
+	  vprime = y1 * (1.0 - x/nreal) * (qu1real/(negskipreal + qu1real));
+	  if(vprime <= 1.0) {
+		break;
+	  }
+
+	  //Step D4: accept the skip if U <= f(skip)/c*g(X)
+	  double y2 = 1.0;
+	  double top = nreal - 1.0;
+	  double bottom;
+	  size_t limit;
+	  if(kleft - 1 > skip) {
+		bottom = nreal - kreal;
+		limit = nleft - skip;
+	  } else {
+		bottom = nreal + negskipreal - 1.0;
+		limit = qu1;
+	  }
+	  for(size_t t=nleft-1;t>=limit;t--) {
+		y2 = (y2 * top)/bottom;
+		top -= 1.0;
+		bottom -= 1.0;
+	  }
+	  if(nreal/(nreal - x) >= y1 * exp(log(y2) * kmin1inv)) {
+		vprime = exp(log(philox_uniform(r)) * kmin1inv);
+		break;
+	  }
+	  vprime = exp(log(philox_uniform(r)) * kinv);
+	}
+
+	//Step D5: skip over `skip' items and select the next one
+	curr += skip;
+	sink_put(out, j++, curr++);
+	nleft -= skip + 1;
+	nreal = (double) nleft;
+	kleft--;
+	kreal -= 1.0;
+	kinv = kmin1inv;
+	qu1 -= skip;
+	qu1real -= (double) skip;
+	threshold += negalphainv;
+  }
+
+  if(kleft > 1) {
+	vitter_method_a(r, out, j, kleft, nleft, curr);
+  } else {
+	//only one item left to select
+	const size_t skip = (size_t) (nreal * vprime);
+	sink_put(out, j, curr + skip);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int vitter_ran_arr_index(struct philox_stream * r, uint32_t * dest, const size_t k, const size_t n)
+{
+  const struct index_sink out = {.dest = dest, .bitmap = NULL, .offset = 0};
+  return vitter_ran_arr_sink(r, &out, k, n);
+}
+
+
+/* Expands the user-supplied seed into the key for the ID hash (the splitmix64 step) */
+uint64_t idhash_key(const uint64_t seed)
+{
+  uint64_t z = seed + 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/* A particle is kept when hash <= threshold, i.e., with probability `fraction' */
+uint64_t idhash_threshold(const double fraction)
+{
+  if(fraction >= 1.0) {
+	return UINT64_MAX;
+  }
+  const double t = ldexp(fraction, 64);
+  return (t >= 1.0) ? ((uint64_t) t) - 1 : 0;
+}
+
+
+/* Applies the id-hash selection to nids IDs (each id_bytes wide). The (index_offset + i)
+   values of the selected particles are written to dest (in increasing order) unless
+   dest is NULL. Returns the number of selected particles, or -1 on error.
+   Same as idhash_select_levels with a single level */
+int64_t idhash_select(const void *ids, const size_t id_bytes, const int64_t nids, const uint64_t key, const uint64_t threshold,
+                      const size_t index_offset, uint32_t *dest)
+{
+  int64_t nselected = 0;
+  uint32_t *level_dest[1] = {dest};
+  if(idhash_select_levels(ids, id_bytes, nids, key, 1, &threshold, index_offset, dest != NULL ? level_dest:NULL, &nselected) != EXIT_SUCCESS) {
+	return -1;
+  }
+  return nselected;
+}
+
+
+/* ID-hash selection for nested fractions (thresholds in non-increasing order). A particle
+   kept at level l is also kept at every level before l. nselected[l] is incremented for
+   every selected particle and, unless dest is NULL, the index is stored at dest[l][nselected[l]]
+   -> can be called repeatedly on consecutive blocks of IDs.
+
+   The hashes are computed in blocks of IDHASH_CHUNKSIZE -> that loop has no branches
+   and can be vectorized by the compiler. The levels are assigned afterwards */
+int idhash_select_levels(const void *ids, const size_t id_bytes, const int64_t nids, const uint64_t key, const int nlevels,
+                         const uint64_t *thresholds, const size_t index_offset, uint32_t **dest, int64_t *nselected)
+{
+  if(id_bytes != 4 && id_bytes != 8) {
+	fprintf(stderr,"Error: ID bytes = %zu must be either 4 or 8\n",id_bytes);
+	return EXIT_FAILURE;
+  }
+
+  uint64_t hash[IDHASH_CHUNKSIZE];
+  for(int64_t i=0;i<nids;i+=IDHASH_CHUNKSIZE) {
+	const int64_t n = (nids - i) > IDHASH_CHUNKSIZE ? IDHASH_CHUNKSIZE:(nids - i);
+	if(id_bytes == 4) {
+	  const uint32_t *id32 = ((const uint32_t *) ids) + i;
+	  for(int64_t j=0;j<n;j++) {
+		hash[j] = fmix64(((uint64_t) id32[j]) ^ key);
+	  }
+	} else {
+	  const uint64_t *id64 = ((const uint64_t *) ids) + i;
+	  for(int64_t j=0;j<n;j++) {
+		hash[j] = fmix64(id64[j] ^ key);
+	  }
+	}
+
+	for(int64_t j=0;j<n;j++) {
+	  for(int l=0;l<nlevels && hash[j] <= thresholds[l];l++) {
+		if(dest != NULL) {
+		  dest[l][nselected[l]] = index_offset + i + j;
+		}
+		nselected[l]++;
+	  }
+	}
+  }
+
+  return EXIT_SUCCESS;
+}
+
+
+/* Keeps the indices in a that are also in b (both in increasing order) -> a is
+   overwritten in place. Returns the number of indices kept */
+int64_t intersect_sorted_indices(uint32_t *a, const int64_t na, const uint32_t *b, const int64_t nb)
+{
+  int64_t n = 0, j = 0;
+  for(int64_t i=0;i<na;i++) {
+	while(j < nb && b[j] < a[i]) {
+	  j++;
+	}
+	if(j == nb) {
+	  break;
+	}
+	if(b[j] == a[i]) {
+	  a[n++] = a[i];
+	}
+  }
+  return n;
+}
+
+static const char selection_type_names[NUM_SELECTION_TYPES][16] = {"runs", "indices", "bitmap"};
+
+const char * selection_type_name(const enum selection_type type)
+{
+  if(type < 0 || type >= NUM_SELECTION_TYPES) {
+	return "unknown";
+  }
+  return selection_type_names[type];
+}
+
+int64_t coalesce_sorted_indices(const uint32_t *indices, const int64_t nindices, struct selection_run *runs)
+{
+  int64_t nruns = 0;
+  for(int64_t i=0;i<nindices;) {
+	int64_t j = i + 1;
+	while(j < nindices && indices[j] == indices[j-1] + 1) {
+	  j++;
+	}
+	if(runs != NULL) {
+	  runs[nruns].start = indices[i];
+	  runs[nruns].count = (uint32_t) (j - i);
+	}
+	nruns++;
+	i = j;
+  }
+  return nruns;
+}
+
+size_t plan_selection(struct selection *s, const uint32_t *indices, const int64_t npart, const int64_t nparent)
+{
+  memset(s, 0, sizeof(*s));
+  s->npart = npart;
+  s->nparent = nparent;
+  s->nruns = coalesce_sorted_indices(indices, npart, NULL);
+
+  //the runs only replace the indices if the selection is clustered. A bitmap built from the
+  //indices would only add to them -> the bitmap is written by the sampler (plan_bitmap_selection)
+  s->type = SELECTION_INDICES;
+  const struct selection runs = {.type = SELECTION_RUNS, .npart = npart, .nparent = nparent, .nruns = s->nruns};
+  if(selection_bytes(&runs) < selection_bytes(s)) {
+	s->type = SELECTION_RUNS;
+	return selection_bytes(s);
+  }
+  return 0;
+}
+
+size_t plan_bitmap_selection(struct selection *s, const int64_t npart, const int64_t nparent)
+{
+  const struct selection bitmap = {.type = SELECTION_BITMAP, .npart = npart, .nparent = nparent};
+  const struct selection indices = {.type = SELECTION_INDICES, .npart = npart, .nparent = nparent};
+  if(selection_bytes(&bitmap) >= selection_bytes(&indices)) {
+	return 0;
+  }
+  *s = bitmap;
+  return selection_bytes(s);
+}
+
+void build_bitmap_selection(struct selection *s, uint64_t *bitmap)
+{
+  s->bitmap = bitmap;
+  //a run starts at every set bit whose previous bit is clear
+  s->nruns = 0;
+  uint64_t carry = 0;
+  for(int64_t w=0;w<(s->nparent + 63)/64;w++) {
+	s->nruns += __builtin_popcountll(bitmap[w] & ~((bitmap[w] << 1) | carry));
+	carry = bitmap[w] >> 63;
+  }
+}
+
+void build_selection(struct selection *s, uint32_t *indices, void *storage)
+{
+  switch(s->type)
+	{
+	case SELECTION_INDICES:
+	  s->indices = indices;
+	  break;
+	case SELECTION_RUNS:
+	  s->runs = (struct selection_run *) storage;
+	  coalesce_sorted_indices(indices, s->npart, s->runs);
+	  break;
+	default:
+	  break;
+	}
+}
+
+size_t selection_bytes(const struct selection *s)
+{
+  switch(s->type)
+	{
+	case SELECTION_RUNS:
+	  return s->nruns * sizeof(struct selection_run);
+	case SELECTION_INDICES:
+	  return s->npart * sizeof(uint32_t);
+	case SELECTION_BITMAP:
+	  return ((s->nparent + 63)/64) * sizeof(uint64_t);
+	default:
+	  return 0;
+	}
+}
+
+/* First bit >= pos that is set (set == 1) or clear (set == 0); n if there is none */
+static int64_t bitmap_find(const uint64_t *bitmap, int64_t pos, const int64_t n, const int set)
+{
+  while(pos < n) {
+	const uint64_t word = set ? bitmap[pos >> 6]:~bitmap[pos >> 6];
+	const uint64_t w = word >> (pos & 63);
+	if(w != 0) {
+	  pos += __builtin_ctzll(w);
+	  break;
+	}
+	pos = (pos | 63) + 1;
+  }
+  return pos < n ? pos:n;
+}
+
+size_t selection_peek_run(const struct selection *s, struct selection_cursor *c, size_t *start)
+{
+  switch(s->type)
+	{
+	case SELECTION_RUNS:
+	  if(c->pos >= s->nruns) {
+		return 0;
+	  }
+	  *start = s->runs[c->pos].start + c->offset;
+	  return s->runs[c->pos].count - c->offset;
+	case SELECTION_INDICES:
+	  {
+		if(c->pos >= s->npart) {
+		  return 0;
+		}
+		int64_t j = c->pos + 1;
+		while(j < s->npart && s->indices[j] == s->indices[j-1] + 1) {
+		  j++;
+		}
+		*start = s->indices[c->pos];
+		return (size_t) (j - c->pos);
+	  }
+	case SELECTION_BITMAP:
+	  {
+		//pos is moved to the next selected particle
+		c->pos = bitmap_find(s->bitmap, c->pos, s->nparent, 1);
+		if(c->pos >= s->nparent) {
+		  return 0;
+		}
+		*start = (size_t) c->pos;
+		return (size_t) (bitmap_find(s->bitmap, c->pos, s->nparent, 0) - c->pos);
+	  }
+	default:
+	  return 0;
+	}
+}
+
+void selection_advance(const struct selection *s, struct selection_cursor *c, const size_t n)
+{
+  if(s->type == SELECTION_RUNS) {
+	c->offset += n;
+	if(c->pos < s->nruns && c->offset == s->runs[c->pos].count) {
+	  c->pos++;
+	  c->offset = 0;
+	}
+  } else {
+	c->pos += n;
+  }
+}
+
+void selection_skip(const struct selection *s, struct selection_cursor *c, size_t n)
+{
+  if(s->type == SELECTION_INDICES) {
+	c->pos += n;
+	return;
+  }
+  size_t start, count;
+  while(n > 0 && (count = selection_peek_run(s, c, &start)) > 0) {
+	count = count < n ? count:n;
+	selection_advance(s, c, count);
+	n -= count;
+  }
+}
@@ -0,0 +1,138 @@
+/* File: sampling.h */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "philox.h"
+
+/* Maximum number of nested fractions that can be written in one run */
+#ifndef MAX_SUBSAMPLE_LEVELS
+#define MAX_SUBSAMPLE_LEVELS  16
+#endif
+
+/* Ranges of fewer bins are split serially by the multivariate hypergeometric draw */
+#ifndef MVHYPER_TASK_NBINS
+#define MVHYPER_TASK_NBINS  64
+#endif
+
+/* Number of particle indices per (parallel) chunk of the vitter and reference samplers. Every
+   chunk is sampled with its own random stream -> changing the chunk size changes the selection */
+#ifndef SAMPLING_CHUNKSIZE
+#define SAMPLING_CHUNKSIZE  (1 << 20)
+#endif
+
+/* Number of IDs hashed per block by the id-hash sampler */
+#ifndef IDHASH_CHUNKSIZE
+#define IDHASH_CHUNKSIZE  4096
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* Algorithms to select k out of n particle indices (returned in increasing order) */
+    enum sampler_type
+    {
+        SAMPLER_VITTER=0,     /*!< Vitter's sequential sampling (Algorithm D) -> O(k) random variates */
+        SAMPLER_REFERENCE,    /*!< Selection sampling, as in gsl (Algorithm S) -> O(n) random variates */
+        SAMPLER_IDHASH,       /*!< Keeps a particle if a keyed hash of its ID falls below the fraction -> stateless */
+        NUM_SAMPLERS
+    };
+
+    /* A run of `count' consecutive selected indices, starting at `start'. The selection is
+       copied as runs -> one read/iovec/memcpy per run instead of one per record */
+    struct selection_run
+    {
+        uint32_t start;
+        uint32_t count;
+    };
+
+    /* Storage for the selected indices of one file (npart is an int32_t in the header -> 32 bits suffice) */
+    enum selection_type
+    {
+        SELECTION_RUNS=0,     /*!< runs of consecutive indices -> 8 bytes per run (clustered or nearly complete selections) */
+        SELECTION_INDICES,    /*!< 32-bit indices -> 4 bytes per selected particle (small fractions) */
+        SELECTION_BITMAP,     /*!< one bit for every particle in the file, written by the sampler instead of the indices (large fractions) */
+        NUM_SELECTION_TYPES
+    };
+
+    struct selection
+    {
+        enum selection_type type;
+        int64_t npart;//number of selected particles
+        int64_t nparent;//number of particles in the file
+        int64_t nruns;//number of runs of consecutive indices (for every type)
+        struct selection_run *runs;
+        uint32_t *indices;
+        uint64_t *bitmap;
+    };
+
+    /* Position within a selection: the run (runs), the rank (indices) or the particle (bitmap) and,
+       for runs, the number of records of that run before the position */
+    struct selection_cursor
+    {
+        int64_t pos;
+        size_t offset;
+    };
+
+    extern int parse_sampler_type(const char *name, enum sampler_type *sampler);
+    extern const char * sampler_type_name(const enum sampler_type sampler);
+    extern int random_subsample_indices(const enum sampler_type sampler, struct philox_stream *r, uint32_t *dest, const size_t k, const size_t n);
+    extern int random_subsample_chunked_indices(const enum sampler_type sampler, const uint64_t seed, const uint32_t level, uint32_t *dest,
+                                                const size_t k, const size_t n);
+    extern int random_subsample_chunked_bitmap(const enum sampler_type sampler, const uint64_t seed, const uint32_t level, uint64_t *bitmap,
+                                               const size_t k, const size_t n);
+    extern int random_subsample_nested_indices(const enum sampler_type sampler, const uint64_t seed, const int nlevels, uint64_t *bitmap,
+                                               uint32_t **dest, const size_t *k, const size_t n);
+
+    /* Exact split of n items drawn (without replacement) from nbins bins of sizes[i] items -> counts[i]
+       follows the multivariate hypergeometric distribution. The bins are split recursively as tasks (run
+       by the enclosing team if called inside a parallel region, otherwise by a new one), and the result
+       only depends on (seed, stream, sizes, n) and not on the number of threads */
+    extern int multivariate_hypergeometric_split(const uint64_t seed, const uint64_t stream, const int nbins, const int64_t *sizes,
+                                                 const int64_t n, int64_t *counts);
+
+    extern int gsl_ran_arr_index(struct philox_stream * r, uint32_t * dest, const size_t k, const size_t n);
+    extern int vitter_ran_arr_index(struct philox_stream * r, uint32_t * dest, const size_t k, const size_t n);
+
+    /* ID-hash selection: the decision for a particle depends only on (seed, ID, fraction) */
+    extern uint64_t idhash_key(const uint64_t seed);
+    extern uint64_t idhash_threshold(const double fraction);
+    extern int64_t idhash_select(const void *ids, const size_t id_bytes, const int64_t nids, const uint64_t key, const uint64_t threshold,
+                                 const size_t index_offset, uint32_t *dest);
+    extern int idhash_select_levels(const void *ids, const size_t id_bytes, const int64_t nids, const uint64_t key, const int nlevels,
+                                    const uint64_t *thresholds, const size_t index_offset, uint32_t **dest, int64_t *nselected);
+    extern int64_t intersect_sorted_indices(uint32_t *a, const int64_t na, const uint32_t *b, const int64_t nb);
+
+    /* Coalesces the (sorted, unique) indices into runs of consecutive indices. Returns the number of runs
+       (only counts them if runs is NULL) */
+    extern int64_t coalesce_sorted_indices(const uint32_t *indices, const int64_t nindices, struct selection_run *runs);
+
+    /* Picks the runs or the indices (whichever is smaller) for npart (sorted, unique) indices out of nparent
+       particles. Returns the bytes of storage that build_selection needs (0 -> the indices are used in place) */
+    extern size_t plan_selection(struct selection *s, const uint32_t *indices, const int64_t npart, const int64_t nparent);
+    /* Builds the planned selection in storage. The selection does not own any memory -> the
+       indices and the storage must outlive it */
+    extern void build_selection(struct selection *s, uint32_t *indices, void *storage);
+    /* The bitmap is only used if the sampler writes it in place of the indices: returns the bytes of the
+       bitmap for npart out of nparent particles, or 0 (s is not changed) if the indices are smaller.
+       build_bitmap_selection then takes the bitmap filled by the sampler */
+    extern size_t plan_bitmap_selection(struct selection *s, const int64_t npart, const int64_t nparent);
+    extern void build_bitmap_selection(struct selection *s, uint64_t *bitmap);
+    extern size_t selection_bytes(const struct selection *s);
+    extern const char * selection_type_name(const enum selection_type type);
+
+    /* The selection is read as runs, starting from a zeroed cursor: selection_peek_run returns the
+       number of records left in the run at the cursor (0 at the end) and sets start to the first
+       of them; selection_advance then moves the cursor forward by (at most that many) n records.
+       selection_skip moves the cursor forward by n records across runs */
+    extern size_t selection_peek_run(const struct selection *s, struct selection_cursor *c, size_t *start);
+    extern void selection_advance(const struct selection *s, struct selection_cursor *c, const size_t n);
+    extern void selection_skip(const struct selection *s, struct selection_cursor *c, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,182 @@
+/* File: snapshot_layout.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "snapshot_layout.h"
+#include "utils.h"
+
+#define SNAPSHOT_LAYOUT_MAGIC    "SGLAYOUT"
+#define SNAPSHOT_LAYOUT_VERSION  1
+
+/* The cache is a raw dump of the layout of every file -> only valid on the same
+   machine/compiler, which is checked through the size of each entry */
+struct snapshot_layout_cache_header
+{
+  char magic[8];
+  int32_t version;
+  int32_t entry_bytes;
+  int32_t nfiles;
+  int32_t unused;
+  char basename[MAXLEN];
+};
+
+/* Returns the number of cached files (0 if the cache does not exist or can not be used) */
+static int read_snapshot_layout_cache(const char *cachefile, const char *basename, struct gadget_file_layout **cached)
+{
+  struct snapshot_layout_cache_header hdr;
+  *cached = NULL;
+  FILE *fp = fopen(cachefile, "r");
+  if(fp == NULL) {
+    return 0;
+  }
+  int nfiles = 0;
+  if(fread(&hdr, sizeof(hdr), 1, fp) == 1 &&
+     memcmp(hdr.magic, SNAPSHOT_LAYOUT_MAGIC, sizeof(hdr.magic)) == 0 &&
+     hdr.version == SNAPSHOT_LAYOUT_VERSION &&
+     hdr.entry_bytes == (int32_t) sizeof(struct gadget_file_layout) &&
+     hdr.nfiles > 0 &&
+     strncmp(hdr.basename, basename, MAXLEN) == 0) {
+    *cached = calloc(hdr.nfiles, sizeof(**cached));
+    if(*cached != NULL && fread(*cached, sizeof(**cached), hdr.nfiles, fp) == (size_t) hdr.nfiles) {
+      nfiles = hdr.nfiles;
+    }
+  }
+  fclose(fp);
+  if(nfiles == 0) {
+    fprintf(stderr,"Warning: Ignoring the snapshot layout cache `%s' (not a cache for `%s' or incompatible)\n", cachefile, basename);
+    free(*cached);
+    *cached = NULL;
+  }
+  return nfiles;
+}
+
+/* Written to a temporary file first so that an interrupted write never leaves a truncated cache behind */
+static int write_snapshot_layout_cache(const char *cachefile, const char *basename, const struct snapshot_layout *layout)
+{
+  struct snapshot_layout_cache_header hdr;
+  char tmpfile[MAXLEN];
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, SNAPSHOT_LAYOUT_MAGIC, sizeof(hdr.magic));
+  hdr.version = SNAPSHOT_LAYOUT_VERSION;
+  hdr.entry_bytes = sizeof(struct gadget_file_layout);
+  hdr.nfiles = layout->nfiles;
+  strncpy(hdr.basename, basename, MAXLEN-1);
+  my_snprintf(tmpfile, MAXLEN, "%s.tmp", cachefile);
+
+  FILE *fp = my_fopen(tmpfile, "w");
+  if(fp == NULL) {
+    return EXIT_FAILURE;
+  }
+  int status = EXIT_SUCCESS;
+  if(my_fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+     my_fwrite(layout->files, sizeof(layout->files[0]), layout->nfiles, fp) != (size_t) layout->nfiles) {
+    status = EXIT_FAILURE;
+  }
+  if(fclose(fp) != 0 || status != EXIT_SUCCESS || rename(tmpfile, cachefile) != 0) {
+    fprintf(stderr,"Error: Could not write the snapshot layout cache `%s'\n", cachefile);
+    perror(NULL);
+    remove(tmpfile);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/* Takes the layout from the cached entry if the size and mtime of the file match, otherwise
+   scans the file. Returns 1 if the file was scanned, 0 if the cached entry was used (-1 on error) */
+static int get_gadget_file_layout(const char *fname, const struct gadget_file_layout *cached, struct gadget_file_layout *layout)
+{
+  struct stat sb;
+  if(stat(fname, &sb) != 0) {
+    fprintf(stderr,"Error: Could not stat snapshot file `%s'\n", fname);
+    perror(NULL);
+    return -1;
+  }
+  if(cached != NULL && cached->file_size == (int64_t) sb.st_size &&
+     cached->mtime_sec == (int64_t) sb.st_mtim.tv_sec && cached->mtime_nsec == (int64_t) sb.st_mtim.tv_nsec) {
+    *layout = *cached;
+    return 0;
+  }
+
+  memset(layout, 0, sizeof(*layout));
+  if(build_gadget_block_index(fname, &(layout->index)) != EXIT_SUCCESS) {
+    return -1;
+  }
+  layout->id_bytes = get_gadget_id_bytes_from_index(&(layout->index));
+  layout->file_size = sb.st_size;
+  layout->mtime_sec = sb.st_mtim.tv_sec;
+  layout->mtime_nsec = sb.st_mtim.tv_nsec;
+  return 1;
+}
+
+int build_snapshot_layout(const char *basename, const char *cachefile, struct snapshot_layout *layout)
+{
+  struct gadget_file_layout *cached = NULL;
+  char fname[MAXLEN];
+  layout->nfiles = 0;
+  layout->nscanned = 0;
+  layout->files = NULL;
+  const int ncached = cachefile != NULL ? read_snapshot_layout_cache(cachefile, basename, &cached):0;
+
+  //the number of files is in the header of the first file
+  struct gadget_file_layout first;
+  my_snprintf(fname, MAXLEN, "%s.%d", basename, 0);
+  int scanned = get_gadget_file_layout(fname, ncached > 0 ? &cached[0]:NULL, &first);
+  if(scanned < 0) {
+    free(cached);
+    return EXIT_FAILURE;
+  }
+  const int nfiles = first.index.header.num_files > 0 ? first.index.header.num_files:1;
+  layout->files = calloc(nfiles, sizeof(*(layout->files)));
+  if(layout->files == NULL) {
+    fprintf(stderr,"Error: Could not allocate memory for the layout of %d files\n", nfiles);
+    free(cached);
+    return EXIT_FAILURE;
+  }
+  layout->nfiles = nfiles;
+  layout->files[0] = first;
+  int nscanned = scanned, errorflag = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) private(fname) reduction(+:nscanned)
+#endif
+  for(int ifile=1;ifile<nfiles;ifile++) {
+    if(errorflag == 0) {
+      my_snprintf(fname, MAXLEN, "%s.%d", basename, ifile);
+      const int status = get_gadget_file_layout(fname, ifile < ncached ? &cached[ifile]:NULL, &(layout->files[ifile]));
+      if(status < 0) {
+#ifdef _OPENMP
+#pragma omp atomic write
+#endif
+        errorflag = 1;
+      } else {
+        nscanned += status;
+      }
+    }
+  }
+  free(cached);
+  layout->nscanned = nscanned;
+  if(errorflag != 0) {
+    free_snapshot_layout(layout);
+    return EXIT_FAILURE;
+  }
+
+  if(cachefile != NULL && (nscanned > 0 || ncached != nfiles)) {
+    //a stale cache is not fatal -> only costs a re-scan on the next run
+    write_snapshot_layout_cache(cachefile, basename, layout);
+  }
+  return EXIT_SUCCESS;
+}
+
+void free_snapshot_layout(struct snapshot_layout *layout)
+{
+  free(layout->files);
+  layout->files = NULL;
+  layout->nfiles = 0;
+}
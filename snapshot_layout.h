@@ -0,0 +1,41 @@
+/* File: snapshot_layout.h */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "gadget_utils.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* Everything needed to subsample one file of the snapshot without re-reading its header */
+    struct gadget_file_layout
+    {
+        struct gadget_block_index index;//block offsets and the header
+        size_t id_bytes;
+        int64_t file_size;//size and modification time -> key for the on-disk cache
+        int64_t mtime_sec;
+        int64_t mtime_nsec;
+    };
+
+    /* Layout of every file <basename>.<i> of a snapshot */
+    struct snapshot_layout
+    {
+        int nfiles;
+        int nscanned;//number of files that were scanned (the rest came from the cache)
+        struct gadget_file_layout *files;
+    };
+
+    /* Scans all of the files (in parallel) to fill the layout. If cachefile is not NULL, the
+       layout of every file whose size and mtime match the cached entry is taken from the
+       cache, and the cache is re-written if any file had to be scanned */
+    extern int build_snapshot_layout(const char *basename, const char *cachefile, struct snapshot_layout *layout);
+    extern void free_snapshot_layout(struct snapshot_layout *layout);
+
+#ifdef __cplusplus
+}
+#endif
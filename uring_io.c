@@ -0,0 +1,352 @@
+/* File: uring_io.c */
+
+#ifdef USE_IO_URING
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring_io.h"
+
+int uring_init(struct uring *ring, const unsigned entries)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+  if(ring->fd < 0) {
+	fprintf(stderr,"Error: Could not setup io_uring with %u entries\n", entries);
+	perror(NULL);
+	return EXIT_FAILURE;
+  }
+
+  ring->sq_entries = p.sq_entries;
+  ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if(p.features & IORING_FEAT_SINGLE_MMAP) {
+	//both the rings are in one mapping
+	if(ring->cq_len > ring->sq_len) {
+	  ring->sq_len = ring->cq_len;
+	}
+	ring->cq_len = ring->sq_len;
+  }
+  ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if(ring->sq_ptr == MAP_FAILED) {
+	perror(NULL);
+	close(ring->fd);
+	return EXIT_FAILURE;
+  }
+  if(p.features & IORING_FEAT_SINGLE_MMAP) {
+	ring->cq_ptr = ring->sq_ptr;
+  } else {
+	ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	if(ring->cq_ptr == MAP_FAILED) {
+	  perror(NULL);
+	  munmap(ring->sq_ptr, ring->sq_len);
+	  close(ring->fd);
+	  return EXIT_FAILURE;
+	}
+  }
+  ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if(ring->sqes == MAP_FAILED) {
+	perror(NULL);
+	uring_exit(ring);
+	return EXIT_FAILURE;
+  }
+
+  char *sq = (char *) ring->sq_ptr;
+  char *cq = (char *) ring->cq_ptr;
+  ring->sq_head  = (unsigned *) (sq + p.sq_off.head);
+  ring->sq_tail  = (unsigned *) (sq + p.sq_off.tail);
+  ring->sq_mask  = (unsigned *) (sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+  ring->cq_head  = (unsigned *) (cq + p.cq_off.head);
+  ring->cq_tail  = (unsigned *) (cq + p.cq_off.tail);
+  ring->cq_mask  = (unsigned *) (cq + p.cq_off.ring_mask);
+  ring->cqes     = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  ring->sqe_tail = *(ring->sq_tail);
+
+  return EXIT_SUCCESS;
+}
+
+void uring_exit(struct uring *ring)
+{
+  if(ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+	munmap(ring->sqes, ring->sqes_len);
+  }
+  if(ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr) {
+	munmap(ring->cq_ptr, ring->cq_len);
+  }
+  if(ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED) {
+	munmap(ring->sq_ptr, ring->sq_len);
+  }
+  close(ring->fd);
+  ring->fd = -1;
+}
+
+//returns NULL if the submission queue is full
+struct io_uring_sqe * uring_get_sqe(struct uring *ring)
+{
+  const unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if(ring->sqe_tail - head >= ring->sq_entries) {
+	return NULL;
+  }
+  const unsigned index = ring->sqe_tail & *(ring->sq_mask);
+  ring->sq_array[index] = index;
+  ring->sqe_tail++;
+  struct io_uring_sqe *sqe = &(ring->sqes[index]);
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+void uring_prep_rw(struct io_uring_sqe *sqe, const int op, const int fd, void *buf, const size_t nbytes, const off_t offset, const uint64_t user_data)
+{
+  sqe->opcode = (uint8_t) op;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t) (uintptr_t) buf;
+  sqe->len = (uint32_t) nbytes;
+  sqe->off = (uint64_t) offset;
+  sqe->user_data = user_data;
+}
+
+//submits all the prepared sqes and waits for (at least) wait_nr completions
+int uring_submit_and_wait(struct uring *ring, const unsigned wait_nr)
+{
+  const unsigned tail = *(ring->sq_tail);
+  const unsigned to_submit = ring->sqe_tail - tail;
+  __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+  if(to_submit == 0 && wait_nr == 0) {
+	return EXIT_SUCCESS;
+  }
+  const unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS:0;
+  long ret;
+  do {
+	ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr, flags, NULL, 0);
+  } while(ret < 0 && errno == EINTR);
+  if(ret < 0) {
+	fprintf(stderr,"Error in io_uring_enter while submitting %u requests\n", to_submit);
+	perror(NULL);
+	return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+//returns NULL if there are no completions available
+struct io_uring_cqe * uring_peek_cqe(struct uring *ring)
+{
+  const unsigned head = *(ring->cq_head);
+  const unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  if(head == tail) {
+	return NULL;
+  }
+  return &(ring->cqes[head & *(ring->cq_mask)]);
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+  __atomic_store_n(ring->cq_head, *(ring->cq_head) + 1, __ATOMIC_RELEASE);
+}
+
+
+enum uring_buffer_state
+{
+  URING_BUF_FREE=0,
+  URING_BUF_READING,
+  URING_BUF_WRITING
+};
+
+struct uring_buffer
+{
+  char *data;
+  size_t nrec;//number of records that will be read into this buffer
+  size_t nqueued;//number of records queued so far
+  size_t reads_pending;
+  off_t out_offset;
+  enum uring_buffer_state state;
+};
+
+/* Every request in flight has a slot (its index is the user_data) with what is still to be
+   transferred -> a short read or write is resubmitted for the remainder */
+struct uring_request
+{
+  char *data;
+  size_t nbytes;
+  off_t offset;
+  int fd;
+  int buf;
+  int is_write;
+};
+
+size_t uring_staging_bytes(const unsigned queue_depth)
+{
+  const size_t nslots = (size_t) queue_depth + URING_NBUFS;
+  return (size_t) URING_NBUFS*URING_BUFSIZE + nslots*(sizeof(struct uring_request) + sizeof(unsigned));
+}
+
+//queues the (rest of the) request in slot -> flushes the queued requests first if the submission queue is full
+static int uring_queue_request(struct uring *ring, const struct uring_request *requests, const unsigned slot)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if(sqe == NULL) {
+	if(uring_submit_and_wait(ring, 0) != EXIT_SUCCESS) {
+	  return EXIT_FAILURE;
+	}
+	sqe = uring_get_sqe(ring);
+  }
+  if(sqe == NULL) {
+	fprintf(stderr,"Error: io_uring submission queue is unexpectedly full\n");
+	return EXIT_FAILURE;
+  }
+  const struct uring_request *req = &requests[slot];
+  uring_prep_rw(sqe, req->is_write ? IORING_OP_WRITE:IORING_OP_READ, req->fd, req->data, req->nbytes, req->offset, slot);
+  return EXIT_SUCCESS;
+}
+
+
+int uring_gather_records(struct uring *ring, char *staging, const int in_fd, const int out_fd, const off_t in_offset,
+                         const off_t out_offset, const size_t itemsize, const struct selection *sel, const unsigned queue_depth)
+{
+  const size_t nrecords = (size_t) sel->npart;
+  if(nrecords == 0) {
+	return EXIT_SUCCESS;
+  }
+  const size_t nrec_per_buf = URING_BUFSIZE/itemsize;
+  if(nrec_per_buf == 0 || queue_depth == 0) {
+	fprintf(stderr,"Error: io_uring buffer size = %d bytes must hold at least one record (%zu bytes) and queue depth = %u must be > 0\n",
+			URING_BUFSIZE, itemsize, queue_depth);
+	return EXIT_FAILURE;
+  }
+
+  //the extra entries guarantee there is always space to queue the writes
+  const unsigned nslots = queue_depth + URING_NBUFS;
+  if(ring->sq_entries < nslots) {
+	fprintf(stderr,"Error: io_uring with %u entries can not keep %u reads and %d writes in flight\n", ring->sq_entries, queue_depth, URING_NBUFS);
+	return EXIT_FAILURE;
+  }
+
+  //the staging area holds the buffers, then the request slots and the stack of free slots
+  struct uring_buffer bufs[URING_NBUFS];
+  memset(bufs, 0, sizeof(bufs));
+  for(int b=0;b<URING_NBUFS;b++) {
+	bufs[b].data = staging + (size_t) b*URING_BUFSIZE;
+  }
+  struct uring_request *requests = (struct uring_request *) (staging + (size_t) URING_NBUFS*URING_BUFSIZE);
+  unsigned *free_slots = (unsigned *) (requests + nslots);
+  unsigned nfree = nslots;
+  for(unsigned i=0;i<nslots;i++) {
+	free_slots[i] = nslots - 1 - i;
+  }
+
+  int status = EXIT_SUCCESS;
+  size_t next = 0;//rank of the next record to be read
+  struct selection_cursor cursor = {.pos = 0, .offset = 0};
+  unsigned inflight = 0;
+  int curr = -1;//buffer that is being filled
+  while(status == EXIT_SUCCESS) {
+	//queue reads for the selected records
+	while(status == EXIT_SUCCESS && next < nrecords && inflight < queue_depth) {
+	  if(curr < 0) {
+		for(int b=0;b<URING_NBUFS;b++) {
+		  if(bufs[b].state == URING_BUF_FREE) {
+			curr = b;
+			break;
+		  }
+		}
+		if(curr < 0) {
+		  break;//all buffers are busy -> wait for a write to complete
+		}
+		struct uring_buffer *buf = &bufs[curr];
+		buf->nrec = (nrecords - next) > nrec_per_buf ? nrec_per_buf:(nrecords - next);
+		buf->nqueued = 0;
+		buf->reads_pending = 0;
+		buf->out_offset = out_offset + next*itemsize;
+		buf->state = URING_BUF_READING;
+	  }
+	  struct uring_buffer *buf = &bufs[curr];
+	  //one read for (the part of) the run that fits into this buffer
+	  size_t start;
+	  size_t n = selection_peek_run(sel, &cursor, &start);
+	  n = n < (buf->nrec - buf->nqueued) ? n:(buf->nrec - buf->nqueued);
+	  const unsigned slot = free_slots[--nfree];
+	  requests[slot] = (struct uring_request) {.data = buf->data + buf->nqueued*itemsize, .nbytes = n*itemsize,
+											   .offset = in_offset + start*itemsize, .fd = in_fd, .buf = curr, .is_write = 0};
+	  status = uring_queue_request(ring, requests, slot);
+	  if(status != EXIT_SUCCESS) {
+		break;
+	  }
+	  selection_advance(sel, &cursor, n);
+	  next += n;
+	  buf->nqueued += n;
+	  buf->reads_pending++;
+	  inflight++;
+	  if(buf->nqueued == buf->nrec) {
+		curr = -1;
+	  }
+	}
+
+	if(inflight == 0 || status != EXIT_SUCCESS) {
+	  break;//all done
+	}
+	status = uring_submit_and_wait(ring, 1);
+
+	//reap the completions
+	struct io_uring_cqe *cqe;
+	while(status == EXIT_SUCCESS && (cqe = uring_peek_cqe(ring)) != NULL) {
+	  const unsigned slot = (unsigned) cqe->user_data;
+	  const int res = cqe->res;
+	  uring_cqe_seen(ring);
+	  struct uring_request *req = &requests[slot];
+	  if(res == -EINTR || res == -EAGAIN || (res > 0 && (size_t) res < req->nbytes)) {
+		//short (or interrupted) transfer -> the rest goes out as a new request in the same slot
+		if(res > 0) {
+		  req->data += res;
+		  req->nbytes -= res;
+		  req->offset += res;
+		}
+		status = uring_queue_request(ring, requests, slot);
+		inflight -= (status != EXIT_SUCCESS);
+		continue;
+	  }
+	  inflight--;
+	  free_slots[nfree++] = slot;
+	  if(res <= 0) {
+		fprintf(stderr,"Error: io_uring %s: expected to transfer %zu bytes at offset %jd but %s %d\n", req->is_write ? "write":"read",
+				req->nbytes, (intmax_t) req->offset, res < 0 ? "failed with error":"transferred", res < 0 ? -res:res);
+		status = EXIT_FAILURE;
+		continue;
+	  }
+	  struct uring_buffer *buf = &bufs[req->buf];
+	  if(req->is_write) {
+		buf->state = URING_BUF_FREE;
+		continue;
+	  }
+	  buf->reads_pending--;
+	  if(buf->reads_pending == 0 && buf->nqueued == buf->nrec) {
+		//every record for this buffer has arrived -> write the buffer out
+		const unsigned wslot = free_slots[--nfree];
+		requests[wslot] = (struct uring_request) {.data = buf->data, .nbytes = buf->nrec*itemsize, .offset = buf->out_offset,
+												  .fd = out_fd, .buf = req->buf, .is_write = 1};
+		status = uring_queue_request(ring, requests, wslot);
+		buf->state = URING_BUF_WRITING;
+		inflight += (status == EXIT_SUCCESS);
+	  }
+	}
+  }
+
+  //wait for anything still in flight (only after an error) before the buffers are re-used
+  while(inflight > 0 && uring_submit_and_wait(ring, 1) == EXIT_SUCCESS) {
+	while(inflight > 0 && uring_peek_cqe(ring) != NULL) {
+	  uring_cqe_seen(ring);
+	  inflight--;
+	}
+  }
+  return status;
+}
+
+#endif//USE_IO_URING
@@ -0,0 +1,65 @@
+/* File: uring_io.h */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+
+#include "sampling.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* Size (in bytes) of each staging buffer used by uring_gather_records */
+#ifndef URING_BUFSIZE
+#define URING_BUFSIZE  (1024*1024)
+#endif
+
+    /* Number of staging buffers -> reads into one buffer overlap with the write of another */
+#ifndef URING_NBUFS
+#define URING_NBUFS  4
+#endif
+
+    /* Minimal io_uring wrapper (talks to the kernel directly, does not require liburing) */
+    struct uring
+    {
+        int fd;
+        unsigned sq_entries;
+        unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+        void *sq_ptr, *cq_ptr;
+        size_t sq_len, cq_len, sqes_len;
+        unsigned sqe_tail;//local tail -> sqes that have been prepared but not yet submitted
+    };
+
+    extern int uring_init(struct uring *ring, const unsigned entries);
+    extern void uring_exit(struct uring *ring);
+    extern struct io_uring_sqe * uring_get_sqe(struct uring *ring);
+    extern int uring_submit_and_wait(struct uring *ring, const unsigned wait_nr);
+    extern struct io_uring_cqe * uring_peek_cqe(struct uring *ring);
+    extern void uring_cqe_seen(struct uring *ring);
+    extern void uring_prep_rw(struct io_uring_sqe *sqe, const int op, const int fd, void *buf, const size_t nbytes, const off_t offset, const uint64_t user_data);
+
+    /* Copies the records (of itemsize bytes) of the selection from the field starting at in_offset
+       (in in_fd) into the consecutive locations starting at out_offset (in out_fd). Up to
+       queue_depth reads (one per run) are kept in flight; the filled staging buffers are
+       written asynchronously, and short reads and writes are resubmitted for the remainder. The ring
+       (with at least queue_depth + URING_NBUFS entries) and the staging area (uring_staging_bytes,
+       page-aligned: the URING_NBUFS buffers and the table of requests in flight) belong to the caller and
+       are re-used for every field -> the ring is empty again on success, but may still hold requests on error */
+    extern size_t uring_staging_bytes(const unsigned queue_depth);
+    extern int uring_gather_records(struct uring *ring, char *staging, const int in_fd, const int out_fd, const off_t in_offset,
+                                    const off_t out_offset, const size_t itemsize, const struct selection *sel, const unsigned queue_depth);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif//USE_IO_URING
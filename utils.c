@@ -21,6 +21,10 @@
 #include<limits.h>
 #include<stdarg.h>
 #include<unistd.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<sys/stat.h>
+#include<sys/mman.h>
 
 #include "macros.h"
 #include "utils.h"
@@ -923,3 +927,137 @@ int pread_pwrite_copy(int in_fd, int out_fd, off_t in_offset, off_t out_offset,
 
   return EXIT_SUCCESS;
 }
+
+//keeps calling pwrite until all nbytes have been written (or an error occurs)
+int pwrite_all(int out_fd, const void *buf, size_t nbytes, off_t out_offset)
+{
+  const char *src = (const char *) buf;
+  while(nbytes > 0) {
+	ssize_t bytes_written = pwrite(out_fd, src, nbytes, out_offset);
+	if(bytes_written <= 0) {
+	  fprintf(stderr,"Error in pwrite. Expected to write %zu bytes but wrote %zd bytes instead\n",nbytes, bytes_written);
+	  perror(NULL);
+	  return EXIT_FAILURE;
+	}
+	size_t bytes_transferred = (size_t) bytes_written;
+	nbytes -= bytes_transferred;
+	src += bytes_transferred;
+	out_offset += bytes_transferred;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+
+//copies nbytes inside the kernel with copy_file_range -> filesystems with reflinks share the
+//data blocks instead of copying them. Falls back to pread + pwrite through buf (bufsize bytes)
+//if the kernel (or the pair of filesystems) does not support it
+int copy_range_all(int in_fd, off_t in_offset, int out_fd, off_t out_offset, size_t nbytes, void *buf, size_t bufsize)
+{
+  while(nbytes > 0) {
+	ssize_t bytes_copied = copy_file_range(in_fd, &in_offset, out_fd, &out_offset, nbytes, 0);
+	if(bytes_copied < 0 && (errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP || errno == EINVAL)) {
+	  break;
+	}
+	if(bytes_copied <= 0) {
+	  fprintf(stderr,"Error in copy_file_range. Expected to copy %zu bytes but copied %zd bytes instead\n",nbytes, bytes_copied);
+	  perror(NULL);
+	  return EXIT_FAILURE;
+	}
+	nbytes -= (size_t) bytes_copied;
+  }
+  if(nbytes == 0) {
+	return EXIT_SUCCESS;
+  }
+
+  XRETURN(buf != NULL && bufsize > 0, EXIT_FAILURE, "No buffer to copy the remaining %zu bytes with pread + pwrite\n", nbytes);
+  int status = EXIT_SUCCESS;
+  while(nbytes > 0 && status == EXIT_SUCCESS) {
+	const size_t n = nbytes < bufsize ? nbytes:bufsize;
+	ssize_t bytes_read = pread(in_fd, buf, n, in_offset);
+	if(bytes_read <= 0) {
+	  fprintf(stderr,"Error in pread. Expected to read %zu bytes but read %zd bytes instead\n",n, bytes_read);
+	  perror(NULL);
+	  status = EXIT_FAILURE;
+	  break;
+	}
+	status = pwrite_all(out_fd, buf, (size_t) bytes_read, out_offset);
+	nbytes -= (size_t) bytes_read;
+	in_offset += bytes_read;
+	out_offset += bytes_read;
+  }
+  return status;
+}
+
+//number of bytes of the file that are currently resident in the page cache (-1 on error)
+int64_t get_pagecache_resident_bytes(const char *fname)
+{
+  int fd = open(fname, O_RDONLY);
+  if(fd < 0) {
+	return -1;
+  }
+  struct stat sb;
+  if(fstat(fd, &sb) < 0) {
+	close(fd);
+	return -1;
+  }
+  if(sb.st_size == 0) {
+	close(fd);
+	return 0;
+  }
+  void *addr = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(addr == MAP_FAILED) {
+	return -1;
+  }
+  const size_t pagesize = (size_t) sysconf(_SC_PAGESIZE);
+  const size_t npages = (sb.st_size + pagesize - 1)/pagesize;
+  unsigned char *vec = malloc(npages);
+  int64_t resident = -1;
+  if(vec != NULL && mincore(addr, sb.st_size, vec) == 0) {
+	resident = 0;
+	for(size_t i=0;i<npages;i++) {
+	  resident += (vec[i] & 1);
+	}
+	resident *= pagesize;
+  }
+  free(vec);
+  munmap(addr, sb.st_size);
+  return resident;
+}
+
+//asynchronously pull the entire file into the page cache (does not wait for the reads to complete)
+int prefetch_file(const char *fname)
+{
+  int fd = open(fname, O_RDONLY);
+  if(fd < 0) {
+	return EXIT_FAILURE;
+  }
+  int status = posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  close(fd);
+  return status == 0 ? EXIT_SUCCESS:EXIT_FAILURE;
+}
+
+/* Number of read and write system calls made so far by this process (all threads), from
+   /proc/self/io. Returns EXIT_FAILURE if the counters are not available */
+int get_io_syscalls(int64_t *syscr, int64_t *syscw)
+{
+  FILE *fp = fopen("/proc/self/io", "r");
+  if(fp == NULL) {
+	return EXIT_FAILURE;
+  }
+  char line[256];
+  int nfound = 0;
+  while(fgets(line, sizeof(line), fp) != NULL) {
+	long long value;
+	if(sscanf(line, "syscr: %lld", &value) == 1) {
+	  *syscr = value;
+	  nfound++;
+	} else if(sscanf(line, "syscw: %lld", &value) == 1) {
+	  *syscw = value;
+	  nfound++;
+	}
+  }
+  fclose(fp);
+  return nfound == 2 ? EXIT_SUCCESS:EXIT_FAILURE;
+}
@@ -8,6 +8,11 @@
 #include <time.h>
 #include <sys/types.h>
 
+/* Size (in bytes) of the buffer passed to copy_range_all, used when copy_file_range is not supported */
+#ifndef COPY_RANGE_BOUNCE_BUFSIZE
+#define COPY_RANGE_BOUNCE_BUFSIZE  (4*1024*1024)
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -19,6 +24,11 @@ extern size_t my_fwrite(void *ptr, size_t size, size_t nmemb, FILE *stream);
 extern size_t my_fread(void *ptr, size_t size, size_t nmemb, FILE *stream);
 extern int my_fseek(FILE *stream, long offset, int whence);
 extern int pread_pwrite_copy(int in_fd, int out_fd, off_t in_offset, off_t out_offset, size_t nbytes, void *buf);
+extern int pwrite_all(int out_fd, const void *buf, size_t nbytes, off_t out_offset);
+extern int copy_range_all(int in_fd, off_t in_offset, int out_fd, off_t out_offset, size_t nbytes, void *buf, size_t bufsize);
+extern int64_t get_pagecache_resident_bytes(const char *fname);
+extern int prefetch_file(const char *fname);
+extern int get_io_syscalls(int64_t *syscr, int64_t *syscw);
 //general utilities
 extern void get_max_float(const int64_t ND1, const float *cz1, float *czmax);
 extern void get_max_double(const int64_t ND1, const double *cz1, double *czmax);
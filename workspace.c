@@ -0,0 +1,132 @@
+/* File: workspace.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "workspace.h"
+#include "macros.h"
+
+static struct workspace *workspaces = NULL;
+static int nworkspaces = 0;
+
+int init_workspaces(const int nthreads)
+{
+  XRETURN(nthreads > 0, EXIT_FAILURE, "Number of threads = %d must be positive\n", nthreads);
+  workspaces = calloc(nthreads, sizeof(*workspaces));
+  XRETURN(workspaces != NULL, EXIT_FAILURE, "Could not allocate memory for %d workspaces\n", nthreads);
+  nworkspaces = nthreads;
+  return EXIT_SUCCESS;
+}
+
+struct workspace * thread_workspace(void)
+{
+#ifdef _OPENMP
+  const int tid = omp_get_thread_num();
+#else
+  const int tid = 0;
+#endif
+  if(tid >= nworkspaces) {
+    fprintf(stderr,"Error: No workspace for thread %d (only %d workspaces)\n", tid, nworkspaces);
+    return NULL;
+  }
+  return &workspaces[tid];
+}
+
+void * workspace_get(struct workspace *w, const enum workspace_slot slot, const size_t nbytes)
+{
+  if(w == NULL || slot < 0 || slot >= NUM_WORKSPACE_SLOTS) {
+    return NULL;
+  }
+  struct workspace_buffer *b = &(w->buffers[slot]);
+  w->nrequests++;
+  if(nbytes > b->size || b->ptr == NULL) {
+    const size_t size = ((nbytes + WORKSPACE_ALIGNMENT - 1)/WORKSPACE_ALIGNMENT + (nbytes == 0)) * WORKSPACE_ALIGNMENT;
+    void *ptr = NULL;
+    if(posix_memalign(&ptr, WORKSPACE_ALIGNMENT, size) != 0) {
+      fprintf(stderr,"Error: Could not allocate %zu bytes for workspace slot %d\n", size, (int) slot);
+      return NULL;
+    }
+    free(b->ptr);
+    w->bytes += size - b->size;
+    b->ptr = ptr;
+    b->size = size;
+    w->nallocs++;
+  }
+  return b->ptr;
+}
+
+int workspace_selection(struct workspace *w, const int level, struct selection *s, uint32_t *indices, const int64_t npart, const int64_t nparent)
+{
+  const size_t nbytes = plan_selection(s, indices, npart, nparent);
+  void *storage = NULL;
+  if(nbytes > 0) {
+    storage = workspace_get(w, WORKSPACE_SELECTIONS + level, nbytes);
+    XRETURN(storage != NULL, EXIT_FAILURE, "Could not allocate %zu bytes for the selection of %"PRId64" particles (as %s)\n",
+            nbytes, npart, selection_type_name(s->type));
+  }
+  build_selection(s, indices, storage);
+  return EXIT_SUCCESS;
+}
+
+#ifdef USE_IO_URING
+struct uring * workspace_uring(struct workspace *w, const unsigned entries)
+{
+  if(w == NULL) {
+    return NULL;
+  }
+  if(w->ring_entries >= entries) {
+    return &(w->ring);
+  }
+  workspace_release_uring(w);
+  if(uring_init(&(w->ring), entries) != EXIT_SUCCESS) {
+    return NULL;
+  }
+  w->ring_entries = entries;
+  w->nallocs++;
+  return &(w->ring);
+}
+
+void workspace_release_uring(struct workspace *w)
+{
+  if(w != NULL && w->ring_entries > 0) {
+    uring_exit(&(w->ring));
+    w->ring_entries = 0;
+  }
+}
+#endif
+
+void print_workspace_stats(FILE *fp)
+{
+  size_t max_bytes = 0, total_bytes = 0;
+  int64_t nrequests = 0, nallocs = 0;
+  for(int i=0;i<nworkspaces;i++) {
+    max_bytes = workspaces[i].bytes > max_bytes ? workspaces[i].bytes:max_bytes;
+    total_bytes += workspaces[i].bytes;
+    nrequests += workspaces[i].nrequests;
+    nallocs += workspaces[i].nallocs;
+  }
+  fprintf(fp,"subsample_Gadget> Workspaces: high-water = %0.3lf MB per thread (%0.3lf MB over %d threads). "
+          "%"PRId64" buffer requests needed %"PRId64" allocations\n",
+          max_bytes/(1024.0*1024.0), total_bytes/(1024.0*1024.0), nworkspaces, nrequests, nallocs);
+}
+
+void free_workspaces(void)
+{
+  for(int i=0;i<nworkspaces;i++) {
+    for(int slot=0;slot<NUM_WORKSPACE_SLOTS;slot++) {
+      free(workspaces[i].buffers[slot].ptr);
+    }
+#ifdef USE_IO_URING
+    workspace_release_uring(&workspaces[i]);
+#endif
+  }
+  free(workspaces);
+  workspaces = NULL;
+  nworkspaces = 0;
+}
@@ -0,0 +1,76 @@
+/* File: workspace.h */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "sampling.h"
+#include "uring_io.h"
+
+/* Alignment (in bytes) of every workspace buffer -> page-aligned */
+#ifndef WORKSPACE_ALIGNMENT
+#define WORKSPACE_ALIGNMENT  4096
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    enum workspace_slot
+    {
+        WORKSPACE_STAGING=0,     /*!< staging buffer of the pread, gather, fused, copy_range, io_uring and odirect strategies */
+        WORKSPACE_BOUNCE,        /*!< buffer of copy_range_all (only touched if copy_file_range is not supported) */
+        WORKSPACE_CURSORS,       /*!< first record of every chunk copied by the gather and fused strategies */
+        WORKSPACE_IOV,           /*!< iovecs of the writev strategy */
+        WORKSPACE_CHUNK_COUNTS,  /*!< per-chunk counts of the streaming id-hash selection */
+        WORKSPACE_CANDIDATES,    /*!< particles of the file whose IDs are in the --id-list */
+        WORKSPACE_REGION,        /*!< particles of the file inside the --box or --sphere */
+        WORKSPACE_INDICES,       /*!< selected indices of every level (MAX_SUBSAMPLE_LEVELS slots) */
+        WORKSPACE_SELECTIONS = WORKSPACE_INDICES + MAX_SUBSAMPLE_LEVELS, /*!< runs or bitmap of every level */
+        NUM_WORKSPACE_SLOTS = WORKSPACE_SELECTIONS + MAX_SUBSAMPLE_LEVELS
+    };
+
+    struct workspace_buffer
+    {
+        void *ptr;
+        size_t size;
+    };
+
+    /* The buffers of one thread. Created once and re-used for every file (and every
+       copy task) that the thread handles -> the buffers only grow, to the largest size requested */
+    struct workspace
+    {
+        struct workspace_buffer buffers[NUM_WORKSPACE_SLOTS];
+#ifdef USE_IO_URING
+        struct uring ring;//io_uring of the io_uring strategy (set up on first use)
+        unsigned ring_entries;//number of entries requested for the ring (0 -> not set up)
+#endif
+        size_t bytes;//total size of the buffers (the high-water mark)
+        int64_t nrequests;
+        int64_t nallocs;
+    };
+
+    /* Creates one workspace for each of nthreads threads */
+    extern int init_workspaces(const int nthreads);
+    /* Workspace of the calling (OpenMP) thread */
+    extern struct workspace * thread_workspace(void);
+    /* Returns the buffer in slot with at least nbytes (NULL on error). The contents are not kept if the buffer grows */
+    extern void * workspace_get(struct workspace *w, const enum workspace_slot slot, const size_t nbytes);
+    /* Stores npart (sorted, unique) indices of level as runs or indices (whichever is smaller) -> the
+       runs are built in the selection slot of the level, the indices are used in place */
+    extern int workspace_selection(struct workspace *w, const int level, struct selection *s, uint32_t *indices,
+                                   const int64_t npart, const int64_t nparent);
+#ifdef USE_IO_URING
+    /* Returns the io_uring of the thread with at least entries (NULL on error). The ring is only
+       set up again if more entries are needed */
+    extern struct uring * workspace_uring(struct workspace *w, const unsigned entries);
+    /* Tears down the ring (e.g., after an error left requests in it) -> the next call sets up a new one */
+    extern void workspace_release_uring(struct workspace *w);
+#endif
+    extern void print_workspace_stats(FILE *fp);
+    extern void free_workspaces(void);
+
+#ifdef __cplusplus
+}
+#endif